@@ -7,9 +7,15 @@
 #include <vector>
 #include <sstream>
 #include <algorithm>
-#include <mutex>
 #include <ctime>
 #include <iomanip>
+#include <climits>
+#include <new>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
 
 #pragma comment(lib, "ws2_32.lib")
 using namespace std;
@@ -19,30 +25,145 @@ bool g_prompt_confirmation = true; // Controls confirmation prompt for mget/mput
 SOCKET g_control_sockfd = INVALID_SOCKET; // Main control socket for FTP server
 bool g_is_binary_mode = true; // True for binary, false for ASCII. Default to binary.
 bool g_passive_mode_preference = true; // True for passive (PASV), false for active (PORT). Client only supports PASV.
+size_t g_transfer_buffer_size = 1024 * 1024; // Data connection buffer size in bytes, changed with "set bufsize"
+string g_log_filename = "ftp_client.txt"; // Log file, changed with "set logfile"
+
+// Limits for the transfer buffer size
+const size_t MIN_TRANSFER_BUFFER_SIZE = 4 * 1024;
+const size_t MAX_TRANSFER_BUFFER_SIZE = 64 * 1024 * 1024;
+const size_t TRANSFER_BUFFER_ALIGNMENT = 4096;
+
+// Log writer: write_to_log() moves the line into a lock-free bounded MPSC ring and returns; a
+// background thread drains the ring in batches, adds the timestamps and appends them to the log
+// file, which stays open while the logger runs
+class AsyncLogger {
+public:
+    explicit AsyncLogger(size_t capacity = 4096) : m_capacity(capacity), m_slots(new Slot[capacity]) {
+        for (size_t i = 0; i < m_capacity; i++) {
+            m_slots[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+    ~AsyncLogger() { stop(); }
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    // Open (or create) the log file for appending and start the writer thread
+    bool start(const string& filename) {
+        stop();
+        FILE* file = nullptr;
+        fopen_s(&file, filename.c_str(), "ab");
+        if (!file) return false;
+        m_file = file;
+        m_stopping.store(false);
+        m_writer = thread([this]() { run(); });
+        return true;
+    }
+
+    // Write everything queued so far, then stop the writer thread and close the file
+    void stop() {
+        if (!m_writer.joinable()) return;
+        m_stopping.store(true);
+        wake();
+        m_writer.join();
+        fclose(m_file);
+        m_file = nullptr;
+    }
+
+    bool running() const { return m_writer.joinable(); }
+
+    // Queue a line; waits for the writer only while the ring is full, so no line is lost
+    void log(string line) {
+        time_t now = time(nullptr);
+        size_t position = m_enqueue.load(memory_order_relaxed);
+        while (true) {
+            Slot& slot = m_slots[position % m_capacity];
+            long long lag = static_cast<long long>(slot.sequence.load(memory_order_acquire)) - static_cast<long long>(position);
+            if (lag == 0) {
+                if (m_enqueue.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    slot.time = now;
+                    slot.line = move(line);
+                    slot.sequence.store(position + 1, memory_order_release);
+                    break;
+                }
+            }
+            else {
+                if (lag < 0) {
+                    wake(); // Full: let the writer drain it
+                    this_thread::yield();
+                }
+                position = m_enqueue.load(memory_order_relaxed);
+            }
+        }
+        wake();
+    }
+
+private:
+    struct Slot {
+        atomic<size_t> sequence{ 0 }; // Equals the position when free, position + 1 when filled
+        time_t time = 0;
+        string line;
+    };
+
+    size_t m_capacity;
+    unique_ptr<Slot[]> m_slots;
+    atomic<size_t> m_enqueue{ 0 };
+    size_t m_dequeue = 0; // Only touched by the writer thread
+    atomic<unsigned> m_signal{ 0 }; // Bumped by producers to wake the writer
+    atomic<bool> m_stopping{ false };
+    thread m_writer;
+    FILE* m_file = nullptr;
+
+    void wake() {
+        m_signal.fetch_add(1, memory_order_release);
+        m_signal.notify_one();
+    }
+
+    void run() {
+        string batch;
+        time_t stampTime = -1;
+        char stamp[32] = {};
+        while (true) {
+            unsigned seen = m_signal.load(memory_order_acquire);
+            while (true) {
+                Slot& slot = m_slots[m_dequeue % m_capacity];
+                if (slot.sequence.load(memory_order_acquire) != m_dequeue + 1) break;
+                if (slot.time != stampTime) {
+                    struct tm timeinfo;
+                    localtime_s(&timeinfo, &slot.time);
+                    strftime(stamp, sizeof(stamp), "%a %b %e %H:%M:%S %Y", &timeinfo); // Same layout as ctime()
+                    stampTime = slot.time;
+                }
+                batch += "[";
+                batch += stamp;
+                batch += "] ";
+                batch += slot.line;
+                batch += "\n";
+                slot.line.clear();
+                slot.sequence.store(m_dequeue + m_capacity, memory_order_release);
+                m_dequeue++;
+            }
+            if (!batch.empty()) {
+                fwrite(batch.data(), 1, batch.size(), m_file);
+                fflush(m_file);
+                batch.clear();
+                continue;
+            }
+            if (m_stopping.load()) return;
+            m_signal.wait(seen, memory_order_acquire);
+        }
+    }
+};
 
-// Mutex for thread-safe logging
-mutex g_log_mutex;
+AsyncLogger g_logger;
 
 // Function to write to log file
 void write_to_log(const string& operation, const string& filename, const string& status, const string& details = "") {
-    lock_guard<mutex> lock(g_log_mutex);
-    ofstream log_file("D:\\ftp_client.txt", ios::app);
-    if (!log_file.is_open()) {
-        cerr << "Failed to open log file for writing.\n";
-        return;
-    }
-
-    auto now = time(nullptr);
-    string timestamp = ctime(&now);
-    timestamp.pop_back(); // Remove trailing newline
-
-    log_file << "[" << timestamp << "] " << operation << ": " << filename
-        << " - Status: " << status;
+    if (!g_logger.running()) return;
+    string line = operation + ": " + filename + " - Status: " + status;
     if (!details.empty()) {
-        log_file << " - Details: " << details;
+        line += " - Details: " + details;
     }
-    log_file << "\n";
-    log_file.close();
+    g_logger.log(move(line));
 }
 
 // Function prototypes for new commands
@@ -118,6 +239,121 @@ void sendCommand(int sockfd, const string& cmd) {
     }
 }
 
+// Page-aligned heap buffer used by the transfer engine
+class TransferBuffer {
+public:
+    explicit TransferBuffer(size_t size)
+        : m_size(size),
+          m_data(static_cast<char*>(::operator new[](size, std::align_val_t(TRANSFER_BUFFER_ALIGNMENT)))) {
+    }
+    ~TransferBuffer() {
+        ::operator delete[](m_data, std::align_val_t(TRANSFER_BUFFER_ALIGNMENT));
+    }
+    TransferBuffer(const TransferBuffer&) = delete;
+    TransferBuffer& operator=(const TransferBuffer&) = delete;
+
+    char* data() { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    size_t m_size;
+    char* m_data;
+};
+
+// Send the whole buffer, retrying on short writes
+bool send_all(SOCKET sock, const char* data, size_t length) {
+    while (length > 0) {
+        int chunk = static_cast<int>(min<size_t>(length, INT_MAX));
+        int sent = send(sock, data, chunk, 0);
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEINTR) continue;
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// Size the kernel send buffer of a data connection to match the transfer buffer. The receive
+// buffer is left to the kernel: set on a connected socket it can no longer widen the TCP window
+void tune_data_socket(SOCKET sock) {
+    int size = static_cast<int>(min<size_t>(g_transfer_buffer_size, 4 * 1024 * 1024));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&size), sizeof(size));
+}
+
+// Open a local file for a transfer; stdio buffering is disabled because the engine writes whole buffers
+FILE* open_transfer_file(const string& filename, const char* mode) {
+    FILE* file = nullptr;
+    fopen_s(&file, filename.c_str(), mode);
+    if (file) {
+        setvbuf(file, nullptr, _IONBF, 0);
+    }
+    return file;
+}
+
+// Drain a data connection into a file. Returns bytes written, or -1 on a socket or disk error
+long long transfer_socket_to_file(SOCKET dataSock, FILE* file, TransferBuffer& buffer) {
+    long long total = 0;
+    size_t filled = 0;
+    while (true) {
+        int chunk = static_cast<int>(min<size_t>(buffer.size() - filled, INT_MAX));
+        int received = recv(dataSock, buffer.data() + filled, chunk, 0);
+        if (received == SOCKET_ERROR && WSAGetLastError() == WSAEINTR) continue;
+        if (received > 0) {
+            filled += received;
+            if (filled < buffer.size()) continue;
+        }
+        // Flush when the buffer is full, the peer closed the connection or recv failed
+        if (filled > 0) {
+            if (fwrite(buffer.data(), 1, filled, file) != filled) return -1;
+            total += filled;
+            filled = 0;
+        }
+        if (received == 0) return total;
+        if (received < 0) return -1;
+    }
+}
+
+// Stream a file over a data connection. Returns bytes sent, or -1 on a socket or disk error
+long long transfer_file_to_socket(FILE* file, SOCKET dataSock, TransferBuffer& buffer) {
+    long long total = 0;
+    while (true) {
+        size_t n = fread(buffer.data(), 1, buffer.size(), file);
+        if (n > 0) {
+            if (!send_all(dataSock, buffer.data(), n)) return -1;
+            total += n;
+        }
+        if (n < buffer.size()) {
+            return ferror(file) ? -1 : total;
+        }
+    }
+}
+
+// Parse a size such as "65536", "256K" or "4M"
+bool parse_size(const string& text, size_t& size) {
+    if (text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) return false;
+    size_t pos = 0;
+    unsigned long long value = 0;
+    try {
+        value = stoull(text, &pos);
+    }
+    catch (const out_of_range&) {
+        return false;
+    }
+    string suffix = text.substr(pos);
+    transform(suffix.begin(), suffix.end(), suffix.begin(), ::toupper);
+    unsigned long long multiplier = 1;
+    if (suffix == "K" || suffix == "KB") multiplier = 1024;
+    else if (suffix == "M" || suffix == "MB") multiplier = 1024 * 1024;
+    else if (!suffix.empty()) return false;
+    if (value > ULLONG_MAX / multiplier) return false;
+    value *= multiplier;
+    if (value > SIZE_MAX) return false;
+    size = static_cast<size_t>(value);
+    return true;
+}
+
 // command "ls" : list all files in current directory
 void ftp_ls(int controlSock) {
     if (controlSock == INVALID_SOCKET) {
@@ -362,6 +598,7 @@ void ftp_get(int controlSock, const string& filename) {
         write_to_log("GET", filename, "Failed", "Could not open data connection");
         return;
     }
+    tune_data_socket(dataSock);
 
     string retrCmd = "RETR " + filename + "\r\n";
     send(controlSock, retrCmd.c_str(), static_cast<int>(retrCmd.length()), 0);
@@ -379,8 +616,7 @@ void ftp_get(int controlSock, const string& filename) {
         }
     }
 
-    FILE* file;
-    fopen_s(&file, filename.c_str(), "wb");
+    FILE* file = open_transfer_file(filename, "wb");
     if (!file) {
         cout << "Failed to open local file for writing.\n";
         write_to_log("GET", filename, "Failed", "Could not open local file");
@@ -388,11 +624,8 @@ void ftp_get(int controlSock, const string& filename) {
         return;
     }
 
-    size_t total_bytes = 0;
-    while ((bytesReceived = recv(dataSock, buffer, sizeof(buffer), 0)) > 0) {
-        fwrite(buffer, 1, bytesReceived, file);
-        total_bytes += bytesReceived;
-    }
+    TransferBuffer transferBuffer(g_transfer_buffer_size);
+    long long total_bytes = transfer_socket_to_file(dataSock, file, transferBuffer);
 
     fclose(file);
     closesocket(dataSock);
@@ -403,6 +636,12 @@ void ftp_get(int controlSock, const string& filename) {
         cout << "Server: " << buffer;
     }
 
+    if (total_bytes < 0) {
+        cout << "Download failed while receiving data: " << filename << endl;
+        write_to_log("GET", filename, "Failed", "Error while receiving or writing data");
+        return;
+    }
+
     cout << "File downloaded successfully: " << filename << endl;
     write_to_log("GET", filename, "Success", "Downloaded " + to_string(total_bytes) + " bytes");
 }
@@ -458,9 +697,9 @@ void ftp_put(int controlSock, const string& filename) {
         closesocket(clamSock);
         return;
     }
+    tune_data_socket(clamDataSock);
 
-    FILE* fileToScan;
-    fopen_s(&fileToScan, filename.c_str(), "rb");
+    FILE* fileToScan = open_transfer_file(filename, "rb");
     if (!fileToScan) {
         cout << "Cannot open file: " << filename << endl;
         write_to_log("ClamAV Scan", filename, "Failed", "Could not open file");
@@ -469,23 +708,17 @@ void ftp_put(int controlSock, const string& filename) {
         return;
     }
 
-    char fileBuffer[1024];
-    size_t total_bytes_scanned = 0;
-    while (!feof(fileToScan)) {
-        size_t n = fread(fileBuffer, 1, sizeof(fileBuffer), fileToScan);
-        if (n > 0) {
-            send(clamDataSock, fileBuffer, (int)n, 0);
-            total_bytes_scanned += n;
-        }
-    }
+    TransferBuffer transferBuffer(g_transfer_buffer_size);
+    long long total_bytes_scanned = transfer_file_to_socket(fileToScan, clamDataSock, transferBuffer);
 
     fclose(fileToScan);
     closesocket(clamDataSock);
 
     clamLen = recv(clamSock, clamBuffer, sizeof(clamBuffer) - 1, 0);
+    if (clamLen > 0) clamBuffer[clamLen] = '\0';
     closesocket(clamSock);
 
-    if (clamLen <= 0 || string(clamBuffer).find("OK") == string::npos) {
+    if (total_bytes_scanned < 0 || clamLen <= 0 || string(clamBuffer).find("OK") == string::npos) {
         cout << "ClamAV detected virus or scan failed. File not uploaded.\n";
         write_to_log("ClamAV Scan", filename, "Failed", "Scan result: " + string(clamBuffer));
         return; // Exit if ClamAV detects a virus or fails to scan
@@ -520,6 +753,7 @@ void ftp_put(int controlSock, const string& filename) {
         write_to_log("PUT", filename, "Failed", "Could not open data connection");
         return;
     }
+    tune_data_socket(dataSock);
 
     // Step 4: Send STOR command to initiate upload
     string storCmd = "STOR " + filename + "\r\n";
@@ -544,8 +778,7 @@ void ftp_put(int controlSock, const string& filename) {
     }
 
     // Step 5: Open file and upload data to FTP server
-    FILE* fileToUpload = nullptr;
-    fopen_s(&fileToUpload, filename.c_str(), "rb");
+    FILE* fileToUpload = open_transfer_file(filename, "rb");
     if (!fileToUpload) {
         cout << "Failed to open local file for FTP upload: " << filename << endl;
         write_to_log("PUT", filename, "Failed", "Could not open local file");
@@ -553,14 +786,7 @@ void ftp_put(int controlSock, const string& filename) {
         return;
     }
 
-    size_t total_bytes_uploaded = 0;
-    while (!feof(fileToUpload)) {
-        size_t bytes = fread(fileBuffer, 1, sizeof(fileBuffer), fileToUpload);
-        if (bytes > 0) {
-            send(dataSock, fileBuffer, (int)bytes, 0);
-            total_bytes_uploaded += bytes;
-        }
-    }
+    long long total_bytes_uploaded = transfer_file_to_socket(fileToUpload, dataSock, transferBuffer);
 
     fclose(fileToUpload);
     closesocket(dataSock);
@@ -577,6 +803,12 @@ void ftp_put(int controlSock, const string& filename) {
         write_to_log("PUT", filename, "Failed", "No final response after transfer");
     }
 
+    if (total_bytes_uploaded < 0) {
+        cout << "Upload failed while sending data: " << filename << endl;
+        write_to_log("PUT", filename, "Failed", "Error while reading or sending data");
+        return;
+    }
+
     cout << "File uploaded successfully: " << filename << endl;
     write_to_log("PUT", filename, "Success", "Uploaded " + to_string(total_bytes_uploaded) + " bytes");
 }
@@ -755,6 +987,8 @@ void ftp_status() {
     cout << "Transfer Mode: " << (g_is_binary_mode ? "BINARY" : "ASCII") << "\n";
     cout << "Passive Mode Preference: " << (g_passive_mode_preference ? "ON (Client will use PASV)" : "OFF (Client will attempt active mode, but not fully supported)") << "\n";
     cout << "Confirmation Prompt (mget/mput): " << (g_prompt_confirmation ? "ON" : "OFF") << "\n";
+    cout << "Transfer Buffer: " << g_transfer_buffer_size << " bytes\n";
+    cout << "Log File: " << g_log_filename << "\n";
     cout << "Local Directory: ";
     wchar_t path[MAX_PATH];
     if (GetCurrentDirectoryW(MAX_PATH, path)) {
@@ -783,6 +1017,44 @@ void ftp_passive_toggle() {
     write_to_log("Passive", "N/A", "Success", "Set to " + string(g_passive_mode_preference ? "ON" : "OFF"));
 }
 
+// set command: change a client option
+void ftp_set(const string& option, const string& value) {
+    if (option == "bufsize") {
+        size_t size = 0;
+        if (!parse_size(value, size) || size < MIN_TRANSFER_BUFFER_SIZE || size > MAX_TRANSFER_BUFFER_SIZE) {
+            cout << "Usage: set bufsize <bytes>[K|M] (between " << MIN_TRANSFER_BUFFER_SIZE / 1024 << "K and "
+                << MAX_TRANSFER_BUFFER_SIZE / (1024 * 1024) << "M)\n";
+            write_to_log("Set", "bufsize", "Failed", "Invalid value: " + value);
+            return;
+        }
+        // Round up to the buffer alignment so the buffer is a whole number of pages
+        size = (size + TRANSFER_BUFFER_ALIGNMENT - 1) / TRANSFER_BUFFER_ALIGNMENT * TRANSFER_BUFFER_ALIGNMENT;
+        g_transfer_buffer_size = size;
+        cout << "Transfer buffer size set to " << g_transfer_buffer_size << " bytes.\n";
+        write_to_log("Set", "bufsize", "Success", "Set to " + to_string(g_transfer_buffer_size) + " bytes");
+    }
+    else if (option == "logfile") {
+        if (value.empty()) {
+            cout << "Usage: set logfile <path>\n";
+            return;
+        }
+        write_to_log("Set", "logfile", "Success", "Changing to " + value);
+        if (!g_logger.start(value)) {
+            cout << "Could not open log file: " << value << ", keeping " << g_log_filename << "\n";
+            g_logger.start(g_log_filename);
+            write_to_log("Set", "logfile", "Failed", "Could not open " + value);
+            return;
+        }
+        g_log_filename = value;
+        cout << "Logging to " << g_log_filename << ".\n";
+        write_to_log("Set", "logfile", "Success", "Log file opened");
+    }
+    else {
+        cout << "Usage: set bufsize <bytes>[K|M] | set logfile <path>\n";
+        write_to_log("Set", option, "Failed", "Unknown option");
+    }
+}
+
 void display_help() {
     cout << "\n--- FTP Client Commands ---\n";
     cout << "ls                       : List files in current remote directory.\n";
@@ -804,6 +1076,8 @@ void display_help() {
     cout << "binary                   : Set file transfer mode to BINARY.\n";
     cout << "status                   : Show current client session status.\n";
     cout << "passive                  : Toggle client's passive mode preference.\n";
+    cout << "set bufsize <n>[K|M]     : Set transfer buffer size (e.g. 256K, 4M).\n";
+    cout << "set logfile <path>       : Write the log to another file.\n";
     cout << "open <ip> [port]         : Connect to an FTP server (default port 21).\n";
     cout << "close                    : Disconnect from the current FTP server.\n";
     cout << "quit                     : Exit the FTP client.\n";
@@ -847,6 +1121,13 @@ void handleFtpCommand(const string& input) {
         ftp_passive_toggle();
         return;
     }
+    else if (input.substr(0, 4) == "set ") {
+        stringstream ss(input.substr(4));
+        string option, value;
+        ss >> option >> value;
+        ftp_set(option, value);
+        return;
+    }
     else if (input.substr(0, 5) == "open ") {
         stringstream ss(input.substr(5));
         string ip_str;
@@ -977,6 +1258,10 @@ void handleFtpCommand(const string& input) {
 }
 
 int main() {
+    if (!g_logger.start(g_log_filename)) {
+        cerr << "Failed to open log file for writing: " << g_log_filename << "\n";
+    }
+
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
         cerr << "WSAStartup failed.\n";
@@ -1002,5 +1287,6 @@ int main() {
     closesocket(g_control_sockfd);
     WSACleanup();
     write_to_log("Shutdown", "N/A", "Success", "Program terminated");
+    g_logger.stop();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,822 @@
+﻿#include <iostream>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#endif
+#include <string>
+#include <vector>
+#include <deque>
+#include <sstream>
+#include <algorithm>
+#include <ctime>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include "signature_matcher.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#define poll WSAPoll
+#else
+typedef int SOCKET;
+const SOCKET INVALID_SOCKET = -1;
+const int SOCKET_ERROR = -1;
+inline int closesocket(SOCKET sock) { return close(sock); }
+#endif
+using namespace std;
+
+// ClamAV Agent: the scanner the FTP client asks before every upload, on 127.0.0.1:9000.
+// Two protocols share the port:
+//   - original: "SCAN <name>" is answered by "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)"; the
+//     client connects there, sends the contents and closes, and gets one verdict line. The agent
+//     then closes the control connection
+//   - persistent: "CAPA" is answered by "211 SIZED PIPELINE STREAM [DB=<signature version>]". Then
+//     any number of "SCANDATA <size> <name>" requests follow, each with exactly <size> bytes of
+//     contents on the same connection, and each gets its verdict line in order. "SCANSTREAM <name>"
+//     is followed by the contents as zINSTREAM chunks (a 4-byte big-endian length, then the bytes)
+//     up to a zero-length one; a negative verdict is sent as soon as it is certain, before the
+//     contents end, and the rest of the chunks is read and dropped. Still one verdict per request
+// A verdict is "OK", "FOUND <signature>" or "ERROR <reason>". "STATS" returns the counters as one
+// "211 ..." line and "QUIT" ends a session.
+//
+// Contents are streamed to clamd with zINSTREAM as they arrive (--clamd host:port, or
+// unix:<socket path> on POSIX), or checked for the EICAR test string by a built-in matcher.
+// Sessions are served by a fixed pool of threads; accepted connections wait in a bounded queue
+// and are turned away with "ERROR Agent busy" when it is full. At most --max-scans scans stream
+// at once, whatever the number of sessions, so clamd is never asked for more than its own
+// MaxThreads (10 by default).
+//     clamav_agent [--port N] [--listen <address>] [--clamd <host:port>|unix:<path>] [--threads N]
+//                  [--max-scans N] [--queue N] [--idle-timeout S] [--stats S] [--verbose]
+
+const unsigned short DEFAULT_AGENT_PORT = 9000; // Fixed in the client
+const size_t DATA_BUFFER_SIZE = 256 * 1024;
+const int DATA_CONNECT_TIMEOUT = 10; // Seconds to wait for the data connection of a SCAN
+const int CLAMD_TIMEOUT = 120; // Seconds clamd may take to accept data or give its verdict
+const int DB_VERSION_REFRESH = 60; // Seconds a signature version read from clamd is reused
+const size_t LATENCY_SAMPLES = 8192; // Scans kept for the percentiles
+
+bool g_verbose = false; // "--verbose": log clean verdicts too
+
+// Console log shared by all sessions
+mutex g_log_mutex;
+
+void log_line(const string& message) {
+    time_t now = time(nullptr);
+    tm local = {};
+#ifdef _WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    lock_guard<mutex> lock(g_log_mutex);
+    cout << "[" << put_time(&local, "%Y-%m-%d %H:%M:%S") << "] " << message << endl;
+}
+
+// Send the whole buffer, returning false if the connection failed
+bool send_all(SOCKET sock, const char* data, size_t length) {
+    while (length > 0) {
+        int sent = send(sock, data, static_cast<int>(min<size_t>(length, INT_MAX)), 0);
+        if (sent <= 0) return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+bool send_line(SOCKET sock, const string& line) {
+    string data = line + "\r\n";
+    return send_all(sock, data.c_str(), data.length());
+}
+
+// Read one CRLF (or LF) terminated line, keeping whatever follows it in `pending`. A receive
+// timeout on the socket ends the wait like a closed connection
+bool read_line(SOCKET sock, string& pending, string& line) {
+    size_t end;
+    while ((end = pending.find('\n')) == string::npos) {
+        char buffer[4096];
+        int received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received <= 0) return false;
+        pending.append(buffer, received);
+    }
+    line = pending.substr(0, end);
+    pending.erase(0, end + 1);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    return true;
+}
+
+// Wait up to `seconds` for `sock` to become readable (for a listener: to have a connection)
+bool wait_readable(SOCKET sock, int seconds) {
+    pollfd fd = {};
+    fd.fd = sock;
+    fd.events = POLLIN;
+    return poll(&fd, 1, seconds * 1000) > 0;
+}
+
+// Bound blocking sends and receives on `sock` to `seconds` (0 waits forever)
+void set_socket_timeouts(SOCKET sock, int seconds) {
+#ifdef _WIN32
+    DWORD timeout = seconds * 1000;
+#else
+    timeval timeout = { seconds, 0 };
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+// Verdicts are short writes that follow the contents; without this Nagle holds them back until
+// the peer's delayed ACK
+void set_no_delay(SOCKET sock) {
+    int noDelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+}
+
+// Listening socket on address:port (port 0 picks a free one)
+SOCKET listen_on(const string& address, unsigned short port, int backlog) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+        ::bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR || listen(sock, backlog) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// Open a passive-mode listener next to `control` and describe it as the "(h1,h2,h3,h4,p1,p2)"
+// of a 227 reply. The address is the one the client reached the agent on
+SOCKET open_passive(SOCKET control, string& address) {
+    sockaddr_in local = {};
+    socklen_t length = sizeof(local);
+    if (getsockname(control, reinterpret_cast<sockaddr*>(&local), &length) != 0) return INVALID_SOCKET;
+    char host[INET_ADDRSTRLEN] = {};
+    inet_ntop(AF_INET, &local.sin_addr, host, sizeof(host));
+    SOCKET listener = listen_on(host, 0, 1);
+    if (listener == INVALID_SOCKET) return INVALID_SOCKET;
+
+    sockaddr_in addr = {};
+    length = sizeof(addr);
+    getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &length);
+    unsigned long ip = ntohl(addr.sin_addr.s_addr);
+    unsigned short port = ntohs(addr.sin_port);
+    address = "(" + to_string(ip >> 24) + "," + to_string((ip >> 16) & 255) + "," + to_string((ip >> 8) & 255) + "," +
+        to_string(ip & 255) + "," + to_string(port / 256) + "," + to_string(port % 256) + ")";
+    return listener;
+}
+
+// Accept the data connection on a passive listener, which is closed either way
+SOCKET accept_data(SOCKET& listener) {
+    SOCKET data = INVALID_SOCKET;
+    if (wait_readable(listener, DATA_CONNECT_TIMEOUT)) {
+        data = accept(listener, nullptr, nullptr);
+    }
+    closesocket(listener);
+    listener = INVALID_SOCKET;
+    return data;
+}
+
+// One scan in progress: contents go in with feed() as they arrive, and verdict() ends the scan.
+// decided() is true once the verdict is negative whatever follows, so it can be given early
+class ScanStream {
+public:
+    virtual ~ScanStream() = default;
+    virtual void feed(const char* data, size_t length) = 0;
+    virtual string verdict() = 0;
+    virtual bool decided() const { return false; }
+};
+
+// Where contents are scanned. db_version() identifies the signatures, so that clients can tell
+// whether a verdict they kept is still current; empty if unknown
+class ScanEngine {
+public:
+    virtual ~ScanEngine() = default;
+    virtual unique_ptr<ScanStream> open() = 0;
+    virtual string db_version() = 0;
+    virtual string describe() const = 0;
+};
+
+// Scan of the built-in engine: the EICAR test string, found by SignatureMatcher
+class SignatureStream : public ScanStream {
+public:
+    void feed(const char* data, size_t length) override { m_matcher.feed(data, length); }
+    string verdict() override { return m_matcher.found() ? "FOUND Eicar-Test-Signature" : "OK"; }
+    bool decided() const override { return m_matcher.found(); }
+
+private:
+    SignatureMatcher m_matcher;
+};
+
+// Built-in engine for tests and benchmarks without a clamd
+class SignatureEngine : public ScanEngine {
+public:
+    unique_ptr<ScanStream> open() override { return make_unique<SignatureStream>(); }
+    string db_version() override { return "eicar-1"; }
+    string describe() const override { return "built-in EICAR matcher"; }
+};
+
+// One zINSTREAM command on its own clamd connection. Every fed buffer becomes one chunk (a 4-byte
+// big-endian length, then the bytes) and a zero length ends the stream. clamd answers
+// "stream: OK", "stream: <signature> FOUND" or "<reason> ERROR", terminated by a NUL. If clamd
+// stops reading early (StreamMaxLength exceeded, say), the rest is dropped and its reply kept.
+// clamd only scans once the stream has ended, so a stream is decided early only by such an error
+class ClamdStream : public ScanStream {
+public:
+    explicit ClamdStream(SOCKET sock) : m_sock(sock) {
+        if (m_sock == INVALID_SOCKET) {
+            m_error = "Cannot connect to clamd";
+            return;
+        }
+        static const char command[] = "zINSTREAM";
+        m_sending = send_all(m_sock, command, sizeof(command)); // With its NUL
+        if (!m_sending) m_error = "clamd closed the connection";
+    }
+
+    ~ClamdStream() override {
+        if (m_sock != INVALID_SOCKET) closesocket(m_sock);
+    }
+
+    void feed(const char* data, size_t length) override {
+        while (m_sending && length > 0) {
+            size_t part = min<size_t>(length, DATA_BUFFER_SIZE);
+            // Length and bytes in one send, so no chunk header is left waiting on its own
+            m_chunk.resize(4 + part);
+            m_chunk[0] = static_cast<char>(part >> 24);
+            m_chunk[1] = static_cast<char>(part >> 16);
+            m_chunk[2] = static_cast<char>(part >> 8);
+            m_chunk[3] = static_cast<char>(part);
+            memcpy(m_chunk.data() + 4, data, part);
+            m_sending = send_all(m_sock, m_chunk.data(), m_chunk.size());
+            data += part;
+            length -= part;
+        }
+    }
+
+    string verdict() override {
+        if (m_sock == INVALID_SOCKET) return "ERROR " + m_error;
+        if (m_sending) {
+            static const char end[4] = {};
+            send_all(m_sock, end, sizeof(end));
+        }
+        string reply;
+        char buffer[512];
+        int received;
+        while (reply.find('\0') == string::npos && (received = recv(m_sock, buffer, sizeof(buffer), 0)) > 0) {
+            reply.append(buffer, received);
+        }
+        reply = reply.substr(0, reply.find('\0'));
+        while (!reply.empty() && (reply.back() == '\n' || reply.back() == '\r')) reply.pop_back();
+        if (reply.empty()) return "ERROR " + (m_error.empty() ? string("No reply from clamd") : m_error);
+
+        if (reply.compare(0, 8, "stream: ") == 0) reply.erase(0, 8);
+        if (reply == "OK") return "OK";
+        if (reply.size() > 6 && reply.compare(reply.size() - 6, 6, " FOUND") == 0) {
+            return "FOUND " + reply.substr(0, reply.size() - 6);
+        }
+        if (reply.size() > 6 && reply.compare(reply.size() - 6, 6, " ERROR") == 0) reply.erase(reply.size() - 6);
+        return "ERROR " + reply;
+    }
+
+    bool decided() const override { return !m_sending; }
+
+private:
+    SOCKET m_sock;
+    bool m_sending = false;
+    string m_error;
+    vector<char> m_chunk;
+};
+
+// Scans through a clamd reached over TCP or, on POSIX, a Unix socket. clamd closes the connection
+// after each command, so every scan connects anew
+class ClamdEngine : public ScanEngine {
+public:
+    // "host:port", or "unix:<path>". Returns false if `target` is neither
+    bool configure(const string& target) {
+        if (target.compare(0, 5, "unix:") == 0) {
+#ifdef _WIN32
+            return false;
+#else
+            m_unix_path = target.substr(5);
+            return !m_unix_path.empty() && m_unix_path.size() < sizeof(sockaddr_un::sun_path);
+#endif
+        }
+        size_t colon = target.rfind(':');
+        if (colon == string::npos || colon == 0) return false;
+        m_host = target.substr(0, colon);
+        int port = atoi(target.c_str() + colon + 1);
+        if (port <= 0 || port > 65535) return false;
+        m_port = to_string(port);
+        return true;
+    }
+
+    unique_ptr<ScanStream> open() override { return make_unique<ClamdStream>(connect_clamd()); }
+
+    // The daily database version from zVERSION ("ClamAV 1.4.1/27433/<date>"), read again at most
+    // every DB_VERSION_REFRESH seconds. Empty while clamd cannot be asked
+    string db_version() override {
+        lock_guard<mutex> lock(m_version_mutex);
+        auto now = chrono::steady_clock::now();
+        if (m_version_read && now - m_version_time < chrono::seconds(DB_VERSION_REFRESH)) return m_version;
+
+        string reply;
+        SOCKET sock = connect_clamd();
+        static const char command[] = "zVERSION";
+        if (sock != INVALID_SOCKET && send_all(sock, command, sizeof(command))) {
+            char buffer[256];
+            int received;
+            while (reply.find('\0') == string::npos && (received = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+                reply.append(buffer, received);
+            }
+        }
+        if (sock != INVALID_SOCKET) closesocket(sock);
+        size_t first = reply.find('/');
+        size_t second = first == string::npos ? string::npos : reply.find('/', first + 1);
+        m_version = second == string::npos ? "" : "clamav-" + reply.substr(first + 1, second - first - 1);
+        m_version_read = true;
+        m_version_time = now;
+        return m_version;
+    }
+
+    string describe() const override {
+        return "clamd at " + (m_unix_path.empty() ? m_host + ":" + m_port : m_unix_path);
+    }
+
+private:
+    SOCKET connect_clamd() const {
+        SOCKET sock = INVALID_SOCKET;
+#ifndef _WIN32
+        if (!m_unix_path.empty()) {
+            sock = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, m_unix_path.c_str(), sizeof(addr.sun_path) - 1);
+            if (sock != INVALID_SOCKET && connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                closesocket(sock);
+                sock = INVALID_SOCKET;
+            }
+        }
+        else
+#endif
+        {
+            addrinfo hints = {};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* results = nullptr;
+            if (getaddrinfo(m_host.c_str(), m_port.c_str(), &hints, &results) != 0) return INVALID_SOCKET;
+            for (addrinfo* ai = results; ai && sock == INVALID_SOCKET; ai = ai->ai_next) {
+                sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if (sock == INVALID_SOCKET) continue;
+                if (connect(sock, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) != 0) {
+                    closesocket(sock);
+                    sock = INVALID_SOCKET;
+                }
+            }
+            freeaddrinfo(results);
+            if (sock != INVALID_SOCKET) set_no_delay(sock);
+        }
+        if (sock != INVALID_SOCKET) set_socket_timeouts(sock, CLAMD_TIMEOUT);
+        return sock;
+    }
+
+    string m_host;
+    string m_port;
+    string m_unix_path;
+    mutex m_version_mutex;
+    string m_version;
+    bool m_version_read = false;
+    chrono::steady_clock::time_point m_version_time;
+};
+
+unique_ptr<ScanEngine> g_engine;
+
+// Counting semaphore on the scans streaming at once. A scan waits for a slot before it opens its
+// engine stream and keeps it until the verdict; the client's data backs up in TCP meanwhile
+class ScanSlots {
+public:
+    void set_limit(int limit) { m_free = limit; }
+
+    void acquire() {
+        unique_lock<mutex> lock(m_mutex);
+        m_waiting++;
+        m_released.wait(lock, [this] { return m_free > 0; });
+        m_waiting--;
+        m_free--;
+    }
+
+    void release() {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_free++;
+        }
+        m_released.notify_one();
+    }
+
+    int waiting() {
+        lock_guard<mutex> lock(m_mutex);
+        return m_waiting;
+    }
+
+private:
+    mutex m_mutex;
+    condition_variable m_released;
+    int m_free = 0;
+    int m_waiting = 0;
+};
+
+ScanSlots g_scan_slots;
+
+class ScanSlot {
+public:
+    ScanSlot() { g_scan_slots.acquire(); }
+    ~ScanSlot() { g_scan_slots.release(); }
+    ScanSlot(const ScanSlot&) = delete;
+    ScanSlot& operator=(const ScanSlot&) = delete;
+};
+
+// Counters of the agent. Latency runs from the scan request to its verdict and includes the wait
+// for a scan slot, which is also kept on its own
+class AgentStats {
+public:
+    AgentStats() : m_started(chrono::steady_clock::now()), m_last_report(m_started) {}
+
+    void session_opened() { m_sessions++; }
+    void session_closed() { m_sessions--; }
+    void rejected() { m_rejected++; }
+
+    void scanned(const string& verdict, long long bytes, double waitMillis, double millis, bool early = false) {
+        lock_guard<mutex> lock(m_mutex);
+        m_scans++;
+        if (early) m_early++;
+        m_bytes += bytes;
+        if (verdict.compare(0, 2, "OK") == 0) m_clean++;
+        else if (verdict.compare(0, 5, "FOUND") == 0) m_infected++;
+        else m_errors++;
+        m_wait_total += waitMillis;
+        if (m_latencies.size() < LATENCY_SAMPLES) m_latencies.push_back(millis);
+        else m_latencies[m_next_sample] = millis;
+        m_next_sample = (m_next_sample + 1) % LATENCY_SAMPLES;
+    }
+
+    // Totals since the start and rates over it, as one line
+    string summary() {
+        lock_guard<mutex> lock(m_mutex);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - m_started).count();
+        return describe(m_scans, m_bytes, seconds);
+    }
+
+    // Rates since the previous report, then the totals
+    string report() {
+        lock_guard<mutex> lock(m_mutex);
+        auto now = chrono::steady_clock::now();
+        double seconds = chrono::duration<double>(now - m_last_report).count();
+        string line = describe(m_scans - m_reported_scans, m_bytes - m_reported_bytes, seconds);
+        m_last_report = now;
+        m_reported_scans = m_scans;
+        m_reported_bytes = m_bytes;
+        return line;
+    }
+
+private:
+    // Caller holds m_mutex
+    string describe(long long scans, long long bytes, double seconds) {
+        vector<double> sorted = m_latencies;
+        sort(sorted.begin(), sorted.end());
+        auto percentile = [&](double p) {
+            if (sorted.empty()) return 0.0;
+            size_t rank = static_cast<size_t>(p / 100 * sorted.size() + 0.5);
+            return sorted[min<size_t>(max<size_t>(rank, 1), sorted.size()) - 1];
+        };
+        seconds = max<double>(seconds, 0.001);
+        ostringstream out;
+        out << fixed << setprecision(1) << "scans=" << m_scans << " clean=" << m_clean << " infected=" << m_infected
+            << " errors=" << m_errors << " early=" << m_early << " bytes=" << m_bytes << " scans/s=" << scans / seconds
+            << " MB/s=" << bytes / seconds / (1024 * 1024) << setprecision(2) << " p50_ms=" << percentile(50)
+            << " p99_ms=" << percentile(99) << " avg_wait_ms=" << (m_scans ? m_wait_total / m_scans : 0)
+            << " sessions=" << m_sessions.load() << " waiting=" << g_scan_slots.waiting() << " rejected=" << m_rejected.load();
+        return out.str();
+    }
+
+    mutex m_mutex;
+    chrono::steady_clock::time_point m_started;
+    chrono::steady_clock::time_point m_last_report;
+    long long m_scans = 0;
+    long long m_clean = 0;
+    long long m_infected = 0;
+    long long m_errors = 0;
+    long long m_early = 0; // Verdicts sent before the contents ended
+    long long m_bytes = 0;
+    long long m_reported_scans = 0;
+    long long m_reported_bytes = 0;
+    double m_wait_total = 0;
+    vector<double> m_latencies; // Ring of the last LATENCY_SAMPLES scans
+    size_t m_next_sample = 0;
+    atomic<int> m_sessions{ 0 };
+    atomic<long long> m_rejected{ 0 };
+};
+
+AgentStats g_stats;
+
+// Scan `length` bytes arriving on `sock`, of which the first ones may already be in `pending`.
+// Returns false if the client went away before sending all of them (length < 0: until it closes)
+bool scan_contents(SOCKET sock, string& pending, long long length, const string& name, vector<char>& buffer, string& verdict) {
+    auto started = chrono::steady_clock::now();
+    ScanSlot slot;
+    double waitMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    unique_ptr<ScanStream> stream = g_engine->open();
+
+    long long remaining = length < 0 ? LLONG_MAX : length;
+    size_t buffered = static_cast<size_t>(min<long long>(remaining, pending.size()));
+    stream->feed(pending.data(), buffered);
+    pending.erase(0, buffered);
+    remaining -= buffered;
+    while (remaining > 0) {
+        int received = recv(sock, buffer.data(), static_cast<int>(min<long long>(remaining, buffer.size())), 0);
+        if (received <= 0) break;
+        stream->feed(buffer.data(), received);
+        remaining -= received;
+    }
+    if (length >= 0 && remaining > 0) return false;
+
+    verdict = stream->verdict();
+    long long bytes = length < 0 ? LLONG_MAX - remaining : length;
+    g_stats.scanned(verdict, bytes, waitMillis, chrono::duration<double, milli>(chrono::steady_clock::now() - started).count());
+    if (g_verbose || verdict != "OK") log_line(name + " (" + to_string(bytes) + " bytes): " + verdict);
+    return true;
+}
+
+// Receive into `data` up to `length` bytes of contents, taking those already in `pending` first.
+// Returns the count, 0 or less if the client went away
+int receive_contents(SOCKET sock, string& pending, char* data, size_t length) {
+    if (!pending.empty()) {
+        size_t taken = min<size_t>(length, pending.size());
+        memcpy(data, pending.data(), taken);
+        pending.erase(0, taken);
+        return static_cast<int>(taken);
+    }
+    return recv(sock, data, static_cast<int>(min<size_t>(length, INT_MAX)), 0);
+}
+
+// SCANSTREAM: scan the chunks arriving on `sock` up to the zero-length one and send the verdict,
+// early if the stream is decided before the end. The slot and the engine stream are let go at that
+// point; the remaining chunks only have to be read past. Returns false if the client went away
+bool scan_chunks(SOCKET sock, string& pending, const string& name, vector<char>& buffer) {
+    auto started = chrono::steady_clock::now();
+    auto slot = make_unique<ScanSlot>();
+    double waitMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    unique_ptr<ScanStream> stream = g_engine->open();
+
+    string verdict;
+    long long bytes = 0;
+    bool answered = false;
+    while (true) {
+        unsigned char header[4];
+        for (size_t got = 0; got < sizeof(header);) {
+            int received = receive_contents(sock, pending, reinterpret_cast<char*>(header) + got, sizeof(header) - got);
+            if (received <= 0) return false;
+            got += received;
+        }
+        uint32_t length = static_cast<uint32_t>(header[0]) << 24 | header[1] << 16 | header[2] << 8 | header[3];
+        if (length == 0) break;
+        while (length > 0) {
+            int received = receive_contents(sock, pending, buffer.data(), min<size_t>(length, buffer.size()));
+            if (received <= 0) return false;
+            if (stream) stream->feed(buffer.data(), received);
+            length -= received;
+            bytes += received;
+        }
+        if (stream && stream->decided()) {
+            verdict = stream->verdict();
+            stream.reset();
+            slot.reset();
+            double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+            g_stats.scanned(verdict, bytes, waitMillis, millis, true);
+            log_line(name + " (stopped after " + to_string(bytes) + " bytes): " + verdict);
+            if (!send_line(sock, verdict)) return false;
+            answered = true;
+        }
+    }
+    if (answered) return true;
+
+    verdict = stream->verdict();
+    g_stats.scanned(verdict, bytes, waitMillis, chrono::duration<double, milli>(chrono::steady_clock::now() - started).count());
+    if (g_verbose || verdict != "OK") log_line(name + " (" + to_string(bytes) + " bytes): " + verdict);
+    return send_line(sock, verdict);
+}
+
+// One client connection, in either protocol (see the top of the file)
+void serve_scan_session(SOCKET control) {
+    g_stats.session_opened();
+    string pending, line;
+    vector<char> buffer(DATA_BUFFER_SIZE);
+    while (read_line(control, pending, line)) {
+        if (line == "CAPA") {
+            string version = g_engine->db_version();
+            send_line(control, "211 SIZED PIPELINE STREAM" + (version.empty() ? "" : " DB=" + version));
+        }
+        else if (line == "STATS") {
+            send_line(control, "211 " + g_stats.summary());
+        }
+        else if (line == "QUIT") {
+            send_line(control, "221 Goodbye");
+            break;
+        }
+        else if (line.compare(0, 9, "SCANDATA ") == 0) {
+            char* end = nullptr;
+            long long size = strtoll(line.c_str() + 9, &end, 10);
+            if (end == line.c_str() + 9 || size < 0 || (*end != ' ' && *end != '\0')) {
+                // Without a size the contents cannot be told from the next request
+                send_line(control, "ERROR Expected SCANDATA <size> <name>");
+                break;
+            }
+            string name = *end == ' ' ? string(end + 1) : string();
+            string verdict;
+            if (!scan_contents(control, pending, size, name, buffer, verdict) || !send_line(control, verdict)) break;
+        }
+        else if (line.compare(0, 11, "SCANSTREAM ") == 0 || line == "SCANSTREAM") {
+            if (!scan_chunks(control, pending, line.size() > 11 ? line.substr(11) : string(), buffer)) break;
+        }
+        else if (line.compare(0, 5, "SCAN ") == 0) {
+            string address, verdict;
+            SOCKET passive = open_passive(control, address);
+            if (passive == INVALID_SOCKET) {
+                send_line(control, "ERROR Cannot open data connection");
+                break;
+            }
+            send_line(control, "227 Entering Passive Mode " + address);
+            SOCKET data = accept_data(passive);
+            if (data == INVALID_SOCKET) {
+                send_line(control, "ERROR No data connection");
+                break;
+            }
+            string none;
+            scan_contents(data, none, -1, line.substr(5), buffer, verdict);
+            closesocket(data);
+            send_line(control, verdict);
+            break;
+        }
+        else {
+            send_line(control, "ERROR Unknown command");
+            break;
+        }
+    }
+    closesocket(control);
+    g_stats.session_closed();
+}
+
+// Fixed set of threads serving sessions. Accepted connections beyond the idle threads wait in a
+// queue of bounded length
+class SessionPool {
+public:
+    void start(int threads, size_t queueLimit) {
+        m_queue_limit = queueLimit;
+        for (int i = 0; i < threads; i++) {
+            thread([this] { work(); }).detach();
+        }
+    }
+
+    // Queue a session. Returns false if no thread is idle and the queue is full
+    bool submit(SOCKET sock) {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (m_queue.size() >= m_idle + m_queue_limit) return false;
+            m_queue.push_back(sock);
+        }
+        m_ready.notify_one();
+        return true;
+    }
+
+private:
+    void work() {
+        while (true) {
+            SOCKET sock;
+            {
+                unique_lock<mutex> lock(m_mutex);
+                m_idle++;
+                m_ready.wait(lock, [this] { return !m_queue.empty(); });
+                m_idle--;
+                sock = m_queue.front();
+                m_queue.pop_front();
+            }
+            serve_scan_session(sock);
+        }
+    }
+
+    mutex m_mutex;
+    condition_variable m_ready;
+    deque<SOCKET> m_queue;
+    size_t m_queue_limit = 0;
+    size_t m_idle = 0; // Threads waiting for a session
+};
+
+SessionPool g_pool;
+
+// Print the counters every `seconds`
+void report_loop(int seconds) {
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(seconds));
+        log_line("Stats: " + g_stats.report());
+    }
+}
+
+int main(int argc, char* argv[]) {
+    string address = "127.0.0.1";
+    string clamd;
+    int port = DEFAULT_AGENT_PORT;
+    int threads = max<int>(static_cast<int>(thread::hardware_concurrency()) * 2, 8);
+    int maxScans = 10;
+    int queueLimit = 64;
+    int idleTimeout = 300;
+    int statsInterval = 0;
+    bool usage = false;
+    for (int i = 1; i < argc && !usage; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--port" && hasValue) port = atoi(argv[++i]);
+        else if (arg == "--listen" && hasValue) address = argv[++i];
+        else if (arg == "--clamd" && hasValue) clamd = argv[++i];
+        else if (arg == "--threads" && hasValue) threads = atoi(argv[++i]);
+        else if (arg == "--max-scans" && hasValue) maxScans = atoi(argv[++i]);
+        else if (arg == "--queue" && hasValue) queueLimit = atoi(argv[++i]);
+        else if (arg == "--idle-timeout" && hasValue) idleTimeout = atoi(argv[++i]);
+        else if (arg == "--stats" && hasValue) statsInterval = atoi(argv[++i]);
+        else if (arg == "--verbose") g_verbose = true;
+        else usage = true;
+    }
+    if (usage || port <= 0 || port > 65535 || threads <= 0 || maxScans <= 0 || queueLimit < 0 || idleTimeout < 0 || statsInterval < 0) {
+        cerr << "Usage: clamav_agent [--port N] [--listen <address>] [--clamd <host:port>|unix:<path>] [--threads N]\n"
+            << "                    [--max-scans N] [--queue N] [--idle-timeout S] [--stats S] [--verbose]" << endl;
+        return 1;
+    }
+
+    if (clamd.empty()) {
+        g_engine = make_unique<SignatureEngine>();
+    }
+    else {
+        auto engine = make_unique<ClamdEngine>();
+        if (!engine->configure(clamd)) {
+            cerr << "Invalid clamd address: " << clamd << " (expected host:port or unix:<path>)" << endl;
+            return 1;
+        }
+        g_engine = move(engine);
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "WSAStartup failed" << endl;
+        return 1;
+    }
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    SOCKET listener = listen_on(address, static_cast<unsigned short>(port), 128);
+    if (listener == INVALID_SOCKET) {
+        cerr << "Cannot listen on " << address << ":" << port << endl;
+        return 1;
+    }
+    g_scan_slots.set_limit(maxScans);
+    g_pool.start(threads, static_cast<size_t>(queueLimit));
+    if (statsInterval > 0) thread(report_loop, statsInterval).detach();
+    if (!clamd.empty() && g_engine->db_version().empty()) {
+        log_line("Warning: clamd did not answer VERSION; clients are not told a signature version until it does");
+    }
+    log_line("ClamAV Agent listening on " + address + ":" + to_string(port) + " - " + g_engine->describe() + ", " +
+        to_string(threads) + " session threads, " + to_string(maxScans) + " concurrent scans");
+
+    while (true) {
+        SOCKET client = accept(listener, nullptr, nullptr);
+        if (client == INVALID_SOCKET) continue;
+        set_no_delay(client);
+        // A session that sends nothing for this long gives its thread back (the client reconnects)
+        set_socket_timeouts(client, idleTimeout);
+        if (!g_pool.submit(client)) {
+            g_stats.rejected();
+            send_line(client, "ERROR Agent busy");
+            closesocket(client);
+        }
+    }
+}
@@ -0,0 +1,905 @@
+﻿#include <iostream>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#endif
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <ctime>
+#include <iomanip>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include "signature_matcher.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#define popen _popen
+#define pclose _pclose
+#define fseeko _fseeki64
+#else
+typedef int SOCKET;
+const SOCKET INVALID_SOCKET = -1;
+const int SOCKET_ERROR = -1;
+inline int closesocket(SOCKET sock) { return close(sock); }
+inline int fopen_s(FILE** file, const char* filename, const char* mode) {
+    *file = fopen(filename, mode);
+    return *file ? 0 : errno;
+}
+#endif
+using namespace std;
+namespace fs = std::filesystem;
+
+// End-to-end benchmark of the FTP client. Runs a minimal FTP server and a stand-in ClamAV Agent
+// (the SCAN <name> -> 227 -> data -> OK protocol on 127.0.0.1:9000 that put expects) in this process,
+// then drives the client executable through its command prompt over a matrix of file sizes and
+// file counts and reports MB/s, files/s and p50/p99 latency per transferred file.
+//     ftp_bench <client executable> [--quick] [--legacy-agent | --no-agent] [--port N] [--dir <work directory>]
+// Everything stays on 127.0.0.1, so results are reproducible offline and comparable between builds.
+// With --no-agent scans go to the agent already listening on 127.0.0.1:9000 (clamav_agent, say).
+// After the matrix, the client's scan verdict cache is checked in every upload mode (not with
+// --legacy-agent, which reports no signature version to cache against)
+
+const unsigned short SCAN_AGENT_PORT = 9000; // Fixed in the client
+const size_t DATA_BUFFER_SIZE = 1024 * 1024;
+const int DATA_CONNECT_TIMEOUT = 10; // Seconds the servers wait for a passive data connection
+
+fs::path g_server_root; // Directory served by the stand-in FTP server
+
+// Files moved by the stand-in FTP server during one scenario. A file counts once the server sent
+// its 226; its latency runs from the RETR/STOR command to that reply
+class TransferStats {
+public:
+    void record(long long bytes, double millis) {
+        lock_guard<mutex> lock(m_mutex);
+        m_bytes += bytes;
+        m_latencies.push_back(millis);
+    }
+
+    void reset() {
+        lock_guard<mutex> lock(m_mutex);
+        m_bytes = 0;
+        m_latencies.clear();
+    }
+
+    int files() {
+        lock_guard<mutex> lock(m_mutex);
+        return static_cast<int>(m_latencies.size());
+    }
+
+    long long bytes() {
+        lock_guard<mutex> lock(m_mutex);
+        return m_bytes;
+    }
+
+    // Nearest-rank percentile of the latencies in milliseconds (0 without transfers)
+    double percentile(double p) {
+        lock_guard<mutex> lock(m_mutex);
+        if (m_latencies.empty()) return 0;
+        vector<double> sorted = m_latencies;
+        sort(sorted.begin(), sorted.end());
+        size_t rank = static_cast<size_t>(p / 100 * sorted.size() + 0.5);
+        return sorted[min<size_t>(max<size_t>(rank, 1), sorted.size()) - 1];
+    }
+
+private:
+    mutex m_mutex;
+    long long m_bytes = 0;
+    vector<double> m_latencies;
+};
+
+TransferStats g_stats;
+
+// Send the whole buffer, returning false if the connection failed
+bool send_all(SOCKET sock, const char* data, size_t length) {
+    while (length > 0) {
+        int sent = send(sock, data, static_cast<int>(min<size_t>(length, INT_MAX)), 0);
+        if (sent <= 0) return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+bool send_line(SOCKET sock, const string& line) {
+    string data = line + "\r\n";
+    return send_all(sock, data.c_str(), data.length());
+}
+
+// Read one CRLF (or LF) terminated line, keeping whatever follows it in `pending`
+bool read_line(SOCKET sock, string& pending, string& line) {
+    size_t end;
+    while ((end = pending.find('\n')) == string::npos) {
+        char buffer[4096];
+        int received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received <= 0) return false;
+        pending.append(buffer, received);
+    }
+    line = pending.substr(0, end);
+    pending.erase(0, end + 1);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    return true;
+}
+
+// Listening socket on 127.0.0.1:port (0 picks a free port)
+SOCKET listen_on(unsigned short port) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (::bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR || listen(sock, 64) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// Open a passive-mode listener and describe it as the "(h1,h2,h3,h4,p1,p2)" of a 227 reply
+SOCKET open_passive(string& address) {
+    SOCKET listener = listen_on(0);
+    if (listener == INVALID_SOCKET) return INVALID_SOCKET;
+    sockaddr_in addr = {};
+    socklen_t length = sizeof(addr);
+    getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &length);
+    unsigned short port = ntohs(addr.sin_port);
+    address = "(127,0,0,1," + to_string(port / 256) + "," + to_string(port % 256) + ")";
+    return listener;
+}
+
+// Accept the data connection on a passive listener, which is closed either way
+SOCKET accept_data(SOCKET& listener) {
+    if (listener == INVALID_SOCKET) return INVALID_SOCKET;
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(listener, &readable);
+    timeval timeout = { DATA_CONNECT_TIMEOUT, 0 };
+    SOCKET data = INVALID_SOCKET;
+    if (select(static_cast<int>(listener) + 1, &readable, nullptr, nullptr, &timeout) > 0) {
+        data = accept(listener, nullptr, nullptr);
+    }
+    closesocket(listener);
+    listener = INVALID_SOCKET;
+    if (data != INVALID_SOCKET) {
+        int noDelay = 1;
+        setsockopt(data, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+    }
+    return data;
+}
+
+// Resolve `argument` against the virtual directory `cwd`. "." and ".." are applied, and ".." stops
+// at the root, so the real path always lies below g_server_root
+void resolve_path(const string& cwd, const string& argument, string& virtualPath, fs::path& realPath) {
+    string combined = (!argument.empty() && argument[0] == '/') ? argument : cwd + "/" + argument;
+    vector<string> parts;
+    istringstream iss(combined);
+    string part;
+    while (getline(iss, part, '/')) {
+        if (part.empty() || part == ".") continue;
+        if (part == "..") {
+            if (!parts.empty()) parts.pop_back();
+            continue;
+        }
+        parts.push_back(part);
+    }
+    virtualPath.clear();
+    realPath = g_server_root;
+    for (const string& name : parts) {
+        virtualPath += "/" + name;
+        realPath /= name;
+    }
+    if (virtualPath.empty()) virtualPath = "/";
+}
+
+// Listing of `directory` in MLSD facts or in the Unix LIST format
+string directory_listing(const fs::path& directory, bool mlsd) {
+    vector<fs::directory_entry> entries;
+    error_code ec;
+    for (const fs::directory_entry& entry : fs::directory_iterator(directory, ec)) {
+        entries.push_back(entry);
+    }
+    sort(entries.begin(), entries.end(), [](const fs::directory_entry& a, const fs::directory_entry& b) { return a.path() < b.path(); });
+
+    ostringstream out;
+    for (const fs::directory_entry& entry : entries) {
+        bool isDirectory = entry.is_directory(ec);
+        long long size = isDirectory ? 0 : static_cast<long long>(entry.file_size(ec));
+        string name = entry.path().filename().string();
+        if (mlsd) {
+            out << "type=" << (isDirectory ? "dir" : "file") << ";size=" << size << ";modify=20240101000000; " << name << "\r\n";
+        }
+        else {
+            out << (isDirectory ? "drwxr-xr-x" : "-rw-r--r--") << " 1 ftp ftp " << setw(12) << size << " Jan 01 00:00 " << name << "\r\n";
+        }
+    }
+    return out.str();
+}
+
+// Copy a file to the data connection, starting at `offset`. Returns the byte count, or -1
+long long send_file(SOCKET data, const fs::path& path, long long offset) {
+    FILE* file = nullptr;
+    if (fopen_s(&file, path.string().c_str(), "rb") != 0 || !file) return -1;
+    if (offset > 0 && fseeko(file, offset, SEEK_SET) != 0) {
+        fclose(file);
+        return -1;
+    }
+    vector<char> buffer(DATA_BUFFER_SIZE);
+    long long total = 0;
+    size_t length;
+    while ((length = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+        if (!send_all(data, buffer.data(), length)) {
+            total = -1;
+            break;
+        }
+        total += length;
+    }
+    fclose(file);
+    return total;
+}
+
+// Write the data connection to a file, from `offset` on when resuming. Returns the byte count, or -1
+long long receive_file(SOCKET data, const fs::path& path, long long offset) {
+    FILE* file = nullptr;
+    if (fopen_s(&file, path.string().c_str(), offset > 0 ? "r+b" : "wb") != 0 || !file) return -1;
+    if (offset > 0) fseeko(file, offset, SEEK_SET);
+    vector<char> buffer(DATA_BUFFER_SIZE);
+    long long total = 0;
+    int received;
+    while ((received = recv(data, buffer.data(), static_cast<int>(buffer.size()), 0)) > 0) {
+        if (fwrite(buffer.data(), 1, received, file) != static_cast<size_t>(received)) {
+            total = -1;
+            break;
+        }
+        total += received;
+    }
+    fclose(file);
+    return received < 0 ? -1 : total;
+}
+
+// A STOR to a name containing this is received in full and then answered 451, as by a server that
+// ran out of disk space
+const string FAILING_STOR_MARKER = "fail_stor";
+
+// One control connection of the stand-in FTP server. Any user and password are accepted; only
+// passive mode exists
+void serve_ftp_session(SOCKET control) {
+    string pending, line;
+    string cwd = "/";
+    SOCKET passive = INVALID_SOCKET;
+    long long restOffset = 0;
+    fs::path renameFrom;
+    send_line(control, "220 ftp_bench stand-in server ready");
+
+    while (read_line(control, pending, line)) {
+        size_t space = line.find(' ');
+        string verb = line.substr(0, space);
+        string argument = space == string::npos ? "" : line.substr(space + 1);
+        transform(verb.begin(), verb.end(), verb.begin(), ::toupper);
+        string virtualPath;
+        fs::path realPath;
+        resolve_path(cwd, argument, virtualPath, realPath);
+        error_code ec;
+        auto started = chrono::steady_clock::now();
+
+        if (verb == "USER") send_line(control, "331 Password required");
+        else if (verb == "PASS") send_line(control, "230 Logged on");
+        else if (verb == "TYPE") send_line(control, "200 Type set");
+        else if (verb == "NOOP") send_line(control, "200 OK");
+        else if (verb == "SYST") send_line(control, "215 UNIX Type: L8");
+        else if (verb == "FEAT") send_line(control, "211-Features:\r\n MLSD\r\n SIZE\r\n REST STREAM\r\n211 End");
+        else if (verb == "PWD") send_line(control, "257 \"" + cwd + "\" is current directory");
+        else if (verb == "CWD" || verb == "CDUP") {
+            if (verb == "CDUP") resolve_path(cwd, "..", virtualPath, realPath);
+            if (fs::is_directory(realPath, ec)) {
+                cwd = virtualPath;
+                send_line(control, "250 Directory changed to " + cwd);
+            }
+            else {
+                send_line(control, "550 No such directory");
+            }
+        }
+        else if (verb == "MKD") {
+            if (fs::create_directory(realPath, ec)) send_line(control, "257 \"" + virtualPath + "\" created");
+            else send_line(control, "550 Cannot create directory");
+        }
+        else if (verb == "RMD" || verb == "DELE") {
+            bool isDirectory = fs::is_directory(realPath, ec);
+            if (isDirectory == (verb == "RMD") && fs::remove(realPath, ec)) send_line(control, "250 Removed");
+            else send_line(control, "550 Cannot remove");
+        }
+        else if (verb == "RNFR") {
+            if (fs::exists(realPath, ec)) {
+                renameFrom = realPath;
+                send_line(control, "350 Ready for RNTO");
+            }
+            else {
+                send_line(control, "550 No such file");
+            }
+        }
+        else if (verb == "RNTO") {
+            fs::rename(renameFrom, realPath, ec);
+            send_line(control, renameFrom.empty() || ec ? "550 Rename failed" : "250 Renamed");
+            renameFrom.clear();
+        }
+        else if (verb == "SIZE") {
+            uintmax_t size = fs::file_size(realPath, ec);
+            send_line(control, ec ? "550 No such file" : "213 " + to_string(size));
+        }
+        else if (verb == "REST") {
+            restOffset = atoll(argument.c_str());
+            send_line(control, "350 Restarting at " + to_string(restOffset));
+        }
+        else if (verb == "PASV") {
+            if (passive != INVALID_SOCKET) closesocket(passive);
+            string address;
+            passive = open_passive(address);
+            send_line(control, passive == INVALID_SOCKET ? "425 Cannot open passive connection" : "227 Entering Passive Mode " + address);
+        }
+        else if (verb == "LIST" || verb == "NLST" || verb == "MLSD") {
+            if (argument.empty() || argument[0] == '-') resolve_path(cwd, "", virtualPath, realPath);
+            if (!fs::is_directory(realPath, ec)) {
+                send_line(control, "550 No such directory");
+                continue;
+            }
+            SOCKET data = accept_data(passive);
+            if (data == INVALID_SOCKET) {
+                send_line(control, "425 No data connection");
+                continue;
+            }
+            send_line(control, "150 Opening data connection");
+            string listing = directory_listing(realPath, verb == "MLSD");
+            send_all(data, listing.c_str(), listing.length());
+            closesocket(data);
+            send_line(control, "226 Transfer complete");
+        }
+        else if (verb == "RETR" || verb == "STOR") {
+            long long offset = restOffset;
+            restOffset = 0;
+            if (verb == "RETR" && !fs::is_regular_file(realPath, ec)) {
+                if (passive != INVALID_SOCKET) closesocket(passive);
+                passive = INVALID_SOCKET;
+                send_line(control, "550 No such file");
+                continue;
+            }
+            SOCKET data = accept_data(passive);
+            if (data == INVALID_SOCKET) {
+                send_line(control, "425 No data connection");
+                continue;
+            }
+            send_line(control, "150 Opening data connection");
+            long long bytes = verb == "RETR" ? send_file(data, realPath, offset) : receive_file(data, realPath, offset);
+            closesocket(data);
+            if (bytes < 0 || (verb == "STOR" && virtualPath.find(FAILING_STOR_MARKER) != string::npos)) {
+                send_line(control, "451 Transfer failed");
+                continue;
+            }
+            send_line(control, "226 Transfer complete");
+            g_stats.record(bytes, chrono::duration<double, milli>(chrono::steady_clock::now() - started).count());
+        }
+        else if (verb == "QUIT") {
+            send_line(control, "221 Goodbye");
+            break;
+        }
+        else {
+            send_line(control, "502 Command not implemented");
+        }
+    }
+    if (passive != INVALID_SOCKET) closesocket(passive);
+    closesocket(control);
+}
+
+bool g_legacy_agent = false; // "--legacy-agent": speak only the original one-scan-per-connection protocol
+bool g_external_agent = false; // "--no-agent": leave port 9000 to a separately started agent
+
+// One connection to the stand-in ClamAV Agent. The original protocol is a single SCAN <name>, a
+// 227 reply with the data address, the contents on that data connection and the verdict. The
+// persistent one is announced by CAPA ("211 SIZED PIPELINE STREAM DB=<signature version>") and takes any
+// number of SCANDATA <size> <name> requests, each followed by its contents on this connection and
+// answered by its verdict in order. SCANSTREAM <name> is followed by zINSTREAM chunks up to a
+// zero-length one, and a FOUND verdict is sent as soon as the string is seen, the rest being read
+// and dropped. A verdict is "OK", or "FOUND ..." if the EICAR test string was seen
+void serve_scan_session(SOCKET control) {
+    string pending, line;
+    vector<char> buffer(DATA_BUFFER_SIZE);
+    while (read_line(control, pending, line)) {
+        if (!g_legacy_agent && line == "CAPA") {
+            send_line(control, "211 SIZED PIPELINE STREAM DB=ftp_bench-1");
+            continue;
+        }
+        if (!g_legacy_agent && line.compare(0, 10, "SCANSTREAM") == 0) {
+            // Up to `length` bytes, the ones that arrived with the request line first
+            auto receive = [&](char* data, size_t length) -> int {
+                if (pending.empty()) return static_cast<int>(recv(control, data, static_cast<int>(length), 0));
+                size_t taken = min<size_t>(length, pending.size());
+                memcpy(data, pending.data(), taken);
+                pending.erase(0, taken);
+                return static_cast<int>(taken);
+            };
+            SignatureMatcher matcher;
+            bool ended = false;
+            while (true) {
+                unsigned char header[4];
+                size_t got = 0;
+                int received = 1;
+                while (got < sizeof(header) && (received = receive(reinterpret_cast<char*>(header) + got, sizeof(header) - got)) > 0) got += received;
+                if (received <= 0) break;
+                size_t length = static_cast<size_t>(header[0]) << 24 | header[1] << 16 | header[2] << 8 | header[3];
+                if (length == 0) {
+                    ended = true;
+                    break;
+                }
+                bool answered = matcher.found();
+                while (length > 0 && (received = receive(buffer.data(), min<size_t>(length, buffer.size()))) > 0) {
+                    if (!answered) matcher.feed(buffer.data(), received);
+                    length -= received;
+                }
+                if (length > 0) break;
+                if (!answered && matcher.found()) send_line(control, "FOUND Eicar-Test-Signature");
+            }
+            if (!ended) break;
+            if (!matcher.found()) send_line(control, "OK");
+            continue;
+        }
+        if (!g_legacy_agent && line.compare(0, 9, "SCANDATA ") == 0) {
+            long long remaining = atoll(line.c_str() + 9);
+            SignatureMatcher matcher;
+            // The start of the contents may have arrived together with the request line
+            size_t buffered = static_cast<size_t>(min<long long>(remaining, pending.size()));
+            matcher.feed(pending.data(), buffered);
+            pending.erase(0, buffered);
+            remaining -= buffered;
+            while (remaining > 0) {
+                int received = recv(control, buffer.data(), static_cast<int>(min<long long>(remaining, buffer.size())), 0);
+                if (received <= 0) break;
+                matcher.feed(buffer.data(), received);
+                remaining -= received;
+            }
+            if (remaining > 0) break;
+            send_line(control, matcher.found() ? "FOUND Eicar-Test-Signature" : "OK");
+            continue;
+        }
+        if (line.compare(0, 5, "SCAN ") != 0) {
+            send_line(control, "ERROR Expected SCAN <name>");
+            break;
+        }
+
+        string address;
+        SOCKET passive = open_passive(address);
+        if (passive == INVALID_SOCKET) {
+            send_line(control, "ERROR Cannot open data connection");
+            break;
+        }
+        send_line(control, "227 Entering Passive Mode " + address);
+        SOCKET data = accept_data(passive);
+        if (data == INVALID_SOCKET) {
+            send_line(control, "ERROR No data connection");
+            break;
+        }
+        SignatureMatcher matcher;
+        int received;
+        while ((received = recv(data, buffer.data(), static_cast<int>(buffer.size()), 0)) > 0) {
+            matcher.feed(buffer.data(), received);
+        }
+        closesocket(data);
+        send_line(control, matcher.found() ? "FOUND Eicar-Test-Signature" : "OK");
+        break;
+    }
+    closesocket(control);
+}
+
+// Serve every connection to `listener` on its own thread
+void accept_loop(SOCKET listener, void (*serve)(SOCKET)) {
+    while (true) {
+        SOCKET client = accept(listener, nullptr, nullptr);
+        if (client == INVALID_SOCKET) continue;
+        // Replies are short writes in a row (150 then 226); without this Nagle holds the second one
+        // back until the client's delayed ACK
+        int noDelay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+        thread(serve, client).detach();
+    }
+}
+
+// Fill a file with `size` pseudo-random bytes
+bool make_file(const fs::path& path, long long size, unsigned seed) {
+    fs::create_directories(path.parent_path());
+    FILE* file = nullptr;
+    if (fopen_s(&file, path.string().c_str(), "wb") != 0 || !file) return false;
+    vector<unsigned> block(16384);
+    unsigned state = seed * 2654435761u + 1;
+    for (long long written = 0; written < size;) {
+        for (unsigned& word : block) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            word = state;
+        }
+        size_t length = static_cast<size_t>(min<long long>(size - written, block.size() * sizeof(unsigned)));
+        fwrite(block.data(), 1, length, file);
+        written += length;
+    }
+    fclose(file);
+    return true;
+}
+
+// Outcome of one scenario. Timing starts with the client process and subtracts the cost of a bare
+// open/quit, so it covers the transfers only
+struct BenchResult {
+    string name;
+    int files = 0;
+    int expected = 0;
+    long long bytes = 0;
+    double seconds = 0;
+    double p50 = 0;
+    double p99 = 0;
+};
+
+string g_client; // Client executable
+fs::path g_client_dir; // Working directory of the client
+unsigned short g_ftp_port = 2121;
+double g_session_overhead = 0; // Seconds of a client run without transfers
+
+// Put the EICAR test string at the start of an existing file
+bool plant_signature(const fs::path& path) {
+    static const char signature[] = "X5O!P%@AP[4\\PZX54(P^)7CC)7}$EICAR-STANDARD-ANTIVIRUS-TEST-FILE!$H+H*";
+    FILE* file = nullptr;
+    if (fopen_s(&file, path.string().c_str(), "r+b") != 0 || !file) return false;
+    bool written = fwrite(signature, 1, sizeof(signature) - 1, file) == sizeof(signature) - 1;
+    fclose(file);
+    return written;
+}
+
+// Run the client in g_client_dir with `script` after the login and return the wall time in seconds
+double run_client(const string& script) {
+    string input = "open 127.0.0.1 " + to_string(g_ftp_port) + "\nprompt\n" + script + "quit\n";
+    fs::path previous = fs::current_path();
+    fs::current_path(g_client_dir);
+    string command = "\"" + g_client + "\" >> client_output.txt 2>&1";
+
+    auto start = chrono::steady_clock::now();
+    FILE* client = popen(command.c_str(), "w");
+    if (client) {
+        fputs(input.c_str(), client);
+        pclose(client);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    fs::current_path(previous);
+    if (!client) {
+        cerr << "Could not start the client: " << g_client << endl;
+        exit(1);
+    }
+    return seconds;
+}
+
+// Run the client with `script` and return what it printed
+string client_output(const string& script) {
+    fs::path output = g_client_dir / "client_output.txt";
+    error_code ec;
+    uintmax_t offset = fs::file_size(output, ec);
+    if (ec) offset = 0;
+    run_client(script);
+    string text;
+    FILE* file = nullptr;
+    if (fopen_s(&file, output.string().c_str(), "rb") != 0 || !file) return text;
+    fseeko(file, static_cast<long long>(offset), SEEK_SET);
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) text.append(buffer, n);
+    fclose(file);
+    return text;
+}
+
+// Whether both files exist and have the same contents
+bool same_contents(const fs::path& first, const fs::path& second) {
+    FILE* a = nullptr;
+    FILE* b = nullptr;
+    fopen_s(&a, first.string().c_str(), "rb");
+    fopen_s(&b, second.string().c_str(), "rb");
+    bool same = a && b;
+    vector<char> bufferA(65536), bufferB(65536);
+    while (same) {
+        size_t n = fread(bufferA.data(), 1, bufferA.size(), a);
+        same = fread(bufferB.data(), 1, bufferB.size(), b) == n && memcmp(bufferA.data(), bufferB.data(), n) == 0;
+        if (n == 0) break;
+    }
+    if (a) fclose(a);
+    if (b) fclose(b);
+    return same;
+}
+
+// The scan verdict cache in each upload mode: a repeated put uses the cached verdict, a file edited
+// without changing its size or modification time is scanned again, an infected edit never replaces
+// the server's copy, and an upload the server answers with 451 fails and is not cached. Prints one
+// line per check and returns the number that failed
+int run_cache_checks() {
+    int failed = 0;
+    auto check = [&failed](bool passed, const string& description) {
+        cout << (passed ? "  ok      " : "  FAILED  ") << description << endl;
+        if (!passed) failed++;
+    };
+    auto count = [](const string& text, const string& part) {
+        int found = 0;
+        for (size_t at = text.find(part); at != string::npos; at = text.find(part, at + 1)) found++;
+        return found;
+    };
+
+    const long long size = 256 * 1024;
+    const vector<pair<string, string>> modes = { { "put", "" }, { "put pipelined", "set pipeline on\n" }, { "put hidden", "set pipeline hidden\n" } };
+    for (size_t i = 0; i < modes.size(); i++) {
+        const string& mode = modes[i].first;
+        const string& setting = modes[i].second;
+        string name = "cached_" + to_string(i) + ".bin";
+        fs::path local = g_client_dir / name;
+        fs::path remote = g_server_root / name;
+        fs::path previous = g_client_dir / ("previous_" + name);
+        error_code ec;
+        fs::remove(g_client_dir / "ftp_scan_cache.txt", ec);
+        make_file(local, size, 2000 + static_cast<unsigned>(i));
+
+        string output = client_output(setting + "put " + name + "\nput " + name + "\n");
+        check(count(output, "(cached verdict)") == 1 && same_contents(local, remote), mode + ": a repeated upload uses the cached verdict");
+
+        // New contents with the same size and modification time, which the file index cannot tell apart
+        fs::file_time_type time = fs::last_write_time(local);
+        make_file(local, size, 3000 + static_cast<unsigned>(i));
+        fs::last_write_time(local, time);
+        output = client_output(setting + "put " + name + "\n");
+        check(output.find("Contents differ from the cached verdict") != string::npos && output.find("(cached verdict)") == string::npos
+            && same_contents(local, remote), mode + ": an edit keeping size and time is scanned again");
+
+        fs::copy_file(local, previous, fs::copy_options::overwrite_existing, ec);
+        plant_signature(local);
+        fs::last_write_time(local, time);
+        output = client_output(setting + "put " + name + "\n");
+        check(output.find("VIRUS DETECTED") != string::npos && same_contents(previous, remote), mode + ": an infected edit leaves the server's copy alone");
+
+        string failing = FAILING_STOR_MARKER + "_" + to_string(i) + ".bin";
+        make_file(g_client_dir / failing, size, 4000 + static_cast<unsigned>(i));
+        output = client_output(setting + "put " + failing + "\nput " + failing + "\n");
+        check(count(output, "UPLOAD_FAILED - File: " + failing) == 2 && output.find("(cached verdict)") == string::npos,
+            mode + ": an upload answered with 451 fails and is not cached");
+    }
+
+    bool leftovers = false;
+    for (const auto& entry : fs::directory_iterator(g_server_root)) {
+        string name = entry.path().filename().string();
+        leftovers = leftovers || (name.size() > 9 && name.compare(name.size() - 9, 9, ".scanning") == 0);
+    }
+    check(!leftovers, "no hidden uploads are left on the server");
+    return failed;
+}
+
+// Run one scenario. The client's scan verdict cache starts empty unless `keepScanCache` is set
+BenchResult run_scenario(const string& name, const string& script, int expectedFiles, bool keepScanCache) {
+    g_stats.reset();
+    if (!keepScanCache) {
+        error_code ec;
+        fs::remove(g_client_dir / "ftp_scan_cache.txt", ec);
+    }
+    BenchResult result;
+    result.name = name;
+    result.expected = expectedFiles;
+    result.seconds = max<double>(run_client(script) - g_session_overhead, 1e-6);
+    result.files = g_stats.files();
+    result.bytes = g_stats.bytes();
+    result.p50 = g_stats.percentile(50);
+    result.p99 = g_stats.percentile(99);
+    return result;
+}
+
+void print_header() {
+    cout << left << setw(26) << "scenario" << right << setw(8) << "files" << setw(14) << "bytes" << setw(9) << "sec"
+        << setw(10) << "MB/s" << setw(10) << "files/s" << setw(10) << "p50 ms" << setw(10) << "p99 ms" << endl;
+}
+
+void print_result(const BenchResult& result) {
+    cout << left << setw(26) << result.name << right << setw(8) << result.files << setw(14) << result.bytes
+        << fixed << setprecision(3) << setw(9) << result.seconds << setprecision(1)
+        << setw(10) << result.bytes / result.seconds / 1e6 << setw(10) << result.files / result.seconds
+        << setprecision(2) << setw(10) << result.p50 << setw(10) << result.p99 << defaultfloat;
+    if (result.files != result.expected) {
+        cout << "  INCOMPLETE (" << result.files << "/" << result.expected << ")";
+    }
+    cout << endl;
+}
+
+string size_label(long long size) {
+    if (size >= 1024 * 1024) return to_string(size / (1024 * 1024)) + "M";
+    return to_string(size / 1024) + "K";
+}
+
+int main(int argc, char* argv[]) {
+    bool quick = false;
+    fs::path workDir = "ftp_bench_data";
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--quick") quick = true;
+        else if (arg == "--legacy-agent") g_legacy_agent = true;
+        else if (arg == "--no-agent") g_external_agent = true;
+        else if (arg == "--port" && i + 1 < argc) g_ftp_port = static_cast<unsigned short>(atoi(argv[++i]));
+        else if (arg == "--dir" && i + 1 < argc) workDir = argv[++i];
+        else if (g_client.empty() && arg[0] != '-') g_client = fs::absolute(arg).string();
+        else {
+            g_client.clear();
+            break;
+        }
+    }
+    if (g_client.empty()) {
+        cerr << "Usage: ftp_bench <client executable> [--quick] [--legacy-agent | --no-agent] [--port N] [--dir <work directory>]" << endl;
+        return 1;
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "WSAStartup failed" << endl;
+        return 1;
+    }
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    // Fresh server root and client directory on every run
+    error_code ec;
+    fs::remove_all(workDir, ec);
+    g_server_root = fs::absolute(workDir / "server");
+    g_client_dir = fs::absolute(workDir / "client");
+    fs::create_directories(g_server_root);
+    fs::create_directories(g_client_dir);
+
+    SOCKET ftpListener = listen_on(g_ftp_port);
+    SOCKET scanListener = g_external_agent ? INVALID_SOCKET : listen_on(SCAN_AGENT_PORT);
+    if (ftpListener == INVALID_SOCKET || (!g_external_agent && scanListener == INVALID_SOCKET)) {
+        cerr << "Cannot listen on 127.0.0.1:" << (ftpListener == INVALID_SOCKET ? g_ftp_port : SCAN_AGENT_PORT)
+            << " (is another server running?)" << endl;
+        return 1;
+    }
+    thread(accept_loop, ftpListener, serve_ftp_session).detach();
+    if (!g_external_agent) thread(accept_loop, scanListener, serve_scan_session).detach();
+
+    vector<long long> sizes = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+    vector<int> counts = { 10, 100 };
+    if (!quick) {
+        sizes.push_back(256 * 1024 * 1024);
+        counts.push_back(1000);
+    }
+    const long long countFileSize = 16 * 1024;
+    const int treeDirectories = 10;
+
+    cout << "Preparing files in " << fs::absolute(workDir).string() << "..." << endl;
+    for (long long size : sizes) {
+        make_file(g_server_root / "sizes" / ("file_" + size_label(size) + ".bin"), size, static_cast<unsigned>(size));
+        make_file(g_client_dir / ("up_" + size_label(size) + ".bin"), size, static_cast<unsigned>(size) + 1);
+    }
+    const int bigCount = 16;
+    const long long bigFileSize = 4 * 1024 * 1024;
+    for (int i = 0; i < bigCount; i++) {
+        make_file(g_client_dir / "big" / ("b" + to_string(i) + ".bin"), bigFileSize, 1000 + i);
+    }
+    fs::create_directories(g_server_root / "big");
+    const long long infectedSize = 16 * 1024 * 1024;
+    make_file(g_client_dir / "up_eicar.bin", infectedSize, 7);
+    plant_signature(g_client_dir / "up_eicar.bin");
+    for (int count : counts) {
+        for (int i = 0; i < count; i++) {
+            string relative = "d" + to_string(i % treeDirectories) + "/f" + to_string(i) + ".dat";
+            make_file(g_server_root / ("tree_" + to_string(count)) / relative, countFileSize, i);
+            make_file(g_client_dir / ("tree_" + to_string(count)) / relative, countFileSize, i + 1);
+        }
+    }
+    fs::create_directories(g_client_dir / "sizes");
+    g_session_overhead = run_client("");
+    cout << "Client session overhead (open, login, quit): " << fixed << setprecision(3) << g_session_overhead << " s" << defaultfloat << "\n\n";
+
+    vector<BenchResult> results;
+    print_header();
+    auto run = [&](const string& name, const string& script, int expectedFiles, bool keepScanCache = false) {
+        results.push_back(run_scenario(name, script, expectedFiles, keepScanCache));
+        print_result(results.back());
+    };
+
+    // File-size matrix: the same file several times in one session, so latencies have a spread.
+    // Every put is scanned: the verdict cache would answer all but the first. "put hidden" scans
+    // while uploading to a hidden name and renames the file once clean
+    for (long long size : sizes) {
+        string label = size_label(size);
+        int repeats = size <= 1024 * 1024 ? 20 : size <= 16 * 1024 * 1024 ? 5 : 2;
+        string getScript, putScript;
+        for (int i = 0; i < repeats; i++) {
+            getScript += "get sizes/file_" + label + ".bin\n";
+            putScript += "put up_" + label + ".bin\n";
+        }
+        run("get " + label + " x" + to_string(repeats), getScript, repeats);
+        run("put " + label + " x" + to_string(repeats), "set scancache off\n" + putScript, repeats);
+        run("put hidden " + label + " x" + to_string(repeats), "set scancache off\nset pipeline hidden\n" + putScript, repeats);
+    }
+
+    // Infected uploads: the verdict comes with the first chunk, so the rest of the file is neither
+    // scanned nor read (with --legacy-agent all of it still is). A plain put stores nothing; a
+    // hidden one stores the part sent until the verdict, and deletes it
+    string eicarScript;
+    for (int i = 0; i < 5; i++) eicarScript += "put up_eicar.bin\n";
+    run("put EICAR " + size_label(infectedSize) + " x5", "set scancache off\n" + eicarScript, 0);
+    run("put hidden EICAR " + size_label(infectedSize) + " x5", "set scancache off\nset pipeline hidden\n" + eicarScript, 5);
+
+    // File-count matrix: batches of small files, sequential and over parallel connections
+    for (int count : counts) {
+        string tree = "tree_" + to_string(count);
+        string names;
+        for (int i = 0; i < count; i++) {
+            names += " " + tree + "/d" + to_string(i % treeDirectories) + "/f" + to_string(i) + ".dat";
+        }
+        string uploadDir = "rput_" + to_string(count);
+        string suffix = " " + to_string(count) + "x" + size_label(countFileSize);
+
+        run("mget" + suffix, "mget" + names + "\n", count);
+        run("mget -j 8" + suffix, "mget -j 8" + names + "\n", count);
+        run("mput" + suffix, "mput" + names + "\n", count);
+        run("mput -j 8" + suffix, "mput -j 8" + names + "\n", count);
+        run("mput -j 8 pipelined" + suffix, "set scancache off\nset pipeline on\nmput -j 8" + names + "\n", count);
+        run("mput -j 8 hidden" + suffix, "set scancache off\nset pipeline hidden\nmput -j 8" + names + "\n", count);
+        run("rget" + suffix, "rget " + tree + " rget_" + to_string(count) + "\n", count);
+        run("rget -j 8" + suffix, "rget -j 8 " + tree + " rgetj_" + to_string(count) + "\n", count);
+        run("rput" + suffix, "rput " + tree + " " + uploadDir + "\n", count);
+        run("rput unchanged" + suffix, "rput " + tree + " " + uploadDir + "\n", count, true);
+    }
+
+    // Parallel uploads of files large enough that streaming them to the scanner takes a while: each
+    // worker's scan must not wait for the others'
+    string bigNames;
+    for (int i = 0; i < bigCount; i++) bigNames += " big/b" + to_string(i) + ".bin";
+    string bigSuffix = " " + to_string(bigCount) + "x" + size_label(bigFileSize);
+    run("mput -j 8" + bigSuffix, "set scancache off\nmput -j 8" + bigNames + "\n", bigCount);
+    run("mput -j 8 pipelined" + bigSuffix, "set scancache off\nset pipeline on\nmput -j 8" + bigNames + "\n", bigCount);
+    run("mput -j 8 hidden" + bigSuffix, "set scancache off\nset pipeline hidden\nmput -j 8" + bigNames + "\n", bigCount);
+
+    int failedChecks = 0;
+    if (!g_legacy_agent) {
+        cout << "\nVerdict cache checks:" << endl;
+        failedChecks = run_cache_checks();
+    }
+
+    // Totals across the scenarios, as one line to compare between builds
+    long long totalBytes = 0;
+    int totalFiles = 0;
+    double totalSeconds = 0;
+    bool complete = true;
+    for (const BenchResult& result : results) {
+        totalBytes += result.bytes;
+        totalFiles += result.files;
+        totalSeconds += result.seconds;
+        complete = complete && result.files == result.expected;
+    }
+    cout << "\nTotal: " << totalFiles << " files, " << totalBytes << " bytes in " << fixed << setprecision(2) << totalSeconds
+        << " s" << defaultfloat << (complete ? "" : " - some scenarios did not complete, see client_output.txt") << endl;
+    if (failedChecks > 0) {
+        cout << failedChecks << " verdict cache checks failed, see client_output.txt" << endl;
+    }
+
+    fs::remove_all(workDir, ec);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return complete && failedChecks == 0 ? 0 : 2;
+}
@@ -1,7 +1,21 @@
 ﻿#include <iostream>
+#ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <afunix.h>
 #include <windows.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <csignal>
+#endif
 #include <string>
 #include <fstream>
 #include <vector>    
@@ -11,17 +25,78 @@
 #include <iomanip>
 #include <filesystem>
 #include <queue>
-
+#include <climits>
+#include <new>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <set>
+#include <map>
+#include <deque>
+#include <condition_variable>
+#include <string_view>
+#include <cstring>
+#include <bit>
+#include <cmath>
+#include <coroutine>
+#include <cstdint>
+#include <random>
+#include <exception>
+
+#ifdef _WIN32
 #pragma comment(lib, "ws2_32.lib")
+#else
+// POSIX spellings of the Winsock and MSVC CRT names used below, so both builds share one code path
+typedef int SOCKET;
+const SOCKET INVALID_SOCKET = -1;
+const int SOCKET_ERROR = -1;
+#define WSAEINTR EINTR
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define sscanf_s sscanf
+#define _fseeki64 fseeko
+#define _mkgmtime timegm
+#define SD_BOTH SHUT_RDWR
+inline int closesocket(SOCKET sock) { return close(sock); }
+inline int WSAGetLastError() { return errno; }
+inline int localtime_s(struct tm* result, const time_t* time) { return localtime_r(time, result) ? 0 : errno; }
+inline int fopen_s(FILE** file, const char* filename, const char* mode) {
+    *file = fopen(filename, mode);
+    return *file ? 0 : errno;
+}
+#endif
 using namespace std;
 namespace fs = std::filesystem;
 
 //Global variables for client state
 bool g_prompt_confirmation = true; // Controls confirmation prompt for mget/mput
-SOCKET g_control_sockfd = INVALID_SOCKET; // Main control socket for FTP server
-bool g_is_binary_mode = true; // True for binary, false for ASCII. Default to binary.
-bool g_passive_mode_preference = true; // True for passive (PASV), false for active (PORT). Client only supports PASV.
-string g_log_filename = "ftp_client.log"; // Default log file name
+string g_log_filename = "ftp_client.log"; // Log file, changed with "set logfile"
+size_t g_transfer_buffer_size = 1024 * 1024; // Data connection buffer size in bytes, changed with "set bufsize"
+int g_listing_cache_ttl = 60; // Seconds a directory listing is reused, 0 disables the cache; "set cachettl"
+int g_socket_timeout = 30; // Seconds to wait for a connect or an idle transfer before giving up; "set timeout"
+bool g_pipelined_upload = false; // True to scan and upload in a single read pass, changed with "set pipeline"
+bool g_hidden_upload = false; // Pipelined uploads go to a hidden name until the scan is clean, "set pipeline hidden"
+string g_scan_cache_filename = "ftp_scan_cache.txt"; // Scan verdict cache, "" when disabled; "set scancache"
+string g_trace_filename; // Trace file while "trace on" is active
+string g_username = "user"; // Login credentials, changed with the "user" command
+string g_password = "14022006";
+thread_local ostream* t_console = &cout; // Console of the current thread; pool workers capture it per file
+
+// Limits for the transfer buffer size
+const size_t MIN_TRANSFER_BUFFER_SIZE = 4 * 1024;
+const size_t MAX_TRANSFER_BUFFER_SIZE = 64 * 1024 * 1024;
+const size_t TRANSFER_BUFFER_ALIGNMENT = 4096;
+
+// Limits for parallel transfers
+const int MAX_PARALLEL_CONNECTIONS = 16;
+const long long MIN_SEGMENT_SIZE = 1024 * 1024;
+
+// Commands written to the control connection in one send() by FtpSession::pipeline
+const size_t PIPELINE_WINDOW = 32;
+
+class FtpSession;
 
 // Function prototypes for new commands
 void ftp_open(const string& ip, unsigned short port);
@@ -31,678 +106,3775 @@ void ftp_binary();
 void ftp_status();
 void ftp_passive_toggle();
 void display_help();
+void ftp_mget_parallel(FtpSession& session, const vector<string>& filenames, int jobs);
+void ftp_mput_parallel(FtpSession& session, const vector<string>& filenames, int jobs);
 
 // Logging functions
 void write_log(const string& message);
-string get_timestamp();
 void log_transfer(const string& operation, const string& filename, const string& status);
 void log_scan(const string& filename, const string& scan_result);
 
-// Logging implementation
-string get_timestamp() {
-    time_t now = time(0);
-    struct tm timeinfo;
-    localtime_s(&timeinfo, &now);
-
-    ostringstream oss;
-    oss << put_time(&timeinfo, "%Y-%m-%d %H:%M:%S");
-    return oss.str();
+// Console output of transfer functions, captured instead of printed when they run on a pool worker
+ostream& console() {
+    return *t_console;
 }
 
+// Log writer shared by all threads. write_log() only moves the message into a lock-free bounded
+// MPSC ring and returns; a background thread drains the ring in batches, adds the timestamps and
+// appends them to the log file, which stays open while the logger runs
+class AsyncLogger {
+public:
+    explicit AsyncLogger(size_t capacity = 4096) : m_capacity(capacity), m_slots(new Slot[capacity]) {
+        for (size_t i = 0; i < m_capacity; i++) {
+            m_slots[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+    ~AsyncLogger() { stop(); }
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    // Open (or create) the log file for appending and start the writer thread
+    bool start(const string& filename) {
+        stop();
+        FILE* file = nullptr;
+        fopen_s(&file, filename.c_str(), "ab");
+        if (!file) return false;
+        m_file = file;
+        m_stopping.store(false);
+        m_writer = thread([this]() { run(); });
+        return true;
+    }
+
+    // Write everything queued so far, then stop the writer thread and close the file
+    void stop() {
+        if (!m_writer.joinable()) return;
+        m_stopping.store(true);
+        wake();
+        m_writer.join();
+        fclose(m_file);
+        m_file = nullptr;
+    }
+
+    bool running() const { return m_writer.joinable(); }
+
+    // Queue a message. Producers never take a lock; only when the ring is full do they wait for
+    // the writer to make room, so no message is lost
+    void log(string message) {
+        time_t now = time(nullptr);
+        size_t position = m_enqueue.load(memory_order_relaxed);
+        while (true) {
+            Slot& slot = m_slots[position % m_capacity];
+            size_t sequence = slot.sequence.load(memory_order_acquire);
+            long long lag = static_cast<long long>(sequence) - static_cast<long long>(position);
+            if (lag == 0) {
+                if (m_enqueue.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    slot.time = now;
+                    slot.message = move(message);
+                    slot.sequence.store(position + 1, memory_order_release);
+                    break;
+                }
+            }
+            else if (lag < 0) {
+                wake(); // Full: let the writer drain it
+                this_thread::yield();
+                position = m_enqueue.load(memory_order_relaxed);
+            }
+            else {
+                position = m_enqueue.load(memory_order_relaxed);
+            }
+        }
+        wake();
+    }
+
+private:
+    struct Slot {
+        atomic<size_t> sequence{ 0 }; // Equals the position when free, position + 1 when filled
+        time_t time = 0;
+        string message;
+    };
+
+    size_t m_capacity;
+    unique_ptr<Slot[]> m_slots;
+    atomic<size_t> m_enqueue{ 0 };
+    size_t m_dequeue = 0; // Only touched by the writer thread
+    atomic<unsigned> m_signal{ 0 }; // Bumped by producers to wake the writer
+    atomic<bool> m_stopping{ false };
+    thread m_writer;
+    FILE* m_file = nullptr;
+
+    void wake() {
+        m_signal.fetch_add(1, memory_order_release);
+        m_signal.notify_one();
+    }
+
+    void run() {
+        string batch;
+        time_t stampTime = -1;
+        char stamp[32] = {};
+        while (true) {
+            unsigned seen = m_signal.load(memory_order_acquire);
+            // Take whatever is queued and write it with a single fwrite
+            while (true) {
+                Slot& slot = m_slots[m_dequeue % m_capacity];
+                if (slot.sequence.load(memory_order_acquire) != m_dequeue + 1) break;
+                if (slot.time != stampTime) {
+                    struct tm timeinfo;
+                    localtime_s(&timeinfo, &slot.time);
+                    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &timeinfo);
+                    stampTime = slot.time;
+                }
+                batch += "[";
+                batch += stamp;
+                batch += "] ";
+                batch += slot.message;
+                batch += "\n";
+                slot.message.clear();
+                slot.sequence.store(m_dequeue + m_capacity, memory_order_release);
+                m_dequeue++;
+            }
+            if (!batch.empty()) {
+                fwrite(batch.data(), 1, batch.size(), m_file);
+                fflush(m_file);
+                batch.clear();
+                continue;
+            }
+            if (m_stopping.load()) return;
+            m_signal.wait(seen, memory_order_acquire);
+        }
+    }
+};
+
+AsyncLogger g_logger;
+
+// Logging implementation
 void write_log(const string& message) {
-    ofstream logFile(g_log_filename, ios::app);
-    if (logFile.is_open()) {
-        logFile << "[" << get_timestamp() << "] " << message << endl;
-        logFile.close();
+    if (g_logger.running()) {
+        g_logger.log(message);
     }
 }
 
 void log_transfer(const string& operation, const string& filename, const string& status) {
     string logMessage = operation + " - File: " + filename + " - Status: " + status;
     write_log(logMessage);
-    cout << "LOG: " << logMessage << endl;
+    console() << "LOG: " << logMessage << endl;
 }
 
 void log_scan(const string& filename, const string& scan_result) {
     string logMessage = "SCAN - File: " + filename + " - Result: " + scan_result;
     write_log(logMessage);
-    cout << "LOG: " << logMessage << endl;
+    console() << "LOG: " << logMessage << endl;
 }
 
-//Function to connect to a server
-SOCKET connectToServer(const char* ip, unsigned short port) {
-    SOCKET sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd == INVALID_SOCKET) {
-        cerr << "Socket creation failed: " << WSAGetLastError() << "\n";
-        return INVALID_SOCKET;
+// Log-linear histogram in the style of HdrHistogram: 32 sub-buckets per power of two keep every
+// value to within about 3% over the whole 64-bit range. Recording is a handful of relaxed atomic
+// operations, so transfer threads record without locking
+class Histogram {
+public:
+    void record(long long value) {
+        value = max<long long>(value, 0);
+        m_buckets[bucket_of(value)].fetch_add(1, memory_order_relaxed);
+        m_count.fetch_add(1, memory_order_relaxed);
+        m_sum.fetch_add(value, memory_order_relaxed);
+        long long seen = m_max.load(memory_order_relaxed);
+        while (value > seen && !m_max.compare_exchange_weak(seen, value, memory_order_relaxed)) {
+        }
     }
 
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(port);
-    inet_pton(AF_INET, ip, &serverAddr.sin_addr);
-
-    if (connect(sockfd, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-        cerr << "Connect failed: " << WSAGetLastError() << "\n";
-        closesocket(sockfd);
-        return INVALID_SOCKET;
+    long long count() const { return m_count.load(memory_order_relaxed); }
+    long long sum() const { return m_sum.load(memory_order_relaxed); }
+    long long max_value() const { return m_max.load(memory_order_relaxed); }
+    double mean() const { return count() ? static_cast<double>(sum()) / count() : 0; }
+
+    // Value at or below which `percent` of the recorded values fall (highest value of its bucket)
+    long long percentile(double percent) const {
+        long long total = count();
+        if (total == 0) return 0;
+        long long rank = max<long long>(1, static_cast<long long>(ceil(percent / 100.0 * total)));
+        long long seen = 0;
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            seen += m_buckets[i].load(memory_order_relaxed);
+            if (seen >= rank) return min<long long>(bucket_top(i), max_value());
+        }
+        return max_value();
     }
-    return sockfd;
-}
-
-//Function to parse PASV response
-bool parsePasvResponse(const std::string& response, std::string& ip, int& port) {
-    size_t start = response.find('(');
-    size_t end = response.find(')');
-    if (start == std::string::npos || end == std::string::npos) return false;
-    std::string nums = response.substr(start + 1, end - start - 1);
-    int h1, h2, h3, h4, p1, p2;
-    if (sscanf_s(nums.c_str(), "%d,%d,%d,%d,%d,%d", &h1, &h2, &h3, &h4, &p1, &p2) != 6) return false;
-    ip = to_string(h1) + "." + to_string(h2) + "." + to_string(h3) + "." + to_string(h4);
-    port = p1 * 256 + p2;
-    return true;
-}
 
-//Function to send a command and receive response
-void sendCommand(int sockfd, const string& cmd) {
-    if (sockfd == INVALID_SOCKET) {
-        cout << "Not connected to server. Cannot send command.\n";
-        return;
-    }
-    send(sockfd, cmd.c_str(), static_cast<int>(cmd.length()), 0);
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
+    void reset() {
+        for (auto& bucket : m_buckets) bucket.store(0, memory_order_relaxed);
+        m_count.store(0, memory_order_relaxed);
+        m_sum.store(0, memory_order_relaxed);
+        m_max.store(0, memory_order_relaxed);
     }
-}
 
-//command "ls" : list all files in current directory
-void ftp_ls(int controlSock) {
-    if (controlSock == INVALID_SOCKET) {
-        cout << "Not connected to a server.\n";
-        write_log("LIST command failed - Not connected to server");
-        return;
-    }
-    if (!g_passive_mode_preference) {
-        cout << "Error: Client is not in passive mode. Active mode (PORT) is not supported for LIST.\n";
-        write_log("LIST command failed - Not in passive mode");
-        return;
-    }
+private:
+    static constexpr int SUB_BUCKET_BITS = 5;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr int BUCKET_COUNT = SUB_BUCKETS * (64 - SUB_BUCKET_BITS);
 
-    write_log("LIST command initiated");
+    atomic<long long> m_buckets[BUCKET_COUNT] = {};
+    atomic<long long> m_count{ 0 };
+    atomic<long long> m_sum{ 0 };
+    atomic<long long> m_max{ 0 };
 
-    send(controlSock, "PASV\r\n", 6, 0);
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived <= 0) {
-        cout << "No PASV response.\n";
-        write_log("LIST failed - No PASV response");
-        return;
+    // Values below 32 have a bucket each; above, the top 5 bits after the leading one pick the sub-bucket
+    static int bucket_of(long long value) {
+        if (value < SUB_BUCKETS) return static_cast<int>(value);
+        int shift = static_cast<int>(bit_width(static_cast<unsigned long long>(value))) - 1 - SUB_BUCKET_BITS;
+        return SUB_BUCKETS + shift * SUB_BUCKETS + static_cast<int>((value >> shift) - SUB_BUCKETS);
     }
-    buffer[bytesReceived] = '\0';
-    cout << "Server: " << buffer;
 
-    string ip;
-    int port;
-    if (!parsePasvResponse(buffer, ip, port)) {
-        cout << "Failed to parse PASV response.\n";
-        write_log("LIST failed - Failed to parse PASV response");
-        return;
+    static long long bucket_top(int bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        int shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+        long long sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
     }
+};
 
-    int dataSock = static_cast<int>(connectToServer(ip.c_str(), port));
-    if (dataSock == INVALID_SOCKET) {
-        cout << "Failed to open data connection.\n";
-        write_log("LIST failed - Failed to open data connection");
-        return;
+// Client-wide instrumentation behind the "stats" command: latency of every FTP verb (command sent
+// to first reply), duration of every transfer phase, and throughput per transfer direction.
+// Times are in microseconds of the monotonic clock, throughput in bytes per second
+class Metrics {
+public:
+    Histogram& verb(const string& name) { return find(m_verbs, name); }
+    Histogram& phase(const string& name) { return find(m_phases, name); }
+
+    // A finished transfer: `bytes` moved over the data connection in `micros`
+    void record_transfer(const string& direction, long long bytes, long long micros) {
+        Histogram& throughput = find(m_throughput, direction);
+        throughput.record(micros > 0 ? static_cast<long long>(bytes * 1e6 / micros) : 0);
+        lock_guard<mutex> lock(m_mutex);
+        m_bytes[direction] += bytes;
+        m_micros[direction] += micros;
+    }
+
+    void reset() {
+        lock_guard<mutex> lock(m_mutex);
+        for (auto* histograms : { &m_verbs, &m_phases, &m_throughput }) {
+            for (auto& [name, histogram] : *histograms) histogram->reset();
+        }
+        m_bytes.clear();
+        m_micros.clear();
+    }
+
+    void print(ostream& out) {
+        lock_guard<mutex> lock(m_mutex);
+        out << fixed << setprecision(2);
+        print_latencies(out, "Command latency (sent to first reply), ms:", m_verbs);
+        print_latencies(out, "Transfer phases, ms:", m_phases);
+        out << "Throughput:\n";
+        out << "  " << left << setw(12) << "direction" << right << setw(8) << "count" << setw(14) << "bytes"
+            << setw(12) << "MB/s" << setw(12) << "p50 MB/s" << setw(12) << "p10 MB/s" << "\n";
+        for (const auto& [direction, histogram] : m_throughput) {
+            if (histogram->count() == 0) continue;
+            double seconds = m_micros[direction] / 1e6;
+            out << "  " << left << setw(12) << direction << right << setw(8) << histogram->count() << setw(14) << m_bytes[direction]
+                << setw(12) << (seconds > 0 ? m_bytes[direction] / seconds / 1e6 : 0.0)
+                << setw(12) << histogram->percentile(50) / 1e6 << setw(12) << histogram->percentile(10) / 1e6 << "\n";
+        }
+        out << defaultfloat;
+    }
+
+    string json() {
+        lock_guard<mutex> lock(m_mutex);
+        ostringstream out;
+        out << "{\"commands\":" << latencies_json(m_verbs) << ",\"phases\":" << latencies_json(m_phases) << ",\"transfers\":{";
+        bool first = true;
+        for (const auto& [direction, histogram] : m_throughput) {
+            if (histogram->count() == 0) continue;
+            double seconds = m_micros[direction] / 1e6;
+            out << (first ? "" : ",") << "\"" << direction << "\":{\"count\":" << histogram->count()
+                << ",\"bytes\":" << m_bytes[direction] << ",\"seconds\":" << seconds
+                << ",\"bytes_per_sec\":" << static_cast<long long>(seconds > 0 ? m_bytes[direction] / seconds : 0)
+                << ",\"p50_bytes_per_sec\":" << histogram->percentile(50) << ",\"p10_bytes_per_sec\":" << histogram->percentile(10) << "}";
+            first = false;
+        }
+        out << "}}";
+        return out.str();
+    }
+
+private:
+    mutex m_mutex; // Guards the maps; histograms are never removed, so references stay valid
+    map<string, unique_ptr<Histogram>> m_verbs;
+    map<string, unique_ptr<Histogram>> m_phases;
+    map<string, unique_ptr<Histogram>> m_throughput;
+    map<string, long long> m_bytes;
+    map<string, long long> m_micros;
+
+    // The histogram of `name`, created on first use. Each thread keeps the histograms it has used,
+    // so m_mutex is only taken the first time a thread records a name
+    Histogram& find(map<string, unique_ptr<Histogram>>& histograms, const string& name) {
+        thread_local map<pair<const void*, string>, Histogram*> used;
+        Histogram*& cached = used[{ &histograms, name }];
+        if (!cached) {
+            lock_guard<mutex> lock(m_mutex);
+            unique_ptr<Histogram>& histogram = histograms[name];
+            if (!histogram) histogram = make_unique<Histogram>();
+            cached = histogram.get();
+        }
+        return *cached;
+    }
+
+    static void print_latencies(ostream& out, const string& title, const map<string, unique_ptr<Histogram>>& histograms) {
+        out << title << "\n";
+        out << "  " << left << setw(12) << "name" << right << setw(8) << "count" << setw(10) << "mean"
+            << setw(10) << "p50" << setw(10) << "p90" << setw(10) << "p99" << setw(10) << "max" << "\n";
+        for (const auto& [name, histogram] : histograms) {
+            if (histogram->count() == 0) continue;
+            out << "  " << left << setw(12) << name << right << setw(8) << histogram->count() << setw(10) << histogram->mean() / 1000
+                << setw(10) << histogram->percentile(50) / 1000.0 << setw(10) << histogram->percentile(90) / 1000.0
+                << setw(10) << histogram->percentile(99) / 1000.0 << setw(10) << histogram->max_value() / 1000.0 << "\n";
+        }
     }
 
-    send(controlSock, "LIST\r\n", 6, 0);
-    bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
+    static string latencies_json(const map<string, unique_ptr<Histogram>>& histograms) {
+        ostringstream out;
+        out << "{";
+        bool first = true;
+        for (const auto& [name, histogram] : histograms) {
+            if (histogram->count() == 0) continue;
+            out << (first ? "" : ",") << "\"" << name << "\":{\"count\":" << histogram->count()
+                << ",\"mean_us\":" << static_cast<long long>(histogram->mean()) << ",\"p50_us\":" << histogram->percentile(50)
+                << ",\"p90_us\":" << histogram->percentile(90) << ",\"p99_us\":" << histogram->percentile(99)
+                << ",\"max_us\":" << histogram->max_value() << "}";
+            first = false;
+        }
+        out << "}";
+        return out.str();
     }
+};
 
-    cout << "Directory listing:\n";
-    while ((bytesReceived = recv(dataSock, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << buffer << flush;
-    }
-    cout << endl;
+Metrics g_metrics;
 
-    closesocket(dataSock);
+// Microseconds of the monotonic clock since `start`
+long long micros_since(chrono::steady_clock::time_point start) {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+}
 
-    bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
+// Timeline of transfer phases behind "trace on <file>", written as Chrome trace-event JSON for
+// chrome://tracing or Perfetto. Every span is a complete ("X") event on a lane (the trace's tid):
+// one lane per thread, plus one per coroutine session since those share a thread. Events are
+// appended to the file as they happen; stop() closes the JSON array
+class Tracer {
+public:
+    Tracer() : m_main_thread(this_thread::get_id()) {}
+    ~Tracer() { stop(); }
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Create (or truncate) the trace file and start recording
+    bool start(const string& filename) {
+        stop();
+        FILE* file = nullptr;
+        if (fopen_s(&file, filename.c_str(), "w") != 0 || !file) {
+            return false;
+        }
+        lock_guard<mutex> lock(m_mutex);
+        m_file = file;
+        m_origin = chrono::steady_clock::now();
+        m_named_lanes.clear();
+        fputs("[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"FTP client\"}}", m_file);
+        m_enabled.store(true, memory_order_release);
+        return true;
+    }
+
+    // Stop recording and finish the trace file
+    void stop() {
+        m_enabled.store(false, memory_order_release);
+        lock_guard<mutex> lock(m_mutex);
+        if (!m_file) return;
+        fputs("\n]\n", m_file);
+        fclose(m_file);
+        m_file = nullptr;
+    }
+
+    bool enabled() const { return m_enabled.load(memory_order_acquire); }
+
+    // New lane named `name` followed by its number
+    int new_lane(const string& name) {
+        lock_guard<mutex> lock(m_mutex);
+        int lane = ++m_lane_count;
+        m_lane_names[lane] = name + " " + to_string(lane);
+        return lane;
+    }
+
+    // Lane of the calling thread
+    int thread_lane() {
+        thread_local int lane = 0;
+        if (lane == 0) {
+            lane = this_thread::get_id() == m_main_thread ? new_lane("main") : new_lane("thread");
+        }
+        return lane;
     }
 
-    write_log("LIST command completed successfully");
-}
+    // Record the span [begin, end] of `name` on `lane`; `target` (a file or directory, may be empty)
+    // is shown among the span's arguments
+    void span(const char* name, chrono::steady_clock::time_point begin, chrono::steady_clock::time_point end, int lane, const string& target) {
+        lock_guard<mutex> lock(m_mutex);
+        if (!m_file) return;
+        if (m_named_lanes.insert(lane).second) {
+            fprintf(m_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                lane, escaped(m_lane_names[lane]).c_str());
+        }
+        begin = max<chrono::steady_clock::time_point>(begin, m_origin);
+        long long start = chrono::duration_cast<chrono::microseconds>(begin - m_origin).count();
+        long long duration = max<long long>(chrono::duration_cast<chrono::microseconds>(end - begin).count(), 0);
+        fprintf(m_file, ",\n{\"name\":\"%s\",\"cat\":\"ftp\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d",
+            name, start, duration, lane);
+        if (!target.empty()) {
+            fprintf(m_file, ",\"args\":{\"target\":\"%s\"}", escaped(target).c_str());
+        }
+        fputs("}", m_file);
+    }
+
+private:
+    mutex m_mutex; // Guards the file and the lane tables
+    atomic<bool> m_enabled{ false };
+    FILE* m_file = nullptr;
+    chrono::steady_clock::time_point m_origin; // ts 0 of the trace
+    thread::id m_main_thread;
+    int m_lane_count = 0;
+    map<int, string> m_lane_names;
+    set<int> m_named_lanes; // Lanes whose thread_name event is already in the current file
+
+    // `text` as the contents of a JSON string
+    static string escaped(const string& text) {
+        string result;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", c);
+                result += code;
+            }
+            else {
+                result += c;
+            }
+        }
+        return result;
+    }
+};
 
-//command "pwd" : show current directory on server
-void ftp_pwd(int sockfd) {
-    if (sockfd == INVALID_SOCKET) {
-        cout << "Not connected to a server.\n";
-        write_log("PWD command failed - Not connected to server");
-        return;
+Tracer g_tracer;
+
+// Monotonic timestamps along one operation: mark() records the time since the previous mark (or
+// since construction / restart) as the duration of the named phase and returns it in microseconds.
+// While tracing, every phase is also a span on `lane` (0: the calling thread's lane) about `target`
+class PhaseClock {
+public:
+    explicit PhaseClock(string target = "", int lane = 0) : m_target(move(target)), m_lane(lane), m_last(chrono::steady_clock::now()) {}
+
+    long long mark(const char* phase) {
+        auto now = chrono::steady_clock::now();
+        long long micros = chrono::duration_cast<chrono::microseconds>(now - m_last).count();
+        g_metrics.phase(phase).record(micros);
+        if (g_tracer.enabled()) {
+            g_tracer.span(phase, m_last, now, m_lane != 0 ? m_lane : g_tracer.thread_lane(), m_target);
+        }
+        m_last = now;
+        return micros;
     }
 
-    write_log("PWD command initiated");
+    // Start the next phase now, leaving the time since the last mark unrecorded
+    void restart() { m_last = chrono::steady_clock::now(); }
 
-    send(sockfd, "PWD\r\n", 5, 0);
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
+private:
+    string m_target;
+    int m_lane;
+    chrono::steady_clock::time_point m_last;
+};
 
-        string virtualPath;
-        size_t firstQuote = string(buffer).find('"');
-        size_t lastQuote = string(buffer).rfind('"');
-        if (firstQuote != string::npos && lastQuote != string::npos && lastQuote > firstQuote) {
-            virtualPath = string(buffer).substr(firstQuote + 1, lastQuote - firstQuote - 1);
-            string nativeBase = "C:\\data";
-            string nativePath = nativeBase + "\\" + virtualPath.substr(1);
-            cout << "Mapped native path: " << nativePath << endl;
-            write_log("PWD command completed - Current directory: " + virtualPath);
+// Trace span of a whole operation (a file transfer, a directory listing), from construction to
+// destruction, so the phases recorded meanwhile on the same lane nest below it
+class TraceSpan {
+public:
+    TraceSpan(const char* name, string target, int lane = 0)
+        : m_name(name), m_target(move(target)), m_lane(lane), m_start(chrono::steady_clock::now()) {}
+    ~TraceSpan() {
+        if (g_tracer.enabled()) {
+            g_tracer.span(m_name, m_start, chrono::steady_clock::now(), m_lane != 0 ? m_lane : g_tracer.thread_lane(), m_target);
         }
     }
-    else {
-        write_log("PWD command failed - No response from server");
-    }
-}
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
 
-//command "cd" : change directory on server
-void ftp_cd(int sockfd, const string& dir) {
-    if (sockfd == INVALID_SOCKET) {
-        cout << "Not connected to a server.\n";
-        write_log("CD command failed - Not connected to server");
-        return;
-    }
+private:
+    const char* m_name;
+    string m_target;
+    int m_lane;
+    chrono::steady_clock::time_point m_start;
+};
 
-    write_log("CD command initiated - Target directory: " + dir);
+// Readiness events reported by IoEngine
+const unsigned IO_READ = 1;
+const unsigned IO_WRITE = 2;
+const unsigned IO_ERROR = 4; // Error or hang-up; always reported, never needs to be requested
+
+// Switch a socket between blocking and non-blocking mode
+bool set_socket_blocking(SOCKET sock, bool blocking) {
+#ifdef _WIN32
+    u_long nonBlocking = blocking ? 0 : 1;
+    return ioctlsocket(sock, FIONBIO, &nonBlocking) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) return false;
+    return fcntl(sock, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK)) == 0;
+#endif
+}
 
-    string cmd = "CWD " + dir + "\r\n";
-    send(sockfd, cmd.c_str(), static_cast<int>(cmd.length()), 0);
+// True when the last call on a non-blocking socket failed only because it would have blocked
+bool socket_would_block() {
+    int error = WSAGetLastError();
+#ifdef _WIN32
+    return error == WSAEWOULDBLOCK || error == WSAEINTR;
+#else
+    return error == EWOULDBLOCK || error == EAGAIN || error == EINPROGRESS || error == EINTR;
+#endif
+}
 
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
+// Readiness-driven event loop over sockets and timers, backed by epoll on Linux and WSAPoll on
+// Windows. Handlers run on the thread calling run_once(); an engine belongs to a single thread
+class IoEngine {
+public:
+    using Handler = function<void(unsigned events)>;
+    using TimerId = unsigned long long;
+
+    IoEngine() {
+#ifndef _WIN32
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+#endif
+    }
+    ~IoEngine() {
+#ifndef _WIN32
+        if (m_epoll >= 0) close(m_epoll);
+#endif
+    }
+    IoEngine(const IoEngine&) = delete;
+    IoEngine& operator=(const IoEngine&) = delete;
+
+    // Call handler whenever sock is ready for `events` (IO_READ and/or IO_WRITE). Watching a
+    // socket again replaces its events and handler
+    bool watch(SOCKET sock, unsigned events, Handler handler) {
+#ifndef _WIN32
+        epoll_event event = {};
+        event.events = to_epoll(events);
+        event.data.fd = sock;
+        if (epoll_ctl(m_epoll, m_watches.count(sock) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, sock, &event) != 0) return false;
+#endif
+        m_watches[sock] = { events, move(handler) };
+        return true;
+    }
+
+    // Stop watching a socket; must be called before the socket is closed
+    void unwatch(SOCKET sock) {
+        if (m_watches.erase(sock) == 0) return;
+#ifndef _WIN32
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, sock, nullptr);
+#endif
+    }
+
+    // Call callback once after `milliseconds`, unless the timer is cancelled first
+    TimerId add_timer(int milliseconds, function<void()> callback) {
+        TimerId id = ++m_lastTimer;
+        auto due = chrono::steady_clock::now() + chrono::milliseconds(milliseconds);
+        m_timers[{ due, id }] = move(callback);
+        m_timerDue[id] = due;
+        return id;
+    }
+
+    void cancel_timer(TimerId id) {
+        auto it = m_timerDue.find(id);
+        if (it == m_timerDue.end()) return;
+        m_timers.erase({ it->second, id });
+        m_timerDue.erase(it);
+    }
+
+    // True when nothing is watched and no timer is pending, i.e. run() would return
+    bool idle() const { return m_watches.empty() && m_timers.empty(); }
+
+    // Wait for readiness until the next timer is due (at most maxWaitMs if not negative), then
+    // run the handlers of ready sockets and expired timers. Returns false if waiting failed
+    bool run_once(int maxWaitMs = -1) {
+        int timeout = maxWaitMs;
+        if (!m_timers.empty()) {
+            auto untilDue = chrono::duration_cast<chrono::milliseconds>(m_timers.begin()->first.first - chrono::steady_clock::now()).count();
+            int timerWait = static_cast<int>(max<long long>(0, min<long long>(untilDue + 1, INT_MAX)));
+            timeout = timeout < 0 ? timerWait : min<int>(timeout, timerWait);
+        }
 
-        if (strncmp(buffer, "250", 3) == 0) {
-            write_log("CD command completed successfully - Changed to: " + dir);
+#ifdef _WIN32
+        vector<WSAPOLLFD> fds;
+        for (const auto& [sock, watched] : m_watches) {
+            WSAPOLLFD fd = {};
+            fd.fd = sock;
+            fd.events = ((watched.events & IO_READ) ? POLLRDNORM : 0) | ((watched.events & IO_WRITE) ? POLLWRNORM : 0);
+            fds.push_back(fd);
+        }
+        if (fds.empty()) {
+            if (timeout < 0) return false; // Nothing could ever become ready
+            this_thread::sleep_for(chrono::milliseconds(timeout));
         }
         else {
-            write_log("CD command failed - Server response: " + string(buffer));
+            int count = WSAPoll(fds.data(), static_cast<ULONG>(fds.size()), timeout);
+            if (count == SOCKET_ERROR) return false;
+            for (const WSAPOLLFD& fd : fds) {
+                if (fd.revents == 0) continue;
+                unsigned events = ((fd.revents & POLLRDNORM) ? IO_READ : 0) | ((fd.revents & POLLWRNORM) ? IO_WRITE : 0) |
+                    ((fd.revents & (POLLERR | POLLHUP | POLLNVAL)) ? IO_ERROR : 0);
+                dispatch(fd.fd, events);
+            }
         }
+#else
+        epoll_event events[64];
+        int count = epoll_wait(m_epoll, events, 64, timeout);
+        if (count < 0 && errno != EINTR) return false;
+        for (int i = 0; i < count; i++) {
+            unsigned ready = ((events[i].events & EPOLLIN) ? IO_READ : 0) | ((events[i].events & EPOLLOUT) ? IO_WRITE : 0) |
+                ((events[i].events & (EPOLLERR | EPOLLHUP)) ? IO_ERROR : 0);
+            dispatch(events[i].data.fd, ready);
+        }
+#endif
+
+        // Expired timers; a callback may add or cancel timers, so take them one at a time
+        auto now = chrono::steady_clock::now();
+        while (!m_timers.empty() && m_timers.begin()->first.first <= now) {
+            auto next = m_timers.begin();
+            function<void()> callback = move(next->second);
+            m_timerDue.erase(next->first.second);
+            m_timers.erase(next);
+            callback();
+        }
+        return true;
     }
-    else {
-        write_log("CD command failed - No response from server");
+
+    // Run until nothing is watched and no timer is pending
+    void run() {
+        while (!idle() && run_once()) {
+        }
     }
-}
 
-//command "lcd" : change local directory
-void ftp_lcd(const string& localDir) {
-    write_log("LCD command initiated - Target directory: " + localDir);
+private:
+    struct Watch {
+        unsigned events = 0;
+        Handler handler;
+    };
 
-    wstring wideLocalDir(localDir.begin(), localDir.end());
+    map<SOCKET, Watch> m_watches;
+    map<pair<chrono::steady_clock::time_point, TimerId>, function<void()>> m_timers; // Ordered by due time
+    map<TimerId, chrono::steady_clock::time_point> m_timerDue;
+    TimerId m_lastTimer = 0;
+#ifndef _WIN32
+    int m_epoll = -1;
 
-    if (SetCurrentDirectory(wideLocalDir.c_str())) {
-        cout << "Local directory changed to: " << localDir << endl;
-        write_log("LCD command completed successfully - Changed to: " + localDir);
-    }
-    else {
-        cout << "Failed to change local directory.\n";
-        write_log("LCD command failed - Unable to change to: " + localDir);
+    static uint32_t to_epoll(unsigned events) {
+        return ((events & IO_READ) ? uint32_t(EPOLLIN) : 0u) | ((events & IO_WRITE) ? uint32_t(EPOLLOUT) : 0u);
     }
-}
+#endif
 
-//command "lpwd" : local directory
-void ftp_lpwd() {
-    write_log("LPWD command initiated");
+    void dispatch(SOCKET sock, unsigned events) {
+        // An earlier handler of the same round may have unwatched the socket
+        auto it = m_watches.find(sock);
+        if (it == m_watches.end()) return;
+        unsigned ready = events & (it->second.events | IO_ERROR);
+        if (ready == 0) return;
+        Handler handler = it->second.handler; // The handler may unwatch its own socket
+        handler(ready);
+    }
+};
 
-    wchar_t path[MAX_PATH];
-    if (GetCurrentDirectoryW(MAX_PATH, path)) {
-        wcout << L"Local directory: " << path << endl;
+// Engine of the calling thread, used by blocking helpers such as connectToServer
+IoEngine& thread_io_engine() {
+    thread_local IoEngine engine;
+    return engine;
+}
 
-        // Convert wide string to regular string for logging
-        string pathStr(path, path + wcslen(path));
-        write_log("LPWD command completed - Current local directory: " + pathStr);
+// Wait until sock is ready for `events` or timeoutMs passed. Returns the ready events, 0 on timeout.
+// A timeout of 0 only polls, without the rounding up of a timer
+unsigned wait_socket(SOCKET sock, unsigned events, int timeoutMs) {
+    IoEngine& engine = thread_io_engine();
+    unsigned ready = 0;
+    engine.watch(sock, events, [&](unsigned readyEvents) { ready = readyEvents; });
+    if (timeoutMs <= 0) {
+        engine.run_once(0);
     }
     else {
-        wcout << L"Failed to get local directory.\n";
-        write_log("LPWD command failed - Unable to get current directory");
+        bool expired = false;
+        IoEngine::TimerId timer = engine.add_timer(timeoutMs, [&]() { expired = true; });
+        while (ready == 0 && !expired && engine.run_once()) {
+        }
+        engine.cancel_timer(timer);
     }
+    engine.unwatch(sock);
+    return ready;
 }
 
-//command "mkdir" : create directory on server
-void ftp_mkdir(int sockfd, const string& dirname) {
+// Start a non-blocking connect. The socket reports IO_WRITE once the connect finished, after
+// which finish_connect() tells whether it succeeded. Returns INVALID_SOCKET on immediate failure
+SOCKET begin_connect(const char* ip, unsigned short port) {
+    SOCKET sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd == INVALID_SOCKET) {
-        cout << "Not connected to a server.\n";
-        write_log("MKDIR command failed - Not connected to server");
-        return;
+        cerr << "Socket creation failed: " << WSAGetLastError() << "\n";
+        return INVALID_SOCKET;
     }
 
-    write_log("MKDIR command initiated - Directory: " + dirname);
-
-    string cmd = "MKD " + dirname + "\r\n";
-    send(sockfd, cmd.c_str(), static_cast<int>(cmd.length()), 0);
-
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
-
-        if (strncmp(buffer, "257", 3) == 0) {
-            write_log("MKDIR command completed successfully - Created: " + dirname);
-        }
-        else {
-            write_log("MKDIR command failed - Server response: " + string(buffer));
-        }
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &serverAddr.sin_addr) != 1) {
+        cerr << "Invalid server address: " << ip << "\n";
+        closesocket(sockfd);
+        return INVALID_SOCKET;
     }
-    else {
-        write_log("MKDIR command failed - No response from server");
+
+    if (!set_socket_blocking(sockfd, false) ||
+        (connect(sockfd, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR && !socket_would_block())) {
+        cerr << "Connect failed: " << WSAGetLastError() << "\n";
+        closesocket(sockfd);
+        return INVALID_SOCKET;
     }
+    return sockfd;
 }
 
-//command "rmdir" : remove directory on server
-void ftp_rmdir(int sockfd, const string& dirname) {
-    if (sockfd == INVALID_SOCKET) {
-        cout << "Not connected to a server.\n";
-        write_log("RMDIR command failed - Not connected to server");
-        return;
+// Result of a connect started by begin_connect(), once the socket reported readiness
+bool finish_connect(SOCKET sock) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &length) != 0 || error != 0) {
+        cerr << "Connect failed: " << error << "\n";
+        return false;
     }
+    return true;
+}
 
-    write_log("RMDIR command initiated - Directory: " + dirname);
-
-    string cmd = "RMD " + dirname + "\r\n";
-    send(sockfd, cmd.c_str(), static_cast<int>(cmd.length()), 0);
-
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
+//Function to connect to a server, giving up after g_socket_timeout seconds. Returns a blocking socket
+SOCKET connectToServer(const char* ip, unsigned short port) {
+    SOCKET sockfd = begin_connect(ip, port);
+    if (sockfd == INVALID_SOCKET) return INVALID_SOCKET;
 
-        if (strncmp(buffer, "250", 3) == 0) {
-            write_log("RMDIR command completed successfully - Removed: " + dirname);
-        }
-        else {
-            write_log("RMDIR command failed - Server response: " + string(buffer));
-        }
+    if (wait_socket(sockfd, IO_WRITE, g_socket_timeout * 1000) == 0) {
+        cerr << "Connect failed: no answer from " << ip << ":" << port << " within " << g_socket_timeout << " s\n";
+        closesocket(sockfd);
+        return INVALID_SOCKET;
     }
-    else {
-        write_log("RMDIR command failed - No response from server");
+    if (!finish_connect(sockfd) || !set_socket_blocking(sockfd, true)) {
+        closesocket(sockfd);
+        return INVALID_SOCKET;
     }
+    return sockfd;
 }
 
-//command "delete" : delete file on server
-void ftp_delete(int sockfd, const string& filename) {
-    if (sockfd == INVALID_SOCKET) {
-        cout << "Not connected to a server.\n";
-        write_log("DELETE command failed - Not connected to server");
-        return;
-    }
+// Lazily started coroutine returning T. A task runs when it is awaited, or when start() is called
+// on a top-level task; the awaiting coroutine resumes as soon as the task returns. The task owns
+// its coroutine frame, so it must outlive the coroutine
+template <typename T>
+class Task {
+public:
+    struct promise_type {
+        T value{};
+        exception_ptr exception;
+        coroutine_handle<> continuation; // Coroutine awaiting this task, if any
+
+        Task get_return_object() { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+        suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> finished) noexcept {
+                coroutine_handle<> continuation = finished.promise().continuation;
+                return continuation ? continuation : noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
 
-    write_log("DELETE command initiated - File: " + filename);
+        void return_value(T result) { value = move(result); }
+        void unhandled_exception() { exception = current_exception(); }
+    };
 
-    string cmd = "DELE " + filename + "\r\n";
-    send(sockfd, cmd.c_str(), static_cast<int>(cmd.length()), 0);
+    Task(Task&& other) noexcept : m_handle(other.m_handle) {
+        other.m_handle = nullptr;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (m_handle) m_handle.destroy();
+    }
 
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
+    // Run a top-level task until its first suspension; the event loop resumes it from there
+    void start() { m_handle.resume(); }
+    bool done() const { return m_handle.done(); }
 
-        if (strncmp(buffer, "250", 3) == 0) {
-            write_log("DELETE command completed successfully - Deleted: " + filename);
-        }
-        else {
-            write_log("DELETE command failed - Server response: " + string(buffer));
-        }
+    bool await_ready() const noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept {
+        m_handle.promise().continuation = awaiting;
+        return m_handle;
     }
-    else {
-        write_log("DELETE command failed - No response from server");
+    T await_resume() {
+        if (m_handle.promise().exception) rethrow_exception(m_handle.promise().exception);
+        return move(m_handle.promise().value);
     }
-}
 
-//command "rename" : rename file on server
-void ftp_rename(int sockfd, const string& oldname, const string& newname) {
-    if (sockfd == INVALID_SOCKET) {
-        cout << "Not connected to a server.\n";
-        write_log("RENAME command failed - Not connected to server");
-        return;
-    }
+private:
+    explicit Task(coroutine_handle<promise_type> handle) : m_handle(handle) {}
+    coroutine_handle<promise_type> m_handle;
+};
 
-    write_log("RENAME command initiated - From: " + oldname + " To: " + newname);
+// Awaitable that suspends a coroutine until sock is ready for `events` on the engine or timeoutMs
+// passed. co_await yields the ready events, 0 on timeout
+class SocketReady {
+public:
+    SocketReady(IoEngine& engine, SOCKET sock, unsigned events, int timeoutMs)
+        : m_engine(engine), m_sock(sock), m_events(events), m_timeoutMs(timeoutMs) {
+    }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> waiting) {
+        m_engine.watch(m_sock, m_events, [this, waiting](unsigned ready) {
+            m_ready = ready;
+            m_engine.cancel_timer(m_timer);
+            m_engine.unwatch(m_sock);
+            waiting.resume();
+        });
+        m_timer = m_engine.add_timer(m_timeoutMs, [this, waiting]() {
+            m_engine.unwatch(m_sock);
+            waiting.resume();
+        });
+    }
+    unsigned await_resume() const noexcept { return m_ready; }
+
+private:
+    IoEngine& m_engine;
+    SOCKET m_sock;
+    unsigned m_events;
+    int m_timeoutMs;
+    unsigned m_ready = 0;
+    IoEngine::TimerId m_timer = 0;
+};
 
-    string cmd1 = "RNFR " + oldname + "\r\n";
-    send(sockfd, cmd1.c_str(), static_cast<int>(cmd1.length()), 0);
+//Function to parse PASV response
+bool parsePasvResponse(std::string_view response, std::string& ip, int& port) {
+    size_t start = response.find('(');
+    size_t end = response.find(')');
+    if (start == std::string::npos || end == std::string::npos) return false;
+    std::string nums(response.substr(start + 1, end - start - 1));
+    int h1, h2, h3, h4, p1, p2;
+    if (sscanf_s(nums.c_str(), "%d,%d,%d,%d,%d,%d", &h1, &h2, &h3, &h4, &p1, &p2) != 6) return false;
+    ip = to_string(h1) + "." + to_string(h2) + "." + to_string(h3) + "." + to_string(h4);
+    port = p1 * 256 + p2;
+    return true;
+}
 
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived <= 0) {
-        cout << "No response after RNFR.\n";
-        write_log("RENAME command failed - No response after RNFR");
-        return;
+// Page-aligned heap buffer used by the transfer engine
+class TransferBuffer {
+public:
+    explicit TransferBuffer(size_t size)
+        : m_size(size),
+          m_data(static_cast<char*>(::operator new[](size, std::align_val_t(TRANSFER_BUFFER_ALIGNMENT)))) {
     }
-    buffer[bytesReceived] = '\0';
-    cout << "Server: " << buffer;
-
-    if (strncmp(buffer, "350", 3) != 0) {
-        cout << "RNFR failed. Aborting rename.\n";
-        write_log("RENAME command failed - RNFR failed: " + string(buffer));
-        return;
+    ~TransferBuffer() {
+        ::operator delete[](m_data, std::align_val_t(TRANSFER_BUFFER_ALIGNMENT));
     }
+    TransferBuffer(const TransferBuffer&) = delete;
+    TransferBuffer& operator=(const TransferBuffer&) = delete;
 
-    string cmd2 = "RNTO " + newname + "\r\n";
-    send(sockfd, cmd2.c_str(), static_cast<int>(cmd2.length()), 0);
+    char* data() { return m_data; }
+    size_t size() const { return m_size; }
 
-    memset(buffer, 0, sizeof(buffer));
-    bytesReceived = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
+private:
+    size_t m_size;
+    char* m_data;
+};
 
-        if (strncmp(buffer, "250", 3) == 0) {
-            write_log("RENAME command completed successfully - From: " + oldname + " To: " + newname);
-        }
-        else {
-            write_log("RENAME command failed - RNTO failed: " + string(buffer));
+// Send the whole buffer, retrying on short writes
+bool send_all(SOCKET sock, const char* data, size_t length) {
+    while (length > 0) {
+        int chunk = static_cast<int>(min<size_t>(length, INT_MAX));
+        int sent = send(sock, data, chunk, 0);
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEINTR) continue;
+            return false;
         }
+        data += sent;
+        length -= sent;
     }
-    else {
-        cout << "No response after RNTO.\n";
-        write_log("RENAME command failed - No response after RNTO");
+    return true;
+}
+
+// Size the kernel send buffer of a data connection to match the transfer buffer. The receive
+// buffer is left to the kernel: set on a connected socket it can no longer widen the TCP window
+void tune_data_socket(SOCKET sock) {
+    int size = static_cast<int>(min<size_t>(g_transfer_buffer_size, 4 * 1024 * 1024));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&size), sizeof(size));
+}
+
+// Open a local file for a transfer; stdio buffering is disabled because the engine writes whole buffers
+FILE* open_transfer_file(const string& filename, const char* mode) {
+    FILE* file = nullptr;
+    fopen_s(&file, filename.c_str(), mode);
+    if (file) {
+        setvbuf(file, nullptr, _IONBF, 0);
     }
+    return file;
 }
 
-//command "get/recv" : download single file from server
-void ftp_get(int controlSock, const string& filename) {
-    if (controlSock == INVALID_SOCKET) {
+// Drain a data connection into a file, stopping after limit bytes if limit is not negative.
+// Marks the "first_byte" phase on `phases` when data starts to arrive.
+// Returns bytes written, or -1 on a socket or disk error
+long long transfer_socket_to_file(SOCKET dataSock, FILE* file, TransferBuffer& buffer, long long limit = -1, PhaseClock* phases = nullptr) {
+    long long total = 0;
+    size_t filled = 0;
+    while (true) {
+        size_t wanted = buffer.size() - filled;
+        if (limit >= 0) {
+            wanted = static_cast<size_t>(min<long long>(static_cast<long long>(wanted), limit - total - static_cast<long long>(filled)));
+        }
+        int received = 0;
+        if (wanted > 0) {
+            received = recv(dataSock, buffer.data() + filled, static_cast<int>(min<size_t>(wanted, INT_MAX)), 0);
+            if (received == SOCKET_ERROR && WSAGetLastError() == WSAEINTR) continue;
+        }
+        if (received > 0) {
+            if (phases && total == 0 && filled == 0) {
+                phases->mark("first_byte");
+            }
+            filled += received;
+            if (filled < buffer.size()) continue;
+        }
+        // Flush when the buffer is full, the peer closed the connection or recv failed
+        if (filled > 0) {
+            if (fwrite(buffer.data(), 1, filled, file) != filled) return -1;
+            total += filled;
+            filled = 0;
+        }
+        if (received == 0) return total;
+        if (received < 0) return -1;
+    }
+}
+
+// Streaming XXH64 of file contents, fed a buffer at a time by a read pass that happens anyway.
+// Four independent accumulators over 32-byte stripes keep the multipliers busy, so hashing runs at
+// several GB/s and does not slow down the transfer it rides on
+class ContentHasher {
+public:
+    explicit ContentHasher(uint64_t seed = 0) : m_seed(seed) {
+        m_acc[0] = seed + P1 + P2;
+        m_acc[1] = seed + P2;
+        m_acc[2] = seed;
+        m_acc[3] = seed - P1;
+    }
+
+    void update(const char* data, size_t length) {
+        const unsigned char* input = reinterpret_cast<const unsigned char*>(data);
+        m_total += length;
+        if (m_buffered + length < STRIPE) {
+            memcpy(m_stripe + m_buffered, input, length);
+            m_buffered += length;
+            return;
+        }
+        if (m_buffered > 0) {
+            size_t fill = STRIPE - m_buffered;
+            memcpy(m_stripe + m_buffered, input, fill);
+            consume(m_stripe);
+            input += fill;
+            length -= fill;
+            m_buffered = 0;
+        }
+        for (; length >= STRIPE; input += STRIPE, length -= STRIPE) {
+            consume(input);
+        }
+        memcpy(m_stripe, input, length);
+        m_buffered = length;
+    }
+
+    uint64_t digest() const {
+        uint64_t hash;
+        if (m_total >= STRIPE) {
+            hash = rotl(m_acc[0], 1) + rotl(m_acc[1], 7) + rotl(m_acc[2], 12) + rotl(m_acc[3], 18);
+            for (uint64_t acc : m_acc) {
+                hash = (hash ^ round(0, acc)) * P1 + P4;
+            }
+        }
+        else {
+            hash = m_seed + P5;
+        }
+        hash += m_total;
+
+        const unsigned char* tail = m_stripe;
+        size_t length = m_buffered;
+        for (; length >= 8; tail += 8, length -= 8) {
+            hash = rotl(hash ^ round(0, read64(tail)), 27) * P1 + P4;
+        }
+        if (length >= 4) {
+            uint32_t word;
+            memcpy(&word, tail, 4);
+            hash = rotl(hash ^ (word * P1), 23) * P2 + P3;
+            tail += 4;
+            length -= 4;
+        }
+        for (; length > 0; tail++, length--) {
+            hash = rotl(hash ^ (*tail * P5), 11) * P1;
+        }
+
+        hash ^= hash >> 33;
+        hash *= P2;
+        hash ^= hash >> 29;
+        hash *= P3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+private:
+    static constexpr uint64_t P1 = 11400714785074694791ULL;
+    static constexpr uint64_t P2 = 14029467366897019727ULL;
+    static constexpr uint64_t P3 = 1609587929392839161ULL;
+    static constexpr uint64_t P4 = 9650029242287828579ULL;
+    static constexpr uint64_t P5 = 2870177450012600261ULL;
+    static constexpr size_t STRIPE = 32;
+
+    uint64_t m_seed;
+    uint64_t m_acc[4];
+    uint64_t m_total = 0;
+    unsigned char m_stripe[STRIPE] = {}; // Input not yet consumed as a whole stripe
+    size_t m_buffered = 0;
+
+    static uint64_t read64(const unsigned char* data) {
+        uint64_t value;
+        memcpy(&value, data, 8);
+        return value;
+    }
+    static uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; }
+
+    void consume(const unsigned char* stripe) {
+        for (int lane = 0; lane < 4; lane++) {
+            m_acc[lane] = round(m_acc[lane], read64(stripe + lane * 8));
+        }
+    }
+};
+
+// Send one chunk of a clamd zINSTREAM: its length as 4 bytes in network order, then the bytes
+bool send_instream_chunk(SOCKET sock, const char* data, size_t length) {
+    uint32_t header = htonl(static_cast<uint32_t>(length));
+    return send_all(sock, reinterpret_cast<const char*>(&header), sizeof(header)) && send_all(sock, data, length);
+}
+
+// Stream a file (at most `limit` bytes if one is given) over a data connection, hashing what is sent
+// into `hasher` if one is given. With `instream` every buffer goes out as one zINSTREAM chunk, and
+// `stop`, if given, is asked after each one whether the rest is still wanted.
+// Returns bytes sent, or -1 on a socket or disk error
+long long transfer_file_to_socket(FILE* file, SOCKET dataSock, TransferBuffer& buffer, long long limit = -1, ContentHasher* hasher = nullptr, bool instream = false, const function<bool()>& stop = nullptr) {
+    long long total = 0;
+    while (true) {
+        size_t want = limit < 0 ? buffer.size() : static_cast<size_t>(min<long long>(buffer.size(), limit - total));
+        size_t n = want > 0 ? fread(buffer.data(), 1, want, file) : 0;
+        if (n > 0) {
+            if (hasher) hasher->update(buffer.data(), n);
+            bool sent = instream ? send_instream_chunk(dataSock, buffer.data(), n) : send_all(dataSock, buffer.data(), n);
+            if (!sent) return -1;
+            total += n;
+            if (stop && stop()) return total;
+        }
+        if (n < buffer.size()) {
+            return ferror(file) ? -1 : total;
+        }
+    }
+}
+
+// Stream a file to two data connections at once, reading each chunk from disk only once; at most
+// `limit` bytes if one is given. With `instream` the first connection gets zINSTREAM chunks, and
+// `stop` ends both streams early when it returns true after a chunk.
+// Returns bytes sent, or -1 if reading or either connection failed
+long long transfer_file_to_sockets(FILE* file, SOCKET first, SOCKET second, TransferBuffer& buffer, long long limit = -1, ContentHasher* hasher = nullptr, bool instream = false, const function<bool()>& stop = nullptr) {
+    long long total = 0;
+    while (true) {
+        size_t want = limit < 0 ? buffer.size() : static_cast<size_t>(min<long long>(buffer.size(), limit - total));
+        size_t n = want > 0 ? fread(buffer.data(), 1, want, file) : 0;
+        if (n > 0) {
+            if (hasher) hasher->update(buffer.data(), n);
+            bool sent = instream ? send_instream_chunk(first, buffer.data(), n) : send_all(first, buffer.data(), n);
+            if (!sent || !send_all(second, buffer.data(), n)) return -1;
+            total += n;
+            if (stop && stop()) return total;
+        }
+        if (n < buffer.size()) {
+            return ferror(file) ? -1 : total;
+        }
+    }
+}
+
+// Parse a size such as "65536", "256K" or "4M"
+bool parse_size(const string& text, size_t& size) {
+    if (text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) return false;
+    size_t pos = 0;
+    unsigned long long value = 0;
+    try {
+        value = stoull(text, &pos);
+    }
+    catch (const out_of_range&) {
+        return false;
+    }
+    string suffix = text.substr(pos);
+    transform(suffix.begin(), suffix.end(), suffix.begin(), ::toupper);
+    unsigned long long multiplier = 1;
+    if (suffix == "K" || suffix == "KB") multiplier = 1024;
+    else if (suffix == "M" || suffix == "MB") multiplier = 1024 * 1024;
+    else if (!suffix.empty()) return false;
+    if (value > ULLONG_MAX / multiplier) return false;
+    value *= multiplier;
+    if (value > SIZE_MAX) return false;
+    size = static_cast<size_t>(value);
+    return true;
+}
+
+// One complete server reply: the three-digit code and the whole text, including every
+// continuation line of a multi-line reply and the final CRLF. The text points into the
+// session's reply buffer and stays valid until the next reply is read from that session
+struct FtpReply {
+    int code = 0;
+    string_view text;
+
+    bool is(int expected) const { return code == expected; }
+    bool is_preliminary() const { return code >= 100 && code < 200; } // 1yz: another reply follows
+    bool is_completion() const { return code >= 200 && code < 300; }
+};
+
+// Final reply to one command of a pipelined batch; code is 0 if the connection failed before it arrived
+struct PipelinedReply {
+    int code = 0;
+    string text;
+};
+
+// Receive buffer of a control connection that splits the byte stream into RFC 959 replies.
+// Several replies that arrived in one segment (e.g. "150" and "226" for a small file) stay
+// queued until they are asked for, and a multi-line reply ("211-..." up to "211 ...") is
+// returned as one reply. Consumed bytes are reclaimed by moving the unread tail to the front
+// rather than wrapping around, so every reply can be handed out as one contiguous view
+class ReplyReader {
+public:
+    explicit ReplyReader(size_t capacity = 8 * 1024) : m_buffer(capacity) {}
+
+    // Drop everything buffered, e.g. when the connection is closed
+    void reset() {
+        m_head = 0;
+        m_tail = 0;
+    }
+
+    // Number of complete replies already received but not read yet
+    size_t queued() const {
+        size_t count = 0;
+        size_t length;
+        for (size_t at = m_head; (length = reply_length(at)) > 0; at += length) {
+            count++;
+        }
+        return count;
+    }
+
+    // Return the next reply, receiving from `sock` only when no complete reply is buffered.
+    // Returns false when the connection is closed or fails before a reply is complete
+    bool read(SOCKET sock, FtpReply& reply) {
+        while (!next(reply)) {
+            if (receive(sock) <= 0) return false;
+        }
+        return true;
+    }
+
+    // Take the next complete reply from the buffer without receiving; false if none has arrived
+    bool next(FtpReply& reply) {
+        size_t length = reply_length(m_head);
+        if (length == 0) return false;
+        const char* text = m_buffer.data() + m_head;
+        reply.text = string_view(text, length);
+        reply.code = (length >= 3 && isdigit(static_cast<unsigned char>(text[0])) &&
+            isdigit(static_cast<unsigned char>(text[1])) && isdigit(static_cast<unsigned char>(text[2])))
+            ? (text[0] - '0') * 100 + (text[1] - '0') * 10 + (text[2] - '0') : 0;
+        m_head += length;
+        return true;
+    }
+
+    // Receive once from `sock` into the buffer. Returns the number of bytes received, 0 when the
+    // connection is closed or failed, -1 when a non-blocking socket had nothing to read
+    int receive(SOCKET sock) {
+        if (m_tail == m_buffer.size()) {
+            if (m_head > 0) {
+                memmove(m_buffer.data(), m_buffer.data() + m_head, m_tail - m_head);
+                m_tail -= m_head;
+                m_head = 0;
+            }
+            else if (m_buffer.size() < MAX_REPLY_SIZE) {
+                m_buffer.resize(min<size_t>(m_buffer.size() * 2, MAX_REPLY_SIZE));
+            }
+            else {
+                return 0; // A single reply larger than MAX_REPLY_SIZE
+            }
+        }
+        else if (m_head == m_tail) {
+            m_head = 0; // Buffer drained: start over at the front
+            m_tail = 0;
+        }
+
+        int received = recv(sock, m_buffer.data() + m_tail, static_cast<int>(min<size_t>(m_buffer.size() - m_tail, INT_MAX)), 0);
+        if (received == SOCKET_ERROR) return socket_would_block() ? -1 : 0;
+        m_tail += received;
+        return received;
+    }
+
+private:
+    static constexpr size_t MAX_REPLY_SIZE = 1024 * 1024;
+
+    vector<char> m_buffer;
+    size_t m_head = 0; // First unread byte
+    size_t m_tail = 0; // End of received data
+
+    // Length of the complete reply starting at `from`, or 0 if it has not fully arrived.
+    // A reply whose first line is "xyz-" continues until a line that starts with "xyz "
+    size_t reply_length(size_t from) const {
+        const char* data = m_buffer.data();
+        size_t lineStart = from;
+        bool multiLine = false;
+        while (true) {
+            const char* newline = static_cast<const char*>(memchr(data + lineStart, '\n', m_tail - lineStart));
+            if (!newline) return 0;
+            size_t lineEnd = newline - data + 1;
+            size_t lineLength = lineEnd - lineStart;
+
+            if (lineStart == from) {
+                multiLine = lineLength > 4 && data[from + 3] == '-';
+                if (!multiLine) return lineEnd - from;
+            }
+            else if (lineLength >= 4 && memcmp(data + lineStart, data + from, 3) == 0 && data[lineStart + 3] == ' ') {
+                return lineEnd - from;
+            }
+            lineStart = lineEnd;
+        }
+    }
+};
+
+// One FTP control connection together with its login and transfer state
+class FtpSession {
+public:
+    SOCKET control = INVALID_SOCKET; // Control connection to the FTP server
+    string host; // Server address and port the session is connected to
+    unsigned short port = 21;
+    bool binary = true; // True for binary (TYPE I), false for ASCII (TYPE A). Default to binary.
+    bool passive = true; // True for passive (PASV), false for active (PORT). Client only supports PASV.
+    string cwd; // Remote working directory, "" until it is known
+    set<string> features; // Extensions announced in the FEAT reply, e.g. "MLST", "SIZE", "REST STREAM"
+    ReplyReader replies; // Replies received on the control connection and not read yet
+    deque<pair<string, chrono::steady_clock::time_point>> awaiting; // Verbs sent and not answered yet, with send time
+
+    FtpSession() = default;
+    ~FtpSession() { close(); }
+    FtpSession(const FtpSession&) = delete;
+    FtpSession& operator=(const FtpSession&) = delete;
+
+    bool is_open() const { return control != INVALID_SOCKET; }
+
+    bool has_feature(const string& name) const { return features.count(name) > 0; }
+
+    // Open the control connection and return the server greeting ("" on failure)
+    string connect(const string& ip, unsigned short serverPort) {
+        close();
+        PhaseClock phases(ip);
+        control = connectToServer(ip.c_str(), serverPort);
+        if (control == INVALID_SOCKET) return "";
+        host = ip;
+        port = serverPort;
+        cwd.clear();
+        features.clear();
+        replies.reset();
+        string greeting = exchange("");
+        phases.mark("connect");
+        return greeting;
+    }
+
+    // Write a command to the control connection without waiting for its reply
+    bool send_command(const string& cmd) {
+        if (!is_open()) return false;
+        note_sent(cmd);
+        return send_all(control, cmd.c_str(), cmd.length());
+    }
+
+    // Read the next reply; queued replies are returned before anything new is received
+    bool read_reply(FtpReply& reply) {
+        if (!is_open() || !replies.read(control, reply)) return false;
+        note_reply(reply);
+        return true;
+    }
+
+    // Remember the verb of every command in `cmd` (one or more lines) for the latency metrics
+    void note_sent(const string& cmd) {
+        auto now = chrono::steady_clock::now();
+        for (size_t start = 0; start < cmd.size();) {
+            size_t end = cmd.find('\n', start);
+            if (end == string::npos) end = cmd.size();
+            size_t verbEnd = start;
+            while (verbEnd < end && isalpha(static_cast<unsigned char>(cmd[verbEnd]))) verbEnd++;
+            if (verbEnd > start) {
+                string verb = cmd.substr(start, verbEnd - start);
+                transform(verb.begin(), verb.end(), verb.begin(), ::toupper);
+                awaiting.emplace_back(move(verb), now);
+            }
+            start = end + 1;
+        }
+    }
+
+    // Record the latency of the command this reply answers. A preliminary reply (150) ends the
+    // latency; the final reply that follows it is not counted again
+    void note_reply(const FtpReply& reply) {
+        if (awaiting.empty()) return;
+        auto& [verb, sent] = awaiting.front();
+        if (!verb.empty()) {
+            g_metrics.verb(verb).record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - sent).count());
+        }
+        if (reply.is_preliminary()) {
+            verb.clear();
+        }
+        else {
+            awaiting.pop_front();
+        }
+    }
+
+    // Send a command and read its reply
+    bool command(const string& cmd, FtpReply& reply) {
+        return send_command(cmd) && read_reply(reply);
+    }
+
+    // Send a batch of commands and return their final replies in order. Up to `window` commands are
+    // written with one send() and their replies read back before the next window, so N commands cost
+    // about N / window round trips instead of N. Only for commands without a data connection
+    vector<PipelinedReply> pipeline(const vector<string>& commands, size_t window = PIPELINE_WINDOW) {
+        vector<PipelinedReply> results(commands.size());
+        for (size_t first = 0; first < commands.size(); first += window) {
+            size_t last = min<size_t>(first + window, commands.size());
+            string batch;
+            for (size_t i = first; i < last; i++) {
+                batch += commands[i];
+            }
+            if (!send_command(batch)) return results;
+
+            for (size_t i = first; i < last; i++) {
+                FtpReply reply;
+                do {
+                    if (!read_reply(reply)) return results;
+                } while (reply.is_preliminary());
+                results[i].code = reply.code;
+                results[i].text = string(reply.text);
+            }
+        }
+        return results;
+    }
+
+    // Send a command without echoing it and return the server's reply ("" if nothing was received).
+    // An empty command only reads, e.g. the greeting of a new connection
+    string exchange(const string& cmd) {
+        if (!cmd.empty() && !send_command(cmd)) return "";
+        FtpReply reply;
+        if (!read_reply(reply)) return "";
+        return string(reply.text);
+    }
+
+    // Log in and set the transfer type without console output. USER, PASS and TYPE go out in one
+    // pipelined batch; if USER alone logs in, the server answers PASS with 503 and that is ignored
+    bool login(const string& user, const string& password, string& error) {
+        PhaseClock phases(user);
+        vector<PipelinedReply> replies = pipeline({ "USER " + user + "\r\n", "PASS " + password + "\r\n", binary ? "TYPE I\r\n" : "TYPE A\r\n" });
+        phases.mark("login");
+        if (replies[0].code != 230 && replies[1].code != 230) {
+            error = "Login failed: " + (replies[1].text.empty() ? replies[0].text : replies[1].text);
+            return false;
+        }
+        if (replies[2].code / 100 != 2) {
+            error = "TYPE rejected: " + replies[2].text;
+            return false;
+        }
+        return true;
+    }
+
+    // Switch between TYPE I and TYPE A
+    bool set_type(bool binaryMode, string& error) {
+        string reply = exchange(binaryMode ? "TYPE I\r\n" : "TYPE A\r\n");
+        if (reply.empty() || reply[0] != '2') {
+            error = "TYPE rejected: " + reply;
+            return false;
+        }
+        binary = binaryMode;
+        return true;
+    }
+
+    // Change the remote directory and remember it
+    bool change_directory(const string& directory, string& error) {
+        string reply = exchange("CWD " + directory + "\r\n");
+        if (reply.compare(0, 3, "250") != 0) {
+            error = "CWD " + directory + " rejected: " + reply;
+            return false;
+        }
+        cwd = (!directory.empty() && directory[0] == '/') ? directory : "";
+        return true;
+    }
+
+    // Remote working directory, asked from the server with PWD when it is not known yet
+    string current_directory() {
+        if (cwd.empty()) {
+            string reply = exchange("PWD\r\n");
+            size_t firstQuote = reply.find('"');
+            size_t lastQuote = reply.rfind('"');
+            if (reply.compare(0, 3, "257") == 0 && firstQuote != string::npos && lastQuote > firstQuote) {
+                cwd = reply.substr(firstQuote + 1, lastQuote - firstQuote - 1);
+            }
+        }
+        return cwd;
+    }
+
+    // Ask the server which extensions it supports (FEAT)
+    void load_features() {
+        FtpReply reply;
+        features.clear();
+        if (command("FEAT\r\n", reply) && reply.is(211)) {
+            parse_features(reply.text);
+        }
+    }
+
+    // Fill the feature set from a FEAT reply, a multi-line reply ending with "211 End"
+    void parse_features(string_view reply) {
+        features.clear();
+        istringstream lines{ string(reply) };
+        string line;
+        while (getline(lines, line)) {
+            if (line.empty() || line[0] != ' ') continue;
+            line.erase(0, 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            // Keep the feature name and its first argument, e.g. "REST STREAM"; MLST lists its facts instead
+            size_t space = line.find(' ');
+            string name = line.substr(0, space);
+            transform(name.begin(), name.end(), name.begin(), ::toupper);
+            features.insert(name);
+            if (space != string::npos && name != "MLST") {
+                features.insert(name + " " + line.substr(space + 1));
+            }
+        }
+    }
+
+    // Check that the server still answers on this connection
+    bool validate() {
+        return exchange("NOOP\r\n").compare(0, 3, "200") == 0;
+    }
+
+    // Log out and close the control connection
+    void quit() {
+        if (is_open()) {
+            exchange("QUIT\r\n");
+        }
+        close();
+    }
+
+    void close() {
+        if (is_open()) {
+            closesocket(control);
+            control = INVALID_SOCKET;
+        }
+        replies.reset();
+        awaiting.clear();
+    }
+};
+
+// Receives transfer data: called with every filled buffer, returns false to abort the transfer
+using DataSink = function<bool(const char* data, size_t length)>;
+// Supplies upload data: fills the buffer and returns the byte count, 0 at the end, -1 on error
+using DataSource = function<long long(char* data, size_t capacity)>;
+
+// Coroutine interface to a logged-in FtpSession, driven by an IoEngine instead of blocking calls:
+//     long long bytes = co_await async.retr("dir/file", sink);
+// Any number of sessions can run concurrently on one thread. Every operation gives up after
+// g_socket_timeout seconds without progress; a failure is described by last_error, and one that
+// leaves the control connection in an unknown state also closes the session
+class AsyncFtpSession {
+public:
+    AsyncFtpSession(FtpSession& session, IoEngine& engine)
+        : m_session(session), m_engine(engine), m_lane(g_tracer.new_lane("session")) {
+        set_socket_blocking(m_session.control, false);
+    }
+    ~AsyncFtpSession() {
+        if (m_session.is_open()) set_socket_blocking(m_session.control, true);
+    }
+    AsyncFtpSession(const AsyncFtpSession&) = delete;
+    AsyncFtpSession& operator=(const AsyncFtpSession&) = delete;
+
+    FtpSession& session() { return m_session; }
+    const string& last_error() const { return m_error; }
+
+    // Write a command to the control connection
+    Task<bool> send(string cmd) {
+        m_session.note_sent(cmd);
+        const char* data = cmd.c_str();
+        size_t length = cmd.length();
+        while (length > 0) {
+            if (!m_session.is_open()) co_return fail("Not connected");
+            int sent = ::send(m_session.control, data, static_cast<int>(min<size_t>(length, INT_MAX)), 0);
+            if (sent == SOCKET_ERROR) {
+                if (!socket_would_block()) co_return fail("Control connection failed");
+                if (co_await SocketReady(m_engine, m_session.control, IO_WRITE, timeout_ms()) == 0) co_return fail(timeout_error());
+                continue;
+            }
+            data += sent;
+            length -= sent;
+        }
+        co_return true;
+    }
+
+    // Next reply on the control connection. Returns its code (0 if none arrived) and the text in `text`
+    Task<int> reply(string* text = nullptr) {
+        FtpReply reply;
+        while (!m_session.replies.next(reply)) {
+            if (!m_session.is_open()) co_return fail("Not connected");
+            int received = m_session.replies.receive(m_session.control);
+            if (received == 0) co_return fail("Control connection closed");
+            if (received < 0) {
+                unsigned ready = co_await SocketReady(m_engine, m_session.control, IO_READ, timeout_ms());
+                if (ready == 0) co_return fail(timeout_error());
+            }
+        }
+        m_session.note_reply(reply);
+        if (text) *text = string(reply.text);
+        co_return reply.code;
+    }
+
+    // Send a command and return the code of its reply (0 on failure)
+    Task<int> command(string cmd, string* text = nullptr) {
+        bool sent = co_await send(move(cmd));
+        if (!sent) co_return 0;
+        co_return co_await reply(text);
+    }
+
+    // Enter passive mode and connect the data connection. Returns the non-blocking data socket,
+    // INVALID_SOCKET on failure
+    Task<SOCKET> pasv() {
+        string text;
+        int code = co_await command("PASV\r\n", &text);
+        string ip;
+        int port;
+        if (code == 0) co_return INVALID_SOCKET;
+        if (code != 227 || !parsePasvResponse(text, ip, port)) {
+            m_error = "Failed to parse PASV response";
+            co_return INVALID_SOCKET;
+        }
+
+        m_error = "Failed to open data connection";
+        SOCKET data = begin_connect(ip.c_str(), static_cast<unsigned short>(port));
+        if (data == INVALID_SOCKET) co_return INVALID_SOCKET;
+        unsigned ready = co_await SocketReady(m_engine, data, IO_WRITE, timeout_ms());
+        if (ready == 0 || !finish_connect(data)) {
+            closesocket(data);
+            co_return INVALID_SOCKET;
+        }
+        m_error.clear();
+        tune_data_socket(data);
+        co_return data;
+    }
+
+    // Download `path`, handing the data to sink a buffer at a time. Returns the byte count, or -1
+    Task<long long> retr(string path, DataSink sink) {
+        TraceSpan span("get", path, m_lane);
+        co_return co_await download("RETR " + path + "\r\n", move(sink), "download");
+    }
+
+    // Directory listing of `path` ("" for the current directory) with MLSD, LIST or NLST
+    Task<long long> list(string verb, string path, string& listing) {
+        listing.clear();
+        co_return co_await download(verb + (path.empty() ? "" : " " + path) + "\r\n", [&listing](const char* data, size_t length) {
+            listing.append(data, length);
+            return true;
+        }, "listing");
+    }
+
+    // Upload to `path` whatever source supplies. Returns the byte count, or -1
+    Task<long long> stor(string path, DataSource source) {
+        TraceSpan span("put", path, m_lane);
+        PhaseClock phases(path, m_lane);
+        SOCKET data = co_await pasv();
+        if (data == INVALID_SOCKET) co_return -1;
+        phases.mark("pasv");
+        string text;
+        int code = co_await command("STOR " + path + "\r\n", &text);
+        if (code < 100 || code >= 200) {
+            closesocket(data);
+            if (code != 0) m_error = "Server rejected STOR: " + trimmed(text);
+            co_return -1;
+        }
+        phases.mark("stor");
+
+        TransferBuffer buffer(g_transfer_buffer_size);
+        long long total = 0;
+        bool ok = true;
+        long long filled;
+        while (ok && (filled = source(buffer.data(), buffer.size())) > 0) {
+            for (long long offset = 0; ok && offset < filled;) {
+                int sent = ::send(data, buffer.data() + offset, static_cast<int>(min<long long>(filled - offset, INT_MAX)), 0);
+                if (sent > 0) {
+                    offset += sent;
+                    continue;
+                }
+                unsigned ready = 0;
+                if (socket_would_block()) {
+                    ready = co_await SocketReady(m_engine, data, IO_WRITE, timeout_ms());
+                }
+                if (ready == 0) {
+                    ok = false;
+                    m_error = "Error while sending data";
+                }
+            }
+            total += filled;
+        }
+        if (ok && filled < 0) {
+            ok = false;
+            m_error = "Error while reading data";
+        }
+        long long dataMicros = phases.mark("transfer");
+        // The server answers an aborted transfer as well, so the session stays usable
+        closesocket(data);
+
+        code = co_await reply(&text);
+        phases.mark("final_reply");
+        if (code == 0) co_return -1;
+        if (code < 200 || code >= 300) {
+            ok = false;
+            m_error = "Upload not completed by server: " + trimmed(text);
+        }
+        if (!ok) {
+            // Whatever part of the file reached the server is removed rather than left under its name
+            string error = m_error;
+            co_await command("DELE " + path + "\r\n");
+            m_error = error;
+            co_return -1;
+        }
+        g_metrics.record_transfer("upload", total, dataMicros);
+        co_return total;
+    }
+
+private:
+    FtpSession& m_session;
+    IoEngine& m_engine;
+    int m_lane; // Trace lane of this session's operations
+    string m_error;
+
+    static int timeout_ms() { return g_socket_timeout * 1000; }
+    static string timeout_error() { return "No activity for " + to_string(g_socket_timeout) + " s"; }
+    static string trimmed(string text) {
+        while (!text.empty() && (text.back() == '\n' || text.back() == '\r')) text.pop_back();
+        return text;
+    }
+
+    // Record a control connection failure; the connection is in an unknown state and is closed
+    bool fail(const string& error) {
+        m_error = error;
+        m_session.close();
+        return false;
+    }
+
+    // Run a command that answers over a data connection (RETR, LIST, ...) and feed the data to
+    // sink. Its throughput is counted under `direction`
+    Task<long long> download(string cmd, DataSink sink, string direction) {
+        PhaseClock phases(trimmed(cmd), m_lane);
+        SOCKET data = co_await pasv();
+        if (data == INVALID_SOCKET) co_return -1;
+        phases.mark("pasv");
+        string text;
+        int code = co_await command(move(cmd), &text);
+        if (code < 100 || code >= 200) {
+            closesocket(data);
+            if (code != 0) m_error = "File transfer not started: " + trimmed(text);
+            co_return -1;
+        }
+        phases.mark(direction == "listing" ? "list" : "retr");
+        auto dataStart = chrono::steady_clock::now();
+
+        TransferBuffer buffer(g_transfer_buffer_size);
+        size_t filled = 0;
+        long long total = 0;
+        bool ok = true;
+        while (true) {
+            int received = recv(data, buffer.data() + filled, static_cast<int>(min<size_t>(buffer.size() - filled, INT_MAX)), 0);
+            if (received == SOCKET_ERROR && socket_would_block()) {
+                unsigned ready = co_await SocketReady(m_engine, data, IO_READ, timeout_ms());
+                if (ready != 0) continue;
+                m_error = timeout_error();
+            }
+            if (received > 0) {
+                if (total == 0 && filled == 0) phases.mark("first_byte");
+                filled += received;
+                if (filled < buffer.size()) continue;
+            }
+            // Hand over the buffer when it is full, the server closed the connection or recv failed
+            if (filled > 0) {
+                if (!sink(buffer.data(), filled)) {
+                    received = SOCKET_ERROR;
+                    m_error = "Transfer aborted by receiver";
+                }
+                total += filled;
+                filled = 0;
+            }
+            if (received > 0) continue;
+            if (received < 0) {
+                ok = false;
+                if (m_error.empty()) m_error = "Error while receiving data";
+            }
+            break;
+        }
+        phases.mark("transfer");
+        long long dataMicros = micros_since(dataStart);
+        closesocket(data);
+
+        // The server answers an aborted transfer as well, so the session stays usable
+        code = co_await reply(&text);
+        phases.mark("final_reply");
+        if (code == 0) co_return -1;
+        if (ok && (code < 200 || code >= 300)) {
+            m_error = "Transfer not completed by server: " + trimmed(text);
+            ok = false;
+        }
+        if (ok) g_metrics.record_transfer(direction, total, dataMicros);
+        co_return ok ? total : -1;
+    }
+};
+
+// Logged-in sessions kept open between parallel transfers, so repeated batches skip the
+// connect, USER, PASS and TYPE round trips of a new login
+class FtpSessionPool {
+public:
+    // Hand out an idle session that still answers NOOP, or log in a new one to the same server as `main`.
+    // The session is switched to main's transfer type and to `directory` if one is given
+    unique_ptr<FtpSession> acquire(const FtpSession& main, const string& directory, string& error) {
+        unique_ptr<FtpSession> session;
+        while (true) {
+            {
+                lock_guard<mutex> lock(m_mutex);
+                if (m_idle.empty()) break;
+                session = move(m_idle.back());
+                m_idle.pop_back();
+            }
+            if (session->host == main.host && session->port == main.port && session->validate()) break;
+            session->close();
+            session.reset();
+        }
+
+        if (!session) {
+            session = open_new(main, error);
+            if (!session) return nullptr;
+        }
+
+        session->passive = main.passive;
+        if (session->binary != main.binary && !session->set_type(main.binary, error)) {
+            session->quit();
+            return nullptr;
+        }
+        if (!directory.empty() && session->current_directory() != directory && !session->change_directory(directory, error)) {
+            session->quit();
+            return nullptr;
+        }
+        return session;
+    }
+
+    // Give a session back for reuse; closed sessions are dropped
+    void release(unique_ptr<FtpSession> session) {
+        if (!session || !session->is_open()) return;
+        lock_guard<mutex> lock(m_mutex);
+        if (m_idle.size() < static_cast<size_t>(MAX_PARALLEL_CONNECTIONS)) {
+            m_idle.push_back(move(session));
+        }
+        else {
+            session->quit();
+        }
+    }
+
+    // Log in sessions in parallel until `count` are idle
+    void warm(const FtpSession& main, int count) {
+        vector<thread> threads;
+        for (int i = static_cast<int>(idle_count()); i < count; i++) {
+            threads.emplace_back([this, &main]() {
+                string error;
+                unique_ptr<FtpSession> session = open_new(main, error);
+                if (!session) {
+                    write_log("Session pool login failed - " + error);
+                    return;
+                }
+                release(move(session));
+            });
+        }
+        for (thread& t : threads) {
+            t.join();
+        }
+    }
+
+    // Log out all idle sessions, e.g. when the main connection is closed
+    void clear() {
+        vector<unique_ptr<FtpSession>> sessions;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            sessions.swap(m_idle);
+        }
+        for (auto& session : sessions) {
+            session->quit();
+        }
+    }
+
+    size_t idle_count() {
+        lock_guard<mutex> lock(m_mutex);
+        return m_idle.size();
+    }
+
+private:
+    mutex m_mutex;
+    vector<unique_ptr<FtpSession>> m_idle;
+
+    // Connect and log in a new session to the same server as `main`
+    unique_ptr<FtpSession> open_new(const FtpSession& main, string& error) {
+        unique_ptr<FtpSession> session = make_unique<FtpSession>();
+        session->binary = main.binary;
+        string greeting = session->connect(main.host, main.port);
+        if (greeting.compare(0, 3, "220") != 0) {
+            error = greeting.empty() ? "Could not connect to " + main.host + ":" + to_string(main.port) : "Unexpected greeting: " + greeting;
+            return nullptr;
+        }
+        if (!session->login(g_username, g_password, error)) {
+            session->quit();
+            return nullptr;
+        }
+        session->features = main.features;
+        return session;
+    }
+};
+
+FtpSession g_session; // Interactive session used by all single commands
+FtpSessionPool g_session_pool; // Extra sessions for parallel transfers, kept until the connection is closed
+
+// Enter passive mode on a session without console output and open the data connection
+SOCKET open_data_connection(FtpSession& session, string& error) {
+    string reply = session.exchange("PASV\r\n");
+    string ip;
+    int port;
+    if (!parsePasvResponse(reply, ip, port)) {
+        error = "Invalid PASV response: " + reply;
+        return INVALID_SOCKET;
+    }
+
+    SOCKET dataSock = connectToServer(ip.c_str(), port);
+    if (dataSock == INVALID_SOCKET) {
+        error = "Could not open data connection";
+        return INVALID_SOCKET;
+    }
+    tune_data_socket(dataSock);
+    return dataSock;
+}
+
+//Function to send a command and receive response
+void sendCommand(FtpSession& session, const string& cmd) {
+    if (!session.is_open()) {
+        cout << "Not connected to server. Cannot send command.\n";
+        return;
+    }
+    FtpReply reply;
+    if (session.command(cmd, reply)) {
+        cout << "Server: " << reply.text;
+    }
+}
+
+// Absolute, normalized form of a remote path ("." and ".." resolved) relative to the session's
+// working directory. Returns "" when the working directory is unknown
+string resolve_remote_path(FtpSession& session, const string& path) {
+    string full;
+    if (!path.empty() && path[0] == '/') {
+        full = path;
+    }
+    else {
+        full = session.current_directory();
+        if (full.empty()) return "";
+        full += "/" + path;
+    }
+
+    vector<string> parts;
+    istringstream iss(full);
+    string part;
+    while (getline(iss, part, '/')) {
+        if (part.empty() || part == ".") continue;
+        if (part == "..") {
+            if (!parts.empty()) parts.pop_back();
+        }
+        else {
+            parts.push_back(part);
+        }
+    }
+
+    string result;
+    for (const string& p : parts) {
+        result += "/" + p;
+    }
+    return result.empty() ? "/" : result;
+}
+
+// Directory that contains an absolute remote path
+string remote_parent(const string& path) {
+    size_t slash = path.rfind('/');
+    if (slash == string::npos || slash == 0) return "/";
+    return path.substr(0, slash);
+}
+
+// Directory listings fetched recently, keyed by absolute remote path and listing command (LIST or
+// MLSD). Entries expire after g_listing_cache_ttl seconds and are dropped as soon as this client
+// changes the directory (put, delete, rename, mkdir, rmdir). Shared by all sessions to the server
+class ListingCache {
+public:
+    // Cached listing of `path` if it is younger than the TTL
+    bool lookup(const string& path, const string& verb, string& data, double& ageSeconds) {
+        if (path.empty() || g_listing_cache_ttl <= 0) return false;
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_listings.find(path + "\n" + verb);
+        if (it == m_listings.end()) return false;
+        ageSeconds = chrono::duration<double>(chrono::steady_clock::now() - it->second.fetched).count();
+        if (ageSeconds > g_listing_cache_ttl) {
+            m_listings.erase(it);
+            return false;
+        }
+        data = it->second.data;
+        return true;
+    }
+
+    void store(const string& path, const string& verb, const string& data) {
+        if (path.empty() || g_listing_cache_ttl <= 0) return;
+        lock_guard<mutex> lock(m_mutex);
+        m_listings[path + "\n" + verb] = { chrono::steady_clock::now(), data };
+    }
+
+    // Forget the listings of `path`, and with `subtree` also of every directory below it
+    void invalidate(const string& path, bool subtree = false) {
+        lock_guard<mutex> lock(m_mutex);
+        string prefix = path + "\n";
+        string below = (path == "/") ? "/" : path + "/";
+        for (auto it = m_listings.begin(); it != m_listings.end();) {
+            bool match = it->first.compare(0, prefix.length(), prefix) == 0 ||
+                (subtree && it->first.compare(0, below.length(), below) == 0);
+            it = match ? m_listings.erase(it) : next(it);
+        }
+    }
+
+    // Forget the listing of the directory that contains `path` (a file or directory was added,
+    // removed or renamed there); with `isDirectory` also everything cached below `path` itself
+    void invalidate_entry(FtpSession& session, const string& path, bool isDirectory = false) {
+        string absolute = resolve_remote_path(session, path);
+        if (absolute.empty()) {
+            clear();
+            return;
+        }
+        invalidate(remote_parent(absolute));
+        if (isDirectory) invalidate(absolute, true);
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(m_mutex);
+        m_listings.clear();
+    }
+
+    size_t size() {
+        lock_guard<mutex> lock(m_mutex);
+        return m_listings.size();
+    }
+
+private:
+    struct Listing {
+        chrono::steady_clock::time_point fetched;
+        string data;
+    };
+
+    mutex m_mutex;
+    map<string, Listing> m_listings;
+};
+
+ListingCache g_listing_cache;
+
+// Remote directories known to exist on the server, so recursive uploads send MKD for each one only
+// once. Filled by ensure_remote_directories; rmdir and rename forget the affected subtree
+class RemoteDirectorySet {
+public:
+    bool contains(const string& path) {
+        lock_guard<mutex> lock(m_mutex);
+        return m_directories.count(path) > 0;
+    }
+
+    void add(const string& path) {
+        lock_guard<mutex> lock(m_mutex);
+        m_directories.insert(path);
+    }
+
+    // Forget `path` and every directory below it
+    void remove_tree(const string& path) {
+        lock_guard<mutex> lock(m_mutex);
+        string below = (path == "/") ? "/" : path + "/";
+        for (auto it = m_directories.begin(); it != m_directories.end();) {
+            bool match = (*it == path || it->compare(0, below.length(), below) == 0);
+            it = match ? m_directories.erase(it) : next(it);
+        }
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(m_mutex);
+        m_directories.clear();
+    }
+
+private:
+    mutex m_mutex;
+    set<string> m_directories;
+};
+
+RemoteDirectorySet g_known_remote_dirs;
+
+// Run a listing command ("LIST", "MLSD", optionally with a path) on a new data connection and
+// collect its output, without console output
+bool fetch_listing(FtpSession& session, const string& cmd, string& data, string& error) {
+    SOCKET dataSock = open_data_connection(session, error);
+    if (dataSock == INVALID_SOCKET) return false;
+
+    FtpReply reply;
+    if (!session.command(cmd + "\r\n", reply) || !reply.is_preliminary()) {
+        error = reply.text.empty() ? "No response to " + cmd : string(reply.text);
+        closesocket(dataSock);
+        return false;
+    }
+
+    data.clear();
+    char buffer[4096];
+    int bytesReceived;
+    while ((bytesReceived = recv(dataSock, buffer, sizeof(buffer), 0)) > 0) {
+        data.append(buffer, bytesReceived);
+    }
+    closesocket(dataSock);
+
+    if (!session.read_reply(reply) || !reply.is_completion()) {
+        error = reply.text.empty() ? "No final response to " + cmd : string(reply.text);
+        return false;
+    }
+    return true;
+}
+
+// Listing of `path` ("" for the working directory) from the cache, or fetched and cached.
+// `refresh` skips the cache lookup
+bool get_listing(FtpSession& session, const string& verb, const string& path, bool refresh, string& data, string& error) {
+    string absolute = resolve_remote_path(session, path);
+    double age;
+    if (!refresh && g_listing_cache.lookup(absolute, verb, data, age)) {
+        return true;
+    }
+    if (!fetch_listing(session, path.empty() ? verb : verb + " " + path, data, error)) {
+        return false;
+    }
+    g_listing_cache.store(absolute, verb, data);
+    return true;
+}
+
+//command "ls" : list all files in current directory ("ls -f" bypasses the listing cache)
+void ftp_ls(FtpSession& session, bool refresh = false) {
+    if (!session.is_open()) {
+        cout << "Not connected to a server.\n";
+        write_log("LIST command failed - Not connected to server");
+        return;
+    }
+    if (!session.passive) {
+        cout << "Error: Client is not in passive mode. Active mode (PORT) is not supported for LIST.\n";
+        write_log("LIST command failed - Not in passive mode");
+        return;
+    }
+
+    write_log("LIST command initiated");
+
+    string directory = resolve_remote_path(session, "");
+    string listing;
+    double age;
+    if (!refresh && g_listing_cache.lookup(directory, "LIST", listing, age)) {
+        cout << "Directory listing (cached " << fixed << setprecision(1) << age << defaultfloat << " s ago, 'ls -f' to refresh):\n";
+        cout << listing << endl;
+        write_log("LIST command completed from cache - " + directory);
+        return;
+    }
+
+    string error;
+    if (!fetch_listing(session, "LIST", listing, error)) {
+        cout << "LIST failed: " << error;
+        if (error.empty() || error.back() != '\n') cout << endl;
+        write_log("LIST failed - " + error);
+        return;
+    }
+    g_listing_cache.store(directory, "LIST", listing);
+
+    cout << "Directory listing:\n";
+    cout << listing << endl;
+
+    write_log("LIST command completed successfully");
+}
+
+//command "pwd" : show current directory on server
+void ftp_pwd(FtpSession& session) {
+    if (!session.is_open()) {
+        cout << "Not connected to a server.\n";
+        write_log("PWD command failed - Not connected to server");
+        return;
+    }
+
+    write_log("PWD command initiated");
+
+    FtpReply reply;
+    if (session.command("PWD\r\n", reply)) {
+        cout << "Server: " << reply.text;
+
+        string virtualPath;
+        size_t firstQuote = reply.text.find('"');
+        size_t lastQuote = reply.text.rfind('"');
+        if (firstQuote != string::npos && lastQuote != string::npos && lastQuote > firstQuote) {
+            virtualPath = string(reply.text.substr(firstQuote + 1, lastQuote - firstQuote - 1));
+            string nativeBase = "C:\\data";
+            string nativePath = nativeBase + "\\" + virtualPath.substr(1);
+            cout << "Mapped native path: " << nativePath << endl;
+            write_log("PWD command completed - Current directory: " + virtualPath);
+        }
+    }
+    else {
+        write_log("PWD command failed - No response from server");
+    }
+}
+
+//command "cd" : change directory on server
+void ftp_cd(FtpSession& session, const string& dir) {
+    if (!session.is_open()) {
+        cout << "Not connected to a server.\n";
+        write_log("CD command failed - Not connected to server");
+        return;
+    }
+
+    write_log("CD command initiated - Target directory: " + dir);
+
+    // Track the new working directory locally so later path lookups need no PWD
+    string target = (!dir.empty() && (dir[0] == '/' || !session.cwd.empty())) ? resolve_remote_path(session, dir) : "";
+
+    string cmd = "CWD " + dir + "\r\n";
+    FtpReply reply;
+    bool replied = session.command(cmd, reply);
+    session.cwd = (replied && reply.is(250)) ? target : "";
+    if (replied) {
+        cout << "Server: " << reply.text;
+
+        if (reply.is(250)) {
+            write_log("CD command completed successfully - Changed to: " + dir);
+        }
+        else {
+            write_log("CD command failed - Server response: " + string(reply.text));
+        }
+    }
+    else {
+        write_log("CD command failed - No response from server");
+    }
+}
+
+//command "lcd" : change local directory
+void ftp_lcd(const string& localDir) {
+    write_log("LCD command initiated - Target directory: " + localDir);
+
+    error_code error;
+    fs::current_path(localDir, error);
+    if (!error) {
+        cout << "Local directory changed to: " << localDir << endl;
+        write_log("LCD command completed successfully - Changed to: " + localDir);
+    }
+    else {
+        cout << "Failed to change local directory.\n";
+        write_log("LCD command failed - Unable to change to: " + localDir);
+    }
+}
+
+//command "lpwd" : local directory
+void ftp_lpwd() {
+    write_log("LPWD command initiated");
+
+    error_code error;
+    fs::path path = fs::current_path(error);
+    if (!error) {
+        cout << "Local directory: " << path.string() << endl;
+        write_log("LPWD command completed - Current local directory: " + path.string());
+    }
+    else {
+        cout << "Failed to get local directory.\n";
+        write_log("LPWD command failed - Unable to get current directory");
+    }
+}
+
+//command "mkdir" : create directory on server
+void ftp_mkdir(FtpSession& session, const string& dirname) {
+    if (!session.is_open()) {
+        cout << "Not connected to a server.\n";
+        write_log("MKDIR command failed - Not connected to server");
+        return;
+    }
+
+    write_log("MKDIR command initiated - Directory: " + dirname);
+
+    string cmd = "MKD " + dirname + "\r\n";
+    FtpReply reply;
+    bool replied = session.command(cmd, reply);
+    if (replied) {
+        cout << "Server: " << reply.text;
+
+        if (reply.is(257)) {
+            g_listing_cache.invalidate_entry(session, dirname);
+            write_log("MKDIR command completed successfully - Created: " + dirname);
+        }
+        else {
+            write_log("MKDIR command failed - Server response: " + string(reply.text));
+        }
+    }
+    else {
+        write_log("MKDIR command failed - No response from server");
+    }
+}
+
+//command "rmdir" : remove directory on server
+void ftp_rmdir(FtpSession& session, const string& dirname) {
+    if (!session.is_open()) {
+        cout << "Not connected to a server.\n";
+        write_log("RMDIR command failed - Not connected to server");
+        return;
+    }
+
+    write_log("RMDIR command initiated - Directory: " + dirname);
+
+    string cmd = "RMD " + dirname + "\r\n";
+    FtpReply reply;
+    bool replied = session.command(cmd, reply);
+    if (replied) {
+        cout << "Server: " << reply.text;
+
+        if (reply.is(250)) {
+            g_listing_cache.invalidate_entry(session, dirname, true);
+            g_known_remote_dirs.remove_tree(resolve_remote_path(session, dirname));
+            write_log("RMDIR command completed successfully - Removed: " + dirname);
+        }
+        else {
+            write_log("RMDIR command failed - Server response: " + string(reply.text));
+        }
+    }
+    else {
+        write_log("RMDIR command failed - No response from server");
+    }
+}
+
+//command "delete" : delete file on server
+void ftp_delete(FtpSession& session, const string& filename) {
+    if (!session.is_open()) {
+        console() << "Not connected to a server.\n";
+        write_log("DELETE command failed - Not connected to server");
+        return;
+    }
+
+    write_log("DELETE command initiated - File: " + filename);
+
+    string cmd = "DELE " + filename + "\r\n";
+    FtpReply reply;
+    bool replied = session.command(cmd, reply);
+    if (replied) {
+        console() << "Server: " << reply.text;
+
+        if (reply.is(250)) {
+            g_listing_cache.invalidate_entry(session, filename);
+            write_log("DELETE command completed successfully - Deleted: " + filename);
+        }
+        else {
+            write_log("DELETE command failed - Server response: " + string(reply.text));
+        }
+    }
+    else {
+        write_log("DELETE command failed - No response from server");
+    }
+}
+
+// Run one pipelined command per name and print every reply; returns how many got `successCode`
+int run_pipelined_batch(FtpSession& session, const string& verb, const vector<string>& names, int successCode) {
+    vector<string> commands;
+    commands.reserve(names.size());
+    for (const string& name : names) {
+        commands.push_back(verb + " " + name + "\r\n");
+    }
+
+    vector<PipelinedReply> replies = session.pipeline(commands);
+    int successCount = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (replies[i].code == 0) {
+            cout << names[i] << ": No response from server\n";
+            continue;
+        }
+        cout << "Server: " << replies[i].text;
+        if (replies[i].code == successCode) {
+            g_listing_cache.invalidate_entry(session, names[i]);
+            successCount++;
+        }
+        else {
+            write_log(verb + " failed for " + names[i] + " - Server response: " + replies[i].text);
+        }
+    }
+    return successCount;
+}
+
+//command "mdelete" : delete several files on server with pipelined DELE commands
+void ftp_mdelete(FtpSession& session, const vector<string>& filenames) {
+    if (!session.is_open()) {
         cout << "Not connected to a server.\n";
+        write_log("MDELETE command failed - Not connected to server");
         return;
     }
-    if (!g_passive_mode_preference) {
-        cout << "Error: Client is not in passive mode. Active mode (PORT) is not supported for RETR.\n";
+
+    if (g_prompt_confirmation) {
+        cout << "You are about to delete " << filenames.size() << " file(s) on the server. Do you want to proceed? (y/N): ";
+        string confirmation;
+        getline(cin, confirmation);
+        if (confirmation != "y" && confirmation != "Y") {
+            cout << "mdelete operation cancelled by user.\n";
+            write_log("MDELETE operation cancelled by user");
+            return;
+        }
+    }
+
+    write_log("MDELETE command initiated - " + to_string(filenames.size()) + " files");
+    int deleted = run_pipelined_batch(session, "DELE", filenames, 250);
+    cout << "Deleted " << deleted << "/" << filenames.size() << " files.\n";
+    write_log("MDELETE command completed - " + to_string(deleted) + "/" + to_string(filenames.size()) + " files deleted");
+}
+
+//command "mmkdir" : create several directories on server with pipelined MKD commands
+void ftp_mmkdir(FtpSession& session, const vector<string>& dirnames) {
+    if (!session.is_open()) {
+        cout << "Not connected to a server.\n";
+        write_log("MMKDIR command failed - Not connected to server");
         return;
     }
 
-    log_transfer("DOWNLOAD_START", filename, "Initiating download");
+    write_log("MMKDIR command initiated - " + to_string(dirnames.size()) + " directories");
+    int created = run_pipelined_batch(session, "MKD", dirnames, 257);
+    cout << "Created " << created << "/" << dirnames.size() << " directories.\n";
+    write_log("MMKDIR command completed - " + to_string(created) + "/" + to_string(dirnames.size()) + " directories created");
+}
+
+//command "rename" : rename file on server. Returns true if the server renamed it
+bool ftp_rename(FtpSession& session, const string& oldname, const string& newname) {
+    if (!session.is_open()) {
+        console() << "Not connected to a server.\n";
+        write_log("RENAME command failed - Not connected to server");
+        return false;
+    }
+
+    write_log("RENAME command initiated - From: " + oldname + " To: " + newname);
+
+    string cmd1 = "RNFR " + oldname + "\r\n";
+    FtpReply reply;
+    if (!session.command(cmd1, reply)) {
+        console() << "No response after RNFR.\n";
+        write_log("RENAME command failed - No response after RNFR");
+        return false;
+    }
+    console() << "Server: " << reply.text;
+
+    if (!reply.is(350)) {
+        console() << "RNFR failed. Aborting rename.\n";
+        write_log("RENAME command failed - RNFR failed: " + string(reply.text));
+        return false;
+    }
+
+    string cmd2 = "RNTO " + newname + "\r\n";
+    if (session.command(cmd2, reply)) {
+        console() << "Server: " << reply.text;
+
+        if (reply.is(250)) {
+            g_listing_cache.invalidate_entry(session, oldname, true);
+            g_known_remote_dirs.remove_tree(resolve_remote_path(session, oldname));
+            g_listing_cache.invalidate_entry(session, newname, true);
+            write_log("RENAME command completed successfully - From: " + oldname + " To: " + newname);
+            return true;
+        }
+        write_log("RENAME command failed - RNTO failed: " + string(reply.text));
+    }
+    else {
+        console() << "No response after RNTO.\n";
+        write_log("RENAME command failed - No response after RNTO");
+    }
+    return false;
+}
 
-    send(controlSock, "PASV\r\n", 6, 0);
+//command "get/recv" : download single file from server, to `localPath` if given (else the same name locally)
+bool ftp_get(FtpSession& session, const string& filename, const string& localPath = "") {
+    if (!session.is_open()) {
+        console() << "Not connected to a server.\n";
+        return false;
+    }
+    if (!session.passive) {
+        console() << "Error: Client is not in passive mode. Active mode (PORT) is not supported for RETR.\n";
+        return false;
+    }
+
+    log_transfer("DOWNLOAD_START", filename, "Initiating download");
+    TraceSpan span("get", filename);
+    PhaseClock phases(filename);
 
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived <= 0) {
-        cout << "No PASV response.\n";
+    FtpReply reply;
+    if (!session.command("PASV\r\n", reply)) {
+        console() << "No PASV response.\n";
         log_transfer("DOWNLOAD_FAILED", filename, "No PASV response");
-        return;
+        return false;
+    }
+    console() << "Server: " << reply.text;
+
+    string ip;
+    int port;
+    if (!parsePasvResponse(reply.text, ip, port)) {
+        console() << "Failed to parse PASV response.\n";
+        log_transfer("DOWNLOAD_FAILED", filename, "Failed to parse PASV response");
+        return false;
+    }
+
+    SOCKET dataSock = connectToServer(ip.c_str(), port);
+    if (dataSock == INVALID_SOCKET) {
+        console() << "Failed to open data connection.\n";
+        log_transfer("DOWNLOAD_FAILED", filename, "Failed to open data connection");
+        return false;
+    }
+    tune_data_socket(dataSock);
+    phases.mark("pasv");
+
+    string retrCmd = "RETR " + filename + "\r\n";
+    if (session.command(retrCmd, reply)) {
+        console() << "Server: " << reply.text;
+    }
+    if (!reply.is_preliminary()) {
+        console() << "File transfer not started.\n";
+        closesocket(dataSock);
+        log_transfer("DOWNLOAD_FAILED", filename, "File transfer not started");
+        return false;
+    }
+
+    FILE* file = open_transfer_file(localPath.empty() ? filename : localPath, "wb");
+    if (!file) {
+        console() << "Failed to open local file for writing.\n";
+        closesocket(dataSock);
+        // The server still sends its 426/226 for the aborted RETR; read it so the next command is not desynchronized
+        session.read_reply(reply);
+        log_transfer("DOWNLOAD_FAILED", filename, "Failed to open local file for writing");
+        return false;
+    }
+
+    TransferBuffer transferBuffer(g_transfer_buffer_size);
+    phases.mark("retr");
+    auto dataStart = chrono::steady_clock::now();
+    long long totalBytes = transfer_socket_to_file(dataSock, file, transferBuffer, -1, &phases);
+    phases.mark("transfer");
+    long long dataMicros = micros_since(dataStart);
+
+    fclose(file);
+    closesocket(dataSock);
+
+    if (session.read_reply(reply)) {
+        console() << "Server: " << reply.text;
+    }
+    phases.mark("final_reply");
+    if (totalBytes >= 0) {
+        g_metrics.record_transfer("download", totalBytes, dataMicros);
+    }
+
+    if (totalBytes < 0) {
+        console() << "Download failed while receiving data: " << filename << endl;
+        log_transfer("DOWNLOAD_FAILED", filename, "Error while receiving or writing data");
+        return false;
+    }
+
+    console() << "File downloaded successfully: " << filename << endl;
+    log_transfer("DOWNLOAD_SUCCESS", filename, "Downloaded " + to_string(totalBytes) + " bytes");
+    return true;
+}
+
+// Connect to the ClamAV Agent, request a scan and open the data connection for the file contents.
+// Returns the agent control socket, or INVALID_SOCKET on failure
+SOCKET open_scan_session(const string& filename, SOCKET& clamDataSock) {
+    clamDataSock = INVALID_SOCKET;
+
+    SOCKET clamSock = connectToServer("127.0.0.1", 9000);
+    if (clamSock == INVALID_SOCKET) {
+        console() << "Failed to connect to ClamAV Agent\n";
+        log_scan(filename, "Failed to connect to ClamAV Agent");
+        return INVALID_SOCKET;
+    }
+
+    log_scan(filename, "Connected to ClamAV Agent");
+
+    string scanCmd = "SCAN " + filename + "\r\n";
+    send(clamSock, scanCmd.c_str(), (int)scanCmd.length(), 0);
+
+    char clamBuffer[1024] = {};
+    int clamLen = recv(clamSock, clamBuffer, sizeof(clamBuffer) - 1, 0);
+    if (clamLen <= 0) {
+        console() << "No PASV response from ClamAV\n";
+        closesocket(clamSock);
+        log_scan(filename, "No PASV response from ClamAV");
+        return INVALID_SOCKET;
+    }
+    clamBuffer[clamLen] = '\0';
+    console() << "ClamAV: " << clamBuffer;
+
+    string clamIp;
+    int clamPort;
+    if (!parsePasvResponse(clamBuffer, clamIp, clamPort)) {
+        console() << "Invalid PASV response from ClamAV\n";
+        closesocket(clamSock);
+        log_scan(filename, "Invalid PASV response from ClamAV");
+        return INVALID_SOCKET;
+    }
+
+    clamDataSock = connectToServer(clamIp.c_str(), clamPort);
+    if (clamDataSock == INVALID_SOCKET) {
+        console() << "Failed to connect data socket to ClamAV\n";
+        closesocket(clamSock);
+        log_scan(filename, "Failed to connect data socket to ClamAV");
+        return INVALID_SOCKET;
+    }
+    tune_data_socket(clamDataSock);
+    return clamSock;
+}
+
+// Wait for the scan verdict once the data connection has been closed. Closes the agent socket
+bool read_scan_verdict(SOCKET clamSock, string& verdict) {
+    char clamBuffer[1024] = {};
+    int clamLen = recv(clamSock, clamBuffer, sizeof(clamBuffer) - 1, 0);
+    closesocket(clamSock);
+
+    if (clamLen <= 0) {
+        verdict = "No verdict received";
+        return false;
+    }
+    clamBuffer[clamLen] = '\0';
+    verdict = clamBuffer;
+    return verdict.find("OK") != string::npos;
+}
+
+// Read one line from the ClamAV Agent, keeping what follows it in `pending`. Gives up after
+// g_socket_timeout seconds without data
+bool read_scan_line(SOCKET sock, string& pending, string& line) {
+    size_t end;
+    while ((end = pending.find('\n')) == string::npos) {
+        if (wait_socket(sock, IO_READ, g_socket_timeout * 1000) == 0) return false;
+        char buffer[1024];
+        int received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received <= 0) return false;
+        pending.append(buffer, received);
+    }
+    line = pending.substr(0, end);
+    pending.erase(0, end + 1);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    return true;
+}
+
+// Persistent connection to the ClamAV Agent. Each scan sends "SCANDATA <size> <name>" and the file
+// contents on this connection; the agent answers every scan with one verdict line, in order. Any
+// number of scans can be waiting for their verdict, while one at a time streams its contents.
+// An agent announcing STREAM takes "SCANSTREAM <name>" instead, with the contents as zINSTREAM
+// chunks up to a zero-length one, and may send a negative verdict before they are complete
+struct ScanConnection {
+    SOCKET sock;
+    mutex send_mutex; // Held by the scan that is about to stream or streaming
+    mutex state_mutex; // Guards the fields below
+    condition_variable turn;
+    unsigned long long next_ticket = 0; // Ticket of the next scan sent
+    unsigned long long next_verdict = 0; // Ticket whose verdict arrives next
+    bool broken = false;
+    string pending; // Received and not yet consumed; only the scan whose verdict is next reads it
+    long long scans = 0;
+    bool streaming = false; // The agent announced STREAM
+
+    explicit ScanConnection(SOCKET connected, string received) : sock(connected), pending(move(received)) {}
+    ~ScanConnection() { closesocket(sock); }
+
+    // Give up on the connection: waiting scans fail, and the next scan opens a new one. The socket
+    // is only shut down here; it is closed when the last scan using it lets go
+    void fail() {
+        lock_guard<mutex> lock(state_mutex);
+        if (!broken) shutdown(sock, SD_BOTH);
+        broken = true;
+        turn.notify_all();
+    }
+};
+
+// Read clamd's answer to one z-prefixed command, which ends with a NUL (or with the connection
+// closing). Gives up after g_socket_timeout seconds without data
+bool read_clamd_reply(SOCKET sock, string& reply) {
+    reply.clear();
+    while (true) {
+        if (wait_socket(sock, IO_READ, g_socket_timeout * 1000) == 0) return false;
+        char buffer[256];
+        int received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received < 0) return false;
+        if (received == 0) return !reply.empty();
+        reply.append(buffer, received);
+        size_t end = reply.find('\0');
+        if (end != string::npos) {
+            reply.resize(end);
+            return true;
+        }
+    }
+}
+
+// Verdict in the agent's terms for a clamd INSTREAM reply: "stream: OK" is "OK",
+// "stream: <signature> FOUND" is "FOUND <signature>" and "<reason> ERROR" is "ERROR <reason>"
+string clamd_verdict(string reply) {
+    while (!reply.empty() && (reply.back() == '\n' || reply.back() == '\r')) reply.pop_back();
+    if (reply.compare(0, 8, "stream: ") == 0) reply.erase(0, 8);
+    if (reply == "OK") return "OK";
+    if (reply.size() > 6 && reply.compare(reply.size() - 6, 6, " FOUND") == 0) {
+        return "FOUND " + reply.substr(0, reply.size() - 6);
+    }
+    if (reply.size() > 6 && reply.compare(reply.size() - 6, 6, " ERROR") == 0) reply.erase(reply.size() - 6);
+    return "ERROR " + reply;
+}
+
+const int DB_VERSION_REFRESH = 60; // Seconds a signature version read from the scanner is reused
+const size_t SCAN_CONNECTIONS_MAX = 8; // Persistent agent sessions streaming at once, as for "mput -j 8"
+
+// Scanner sessions of the client. The first scan probes the agent with CAPA: one that answers
+// "211 ... SIZED" gets a ScanConnection, which later scans and threads reuse as soon as its contents
+// are sent; parallel transfers open more, up to SCAN_CONNECTIONS_MAX. Any other answer means
+// the original protocol with two new connections per scan (SCAN <name>, 227, data, verdict).
+// After "scanner clamd" uploads skip the agent: each scan is one zINSTREAM on a new connection to
+// clamd, over TCP or a Unix socket
+class ScannerClient {
+public:
+    // Scan with clamd at `target` ("<ip>:<port>" or "unix:<socket path>") instead of the agent.
+    // Returns false if `target` is neither
+    bool use_clamd(const string& target) {
+        string host, path;
+        int port = 0;
+        if (target.compare(0, 5, "unix:") == 0) {
+            path = target.substr(5);
+            if (path.empty() || path.size() >= sizeof(sockaddr_un::sun_path)) return false;
+        }
+        else {
+            size_t colon = target.rfind(':');
+            if (colon == string::npos) return false;
+            host = target.substr(0, colon);
+            port = atoi(target.c_str() + colon + 1);
+            in_addr address;
+            if (inet_pton(AF_INET, host.c_str(), &address) != 1 || port <= 0 || port > 65535) return false;
+        }
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_use_clamd = true;
+            m_clamd_host = host;
+            m_clamd_port = static_cast<unsigned short>(port);
+            m_clamd_path = path;
+        }
+        // Not nested: clamd_version() takes m_mutex while holding m_version_mutex
+        lock_guard<mutex> versionLock(m_version_mutex);
+        m_clamd_version_read = false;
+        return true;
+    }
+
+    // Scan with the ClamAV Agent again
+    void use_agent() {
+        lock_guard<mutex> lock(m_mutex);
+        m_use_clamd = false;
+    }
+
+    bool uses_clamd() {
+        lock_guard<mutex> lock(m_mutex);
+        return m_use_clamd;
+    }
+
+    // New connection to clamd, which answers one command on it and closes it. INVALID_SOCKET on failure
+    SOCKET connect_clamd() {
+        unique_lock<mutex> lock(m_mutex);
+        string host = m_clamd_host, path = m_clamd_path;
+        unsigned short port = m_clamd_port;
+        lock.unlock();
+
+        SOCKET sock;
+        if (!path.empty()) {
+            sock = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            memcpy(addr.sun_path, path.c_str(), path.size()); // Shorter than sun_path, see use_clamd()
+            if (sock != INVALID_SOCKET && connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR) {
+                closesocket(sock);
+                sock = INVALID_SOCKET;
+            }
+            return sock;
+        }
+        sock = connectToServer(host.c_str(), port);
+        if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+        // The chunk that ends a stream must not wait for clamd's delayed ACK of the last data
+        int noDelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+        tune_data_socket(sock);
+        return sock;
+    }
+
+    // Daily signature version of clamd from zVERSION ("ClamAV 1.4.1/27433/<date>" gives
+    // "clamav-27433", as the agent reports it), asked again at most every DB_VERSION_REFRESH
+    // seconds. "" while clamd does not answer
+    string clamd_version() {
+        lock_guard<mutex> lock(m_version_mutex);
+        auto now = chrono::steady_clock::now();
+        if (m_clamd_version_read && now - m_clamd_version_time < chrono::seconds(DB_VERSION_REFRESH)) return m_clamd_version;
+
+        string reply;
+        SOCKET sock = connect_clamd();
+        if (sock != INVALID_SOCKET) {
+            static const char command[] = "zVERSION";
+            if (send_all(sock, command, sizeof(command))) read_clamd_reply(sock, reply);
+            closesocket(sock);
+        }
+        size_t first = reply.find('/');
+        size_t second = first == string::npos ? string::npos : reply.find('/', first + 1);
+        m_clamd_version = second == string::npos ? "" : "clamav-" + reply.substr(first + 1, second - first - 1);
+        m_clamd_version_read = true;
+        m_clamd_version_time = now;
+        return m_clamd_version;
+    }
+
+
+    // A connection to stream the next scan on, returned with its send_mutex held in `sending`. The
+    // agent scans one session's requests in turn, so an idle session comes first, then a new one
+    // while there are fewer than SCAN_CONNECTIONS_MAX, then the free one with the fewest verdicts
+    // outstanding, or else the next in turn once it is free. nullptr if the agent only speaks the
+    // original protocol (`legacy` is set) or could not be reached. A new session is connected and
+    // asked for CAPA without m_mutex, on a slot reserved in m_opening, so "status" and the other
+    // scans are not held up by an agent slow to answer
+    shared_ptr<ScanConnection> connection(bool& legacy, unique_lock<mutex>& sending) {
+        unique_lock<mutex> lock(m_mutex);
+        while (true) {
+            legacy = m_legacy;
+            if (m_legacy) return nullptr;
+            for (auto it = m_connections.begin(); it != m_connections.end();) {
+                ScanConnection& connection = **it;
+                unique_lock<mutex> stateLock(connection.state_mutex);
+                // With no verdict outstanding the agent has nothing to say: a readable connection was
+                // closed by it (a restarted agent, say) and is replaced before a scan is lost on it
+                bool idle = connection.next_ticket == connection.next_verdict;
+                bool stale = idle && !connection.broken && wait_socket(connection.sock, IO_READ, 0) != 0;
+                bool broken = connection.broken;
+                stateLock.unlock();
+                if (stale) connection.fail();
+                it = broken || stale ? m_connections.erase(it) : it + 1;
+            }
+            shared_ptr<ScanConnection> best;
+            unsigned long long bestOutstanding = 0;
+            for (const auto& connection : m_connections) {
+                unique_lock<mutex> free(connection->send_mutex, try_to_lock);
+                if (!free.owns_lock()) continue;
+                unsigned long long outstanding;
+                {
+                    lock_guard<mutex> stateLock(connection->state_mutex);
+                    outstanding = connection->next_ticket - connection->next_verdict;
+                }
+                if (!best || outstanding < bestOutstanding) {
+                    best = connection;
+                    bestOutstanding = outstanding;
+                    sending = move(free);
+                }
+                if (outstanding == 0) break;
+            }
+            size_t slots = m_connections.size() + m_opening;
+            if (best && (bestOutstanding == 0 || slots >= SCAN_CONNECTIONS_MAX)) return best;
+            if (best) sending.unlock();
+            if (slots < SCAN_CONNECTIONS_MAX) break;
+            if (m_connections.empty()) {
+                // Every slot is a session still being opened
+                m_opened.wait(lock);
+                continue;
+            }
+
+            // Every session is streaming: wait for one without holding up the others
+            shared_ptr<ScanConnection> next = m_connections[m_next_connection++ % m_connections.size()];
+            lock.unlock();
+            sending = unique_lock<mutex>(next->send_mutex);
+            {
+                lock_guard<mutex> stateLock(next->state_mutex);
+                if (!next->broken) return next;
+            }
+            sending.unlock();
+            lock.lock();
+        }
+
+        m_opening++;
+        lock.unlock();
+        SOCKET sock = connectToServer("127.0.0.1", 9000);
+        string pending, reply;
+        bool answered = sock != INVALID_SOCKET && send_all(sock, "CAPA\r\n", 6) && read_scan_line(sock, pending, reply);
+        // A busy agent turns the connection away; that says nothing about its protocol. Any other
+        // error is an agent of the original protocol rejecting CAPA
+        bool busy = answered && reply == "ERROR Agent busy";
+        shared_ptr<ScanConnection> connection;
+        if (answered && reply.compare(0, 3, "211") == 0 && reply.find("SIZED") != string::npos) {
+            // A request's last partial segment must not wait for the agent's delayed ACK of the previous one
+            int noDelay = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+            tune_data_socket(sock);
+            connection = make_shared<ScanConnection>(sock, move(pending));
+            connection->streaming = (reply + " ").find(" STREAM ") != string::npos;
+            sending = unique_lock<mutex>(connection->send_mutex);
+        }
+        else if (sock != INVALID_SOCKET) {
+            // An agent of the original protocol may be waiting for a data connection now; closing
+            // the control connection releases it
+            closesocket(sock);
+        }
+
+        lock.lock();
+        m_opening--;
+        m_opened.notify_all();
+        if (sock == INVALID_SOCKET) return nullptr;
+        if (busy) {
+            write_log("ClamAV Agent refused the session: " + reply);
+            return nullptr;
+        }
+        if (!connection) {
+            m_legacy = legacy = true;
+            write_log("ClamAV Agent has no persistent sessions - using one connection per scan");
+            return nullptr;
+        }
+        m_connections.push_back(connection);
+        string version = capa_version(reply);
+        {
+            lock_guard<mutex> versionLock(m_agent_version_mutex);
+            m_agent_version = version;
+            m_agent_version_read = true;
+            m_agent_version_time = chrono::steady_clock::now();
+        }
+        write_log("Persistent ClamAV Agent session opened" + string(connection->streaming ? " (early verdicts)" : "")
+            + (version.empty() ? "" : ", signatures " + version) + ", " + to_string(m_connections.size()) + " open");
+        return connection;
+    }
+
+    // Signature database version of the scanner in use, "" if unknown: clamd's from zVERSION, the
+    // agent's from its CAPA reply. A persistent session reads CAPA only when it opens, so once
+    // DB_VERSION_REFRESH seconds have passed the agent is asked again on a connection of its own
+    string db_version() {
+        unique_lock<mutex> lock(m_mutex);
+        bool useClamd = m_use_clamd, legacy = m_legacy;
+        lock.unlock();
+        if (useClamd) return clamd_version();
+        if (legacy) return "";
+
+        lock_guard<mutex> versionLock(m_agent_version_mutex);
+        auto now = chrono::steady_clock::now();
+        if (m_agent_version_read && now - m_agent_version_time < chrono::seconds(DB_VERSION_REFRESH)) return m_agent_version;
+        string reply;
+        SOCKET sock = connectToServer("127.0.0.1", 9000);
+        if (sock != INVALID_SOCKET) {
+            string pending;
+            if (!send_all(sock, "CAPA\r\nQUIT\r\n", 12) || !read_scan_line(sock, pending, reply)) reply.clear();
+            closesocket(sock);
+        }
+        m_agent_version = reply.compare(0, 3, "211") == 0 ? capa_version(reply) : "";
+        m_agent_version_read = true;
+        m_agent_version_time = now;
+        return m_agent_version;
+    }
+
+    string describe() {
+        lock_guard<mutex> lock(m_mutex);
+        if (m_use_clamd) {
+            return "clamd at " + (m_clamd_path.empty() ? m_clamd_host + ":" + to_string(m_clamd_port) : "unix:" + m_clamd_path) + " (zINSTREAM)";
+        }
+        if (m_legacy) return "ClamAV Agent, one connection per scan (no persistent sessions)";
+        size_t sessions = 0;
+        long long scans = 0;
+        bool streaming = false;
+        for (const auto& connection : m_connections) {
+            lock_guard<mutex> stateLock(connection->state_mutex);
+            if (connection->broken) continue;
+            sessions++;
+            scans += connection->scans;
+            streaming = streaming || connection->streaming;
+        }
+        if (sessions == 0) return "ClamAV Agent, not connected";
+        return "ClamAV Agent, " + to_string(sessions) + (sessions == 1 ? " persistent session" : " persistent sessions")
+            + (streaming ? " with early verdicts" : "") + ", " + to_string(scans) + " scans";
+    }
+
+private:
+    // The "DB=<version>" of a CAPA reply, "" if there is none
+    static string capa_version(const string& reply) {
+        size_t version = reply.find(" DB=");
+        if (version == string::npos) return "";
+        return reply.substr(version + 4, reply.find(' ', version + 4) - version - 4);
+    }
+
+    mutex m_mutex;
+    vector<shared_ptr<ScanConnection>> m_connections; // Persistent sessions, at most SCAN_CONNECTIONS_MAX
+    size_t m_next_connection = 0; // Session to wait for when all are streaming
+    size_t m_opening = 0; // Sessions being connected outside m_mutex, counted against the cap
+    condition_variable m_opened; // Signalled under m_mutex when one of them is done
+    bool m_legacy = false; // Set once the agent turned out to speak only the original protocol
+    bool m_use_clamd = false; // "scanner clamd": scan with clamd directly
+    string m_clamd_host;
+    unsigned short m_clamd_port = 0;
+    string m_clamd_path; // Unix socket of clamd, instead of host and port
+    mutex m_version_mutex; // Guards the fields below
+    string m_clamd_version;
+    bool m_clamd_version_read = false;
+    chrono::steady_clock::time_point m_clamd_version_time;
+    mutex m_agent_version_mutex; // Guards the fields below; taken last
+    string m_agent_version;
+    bool m_agent_version_read = false;
+    chrono::steady_clock::time_point m_agent_version_time;
+};
+
+ScannerClient g_scanner;
+
+// One file scan: begin() reaches the scanner, on a persistent session holding it for this scan's
+// contents, so a caller waiting for a free session does so before opening its FTP transfer.
+// open_stream() gives the socket the contents are written to, end_stream() reports how many were written and verdict() waits for the result. Either
+// protocol of ScannerClient is used, or clamd, whose contents must be sent as zINSTREAM chunks
+// (instream()). In chunks, early_verdict() tells between them whether the scanner has already
+// rejected the file. A scan dropped after its contents were sent still consumes its verdict, so the
+// scans queued behind it get theirs
+class ScanRequest {
+public:
+    ScanRequest() = default;
+    ScanRequest(const ScanRequest&) = delete;
+    ScanRequest& operator=(const ScanRequest&) = delete;
+    ~ScanRequest() {
+        if (m_sending.owns_lock() && m_announced) {
+            m_connection->fail(); // Fewer bytes than announced: the agent can no longer be followed
+        }
+        else if (m_queued) {
+            string ignored;
+            verdict(ignored);
+        }
+        if (m_control != INVALID_SOCKET) closesocket(m_control);
+        if (m_data != INVALID_SOCKET) closesocket(m_data);
+        if (m_clamd != INVALID_SOCKET) closesocket(m_clamd);
+    }
+
+    // Connect to the scanner for scanning `size` bytes of `filename`
+    bool begin(const string& filename, long long size) {
+        m_filename = filename;
+        m_size = size;
+        if (size < 0) {
+            console() << "Cannot read file size: " << filename << endl;
+            log_scan(filename, "Cannot read file size");
+            return false;
+        }
+        if (g_scanner.uses_clamd()) {
+            m_clamd = g_scanner.connect_clamd();
+            if (m_clamd == INVALID_SOCKET) {
+                console() << "Failed to connect to clamd\n";
+                log_scan(filename, "Failed to connect to clamd");
+                return false;
+            }
+            m_db_version = g_scanner.db_version();
+            return true;
+        }
+        bool legacy = false;
+        m_db_version = g_scanner.db_version();
+        m_connection = g_scanner.connection(legacy, m_sending);
+        if (m_connection) return true;
+        if (!legacy) {
+            console() << "Failed to connect to ClamAV Agent\n";
+            log_scan(filename, "Failed to connect to ClamAV Agent");
+            return false;
+        }
+        m_control = open_scan_session(filename, m_data);
+        return m_control != INVALID_SOCKET;
+    }
+
+    // Signature database version of the scanner, "" if unknown
+    string db_version() const { return m_db_version; }
+
+    // The contents go to clamd, or to an agent taking SCANSTREAM, and must be sent as zINSTREAM chunks
+    bool instream() const { return m_clamd != INVALID_SOCKET || (m_connection && m_connection->streaming); }
+
+    // The scanner answered before all contents were sent (early_verdict())
+    bool stopped_early() const { return m_has_early; }
+
+    // Announce the scan and return the socket to write exactly `size` bytes to, INVALID_SOCKET on failure
+    SOCKET open_stream() {
+        if (m_clamd != INVALID_SOCKET) {
+            static const char command[] = "zINSTREAM";
+            if (send_all(m_clamd, command, sizeof(command))) return m_clamd;
+            console() << "Lost connection to clamd\n";
+            log_scan(m_filename, "Lost connection to clamd");
+            return INVALID_SOCKET;
+        }
+        if (!m_connection) return m_data;
+        if (!m_sending.owns_lock()) return INVALID_SOCKET;
+        m_announced = true;
+        {
+            lock_guard<mutex> lock(m_connection->state_mutex);
+            m_ticket = m_connection->next_ticket++;
+            m_connection->scans++;
+        }
+        m_queued = true;
+        string header = (m_connection->streaming ? "SCANSTREAM " : "SCANDATA " + to_string(m_size) + " ") + m_filename + "\r\n";
+        if (!send_all(m_connection->sock, header.c_str(), header.length())) {
+            m_connection->fail();
+            m_sending.unlock();
+            console() << "Lost connection to ClamAV Agent\n";
+            log_scan(m_filename, "Lost connection to ClamAV Agent");
+            return INVALID_SOCKET;
+        }
+        return m_connection->sock;
+    }
+
+    // The contents are written: `sent` bytes, or -1 after an error
+    void end_stream(long long sent) {
+        if (m_clamd != INVALID_SOCKET) {
+            // A zero-length chunk ends the stream. An incomplete one is left open and gets no verdict
+            static const char end[4] = {};
+            m_streamed = sent == m_size && send_all(m_clamd, end, sizeof(end));
+            return;
+        }
+        if (!m_connection) {
+            if (m_data != INVALID_SOCKET) closesocket(m_data);
+            m_data = INVALID_SOCKET;
+            return;
+        }
+        if (!m_sending.owns_lock()) return;
+        if (!m_announced) {
+            m_sending.unlock(); // Never opened: the session is left as it was
+            return;
+        }
+        if (m_connection->streaming && sent >= 0) {
+            // The agent answers a stream ended early too; only a complete one can be clean
+            static const char end[4] = {};
+            if (!send_all(m_connection->sock, end, sizeof(end))) m_connection->fail();
+            m_streamed = sent == m_size;
+        }
+        else if (sent != m_size) {
+            m_connection->fail();
+        }
+        m_sending.unlock();
+    }
+
+    // Between chunks: whether the scanner has already answered, which it only does early to reject
+    // the file, so the rest need not be sent. Never waits
+    bool early_verdict() {
+        if (m_has_early) return true;
+        if (m_clamd != INVALID_SOCKET && !m_streamed) {
+            // clamd stopped reading the stream (StreamMaxLength exceeded, say)
+            if (wait_socket(m_clamd, IO_READ, 0) == 0) return false;
+            string reply;
+            m_early = read_clamd_reply(m_clamd, reply) ? clamd_verdict(reply) : "No verdict received";
+            m_has_early = true;
+            return true;
+        }
+        if (!m_connection || !m_connection->streaming || !m_sending.owns_lock() || !m_announced) return false;
+        ScanConnection& connection = *m_connection;
+        {
+            // Verdicts of earlier scans come first; this one is only looked for once they are read
+            lock_guard<mutex> lock(connection.state_mutex);
+            if (connection.broken || connection.next_verdict != m_ticket) return false;
+        }
+        if (connection.pending.empty() && wait_socket(connection.sock, IO_READ, 0) == 0) return false;
+        string line;
+        if (read_scan_line(connection.sock, connection.pending, line)) {
+            lock_guard<mutex> lock(connection.state_mutex);
+            connection.next_verdict++;
+            connection.turn.notify_all();
+        }
+        else {
+            connection.fail();
+            line = "No verdict received";
+        }
+        m_queued = false;
+        m_early = line;
+        m_has_early = true;
+        return true;
+    }
+
+    // Wait for the verdict; true if the file is clean
+    bool verdict(string& verdict) {
+        if (m_has_early) {
+            end_stream(-1);
+            verdict = m_early;
+            return false;
+        }
+        if (m_clamd != INVALID_SOCKET) {
+            SOCKET sock = m_clamd;
+            m_clamd = INVALID_SOCKET;
+            // clamd also answers a stream it stopped reading early (StreamMaxLength exceeded)
+            string reply;
+            bool answered = (m_streamed || wait_socket(sock, IO_READ, 0) != 0) && read_clamd_reply(sock, reply);
+            closesocket(sock);
+            if (!answered) {
+                verdict = m_streamed ? "No verdict received" : "Scan not completed";
+                return false;
+            }
+            verdict = clamd_verdict(reply);
+            return m_streamed && verdict == "OK";
+        }
+        if (!m_connection) {
+            SOCKET control = m_control;
+            m_control = INVALID_SOCKET;
+            if (control == INVALID_SOCKET) {
+                verdict = "No scan session";
+                return false;
+            }
+            return read_scan_verdict(control, verdict);
+        }
+        end_stream(-1); // A scan still streaming can no longer be completed
+        if (!m_queued) {
+            verdict = "Scan not sent";
+            return false;
+        }
+        m_queued = false;
+
+        ScanConnection& connection = *m_connection;
+        unique_lock<mutex> lock(connection.state_mutex);
+        connection.turn.wait(lock, [&]() { return connection.broken || connection.next_verdict == m_ticket; });
+        if (connection.broken) {
+            verdict = "Connection to ClamAV Agent lost";
+            return false;
+        }
+        // Until next_verdict moves on, no other scan touches the socket's input
+        lock.unlock();
+        string line;
+        bool received = read_scan_line(connection.sock, connection.pending, line);
+        if (!received) {
+            connection.fail();
+            verdict = "No verdict received";
+            return false;
+        }
+        lock.lock();
+        connection.next_verdict++;
+        connection.turn.notify_all();
+        verdict = line;
+        return line.compare(0, 2, "OK") == 0 && (!connection.streaming || m_streamed);
+    }
+
+private:
+    string m_filename;
+    long long m_size = 0;
+    shared_ptr<ScanConnection> m_connection; // Persistent protocol
+    unique_lock<mutex> m_sending; // The session's send_mutex, from begin() until the contents are sent
+    bool m_announced = false; // open_stream() sent the scan's header
+    unsigned long long m_ticket = 0;
+    bool m_queued = false; // Sent and its verdict not read yet
+    SOCKET m_control = INVALID_SOCKET; // Original protocol
+    SOCKET m_data = INVALID_SOCKET;
+    SOCKET m_clamd = INVALID_SOCKET; // clamd
+    bool m_streamed = false; // All contents and the end of the stream reached clamd or a streaming agent
+    bool m_has_early = false; // The scanner answered before the contents were complete
+    string m_early; // That answer
+    string m_db_version; // Signature version of the scanner when the scan began
+};
+
+// Size of a local file, -1 if it cannot be read
+long long local_file_size(const string& filename) {
+    error_code ec;
+    uintmax_t size = fs::file_size(filename, ec);
+    return ec ? -1 : static_cast<long long>(size);
+}
+
+// Modification time of a local file in file clock ticks, 0 if it cannot be read
+long long local_file_time(const string& filename) {
+    error_code ec;
+    fs::file_time_type time = fs::last_write_time(filename, ec);
+    return ec ? 0 : static_cast<long long>(time.time_since_epoch().count());
+}
+
+// Scan verdicts kept across runs, so unchanged files are not sent to the ClamAV Agent again. A
+// verdict belongs to (content hash, size, signature database version); a file index maps a local
+// file's (path, size, modification time) to the hash of its contents when it was scanned, which
+// recognizes an unchanged file without reading it. Uploads relying on a cached verdict hash what they
+// send to a hidden name and are renamed into place only on a match. The hash is seeded with a random key stored in the cache
+// file, so contents cannot be prepared to collide with a cached clean file without reading it.
+// The file is a header line plus appended entries, the last entry for a key winning:
+//     V <hash> <size> <db version> <verdict>
+//     F <hash> <size> <modification time> <absolute path>
+class VerdictCache {
+public:
+    struct Hit {
+        uint64_t hash = 0;
+        bool clean = false;
+        string verdict;
+    };
+
+    // Switch to another cache file ("" disables caching); it is read on first use
+    void open(const string& filename) {
+        lock_guard<mutex> lock(m_mutex);
+        close_file();
+        m_filename = filename;
+        m_loaded = false;
+        m_verdicts.clear();
+        m_files.clear();
+    }
+
+    uint64_t seed() {
+        lock_guard<mutex> lock(m_mutex);
+        load();
+        return m_seed;
+    }
+
+    size_t size() {
+        lock_guard<mutex> lock(m_mutex);
+        load();
+        return m_verdicts.size();
+    }
+
+    // Cached verdict for the unchanged file `filename`, scanned with signatures `dbVersion`
+    bool lookup(const string& filename, long long size, long long time, const string& dbVersion, Hit& hit) {
+        if (dbVersion.empty()) return false;
+        lock_guard<mutex> lock(m_mutex);
+        if (!load()) return false;
+        auto file = m_files.find(absolute_path(filename));
+        if (file == m_files.end() || file->second.size != size || file->second.time != time) return false;
+        auto verdict = m_verdicts.find(verdict_key(file->second.hash, size, dbVersion));
+        if (verdict == m_verdicts.end()) return false;
+        hit.hash = file->second.hash;
+        hit.verdict = verdict->second;
+        hit.clean = is_clean(hit.verdict);
+        return true;
+    }
+
+    // Remember the verdict of a file whose contents hashed to `hash`. Only real verdicts are kept,
+    // not scan failures
+    void store(const string& filename, long long size, long long time, uint64_t hash, const string& dbVersion, const string& verdict) {
+        if (dbVersion.empty() || (!is_clean(verdict) && verdict.find("FOUND") == string::npos)) return;
+        string text = verdict;
+        while (!text.empty() && (text.back() == '\n' || text.back() == '\r')) text.pop_back();
+        string path = absolute_path(filename);
+        lock_guard<mutex> lock(m_mutex);
+        if (!load()) return;
+        m_verdicts[verdict_key(hash, size, dbVersion)] = text;
+        m_files[path] = { hash, size, time };
+        append("V " + hex(hash) + " " + to_string(size) + " " + dbVersion + " " + text);
+        append("F " + hex(hash) + " " + to_string(size) + " " + to_string(time) + " " + path);
+    }
+
+    // Drop the file index entry of `filename`, whose contents no longer match it
+    void forget(const string& filename) {
+        string path = absolute_path(filename);
+        lock_guard<mutex> lock(m_mutex);
+        if (!load() || m_files.erase(path) == 0) return;
+        append("F 0 -1 0 " + path);
+    }
+
+private:
+    struct FileEntry {
+        uint64_t hash;
+        long long size;
+        long long time;
+    };
+
+    mutex m_mutex;
+    string m_filename;
+    bool m_loaded = false;
+    FILE* m_file = nullptr; // Open for appending while the cache is in use
+    uint64_t m_seed = 0;
+    map<string, string> m_verdicts; // verdict_key() -> verdict
+    map<string, FileEntry> m_files; // Absolute path -> contents when scanned
+
+    static bool is_clean(const string& verdict) { return verdict.compare(0, 2, "OK") == 0; }
+    static string verdict_key(uint64_t hash, long long size, const string& dbVersion) {
+        return hex(hash) + " " + to_string(size) + " " + dbVersion;
+    }
+    static string hex(uint64_t value) {
+        char text[17];
+        snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(value));
+        return text;
+    }
+    static string absolute_path(const string& filename) {
+        error_code ec;
+        fs::path path = fs::absolute(filename, ec);
+        return ec ? filename : path.lexically_normal().string();
+    }
+
+    // Read the cache file once and open it for appending; a missing file is created with a new seed.
+    // False while caching is disabled or the file cannot be used
+    bool load() {
+        if (m_filename.empty()) return false;
+        if (m_loaded) return m_file != nullptr;
+        m_loaded = true;
+
+        ifstream in(m_filename);
+        string line;
+        size_t lines = 0;
+        bool valid = in && getline(in, line) && sscanf_s(line.c_str(), "ftp-scan-cache 1 %llx", reinterpret_cast<unsigned long long*>(&m_seed)) == 1;
+        while (valid && getline(in, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            istringstream fields(line);
+            string kind, hash, rest;
+            long long size = 0, time = 0;
+            if (!(fields >> kind >> hash >> size)) continue;
+            if (kind == "V") {
+                string dbVersion;
+                if (!(fields >> dbVersion) || !getline(fields >> ws, rest)) continue;
+                m_verdicts[hash + " " + to_string(size) + " " + dbVersion] = rest;
+            }
+            else if (kind == "F") {
+                if (!(fields >> time) || !getline(fields >> ws, rest)) continue;
+                if (size < 0) m_files.erase(rest);
+                else m_files[rest] = { strtoull(hash.c_str(), nullptr, 16), size, time };
+            }
+            lines++;
+        }
+        in.close();
+
+        // Start over if the file is missing or damaged, and rewrite it once superseded entries dominate
+        if (!valid) {
+            random_device random;
+            m_seed = (static_cast<uint64_t>(random()) << 32) ^ random();
+            m_verdicts.clear();
+            m_files.clear();
+        }
+        if (!valid || lines > 2 * (m_verdicts.size() + m_files.size()) + 64) {
+            if (!rewrite()) return false;
+        }
+        if (fopen_s(&m_file, m_filename.c_str(), "ab") != 0) m_file = nullptr;
+        if (!m_file) write_log("Scan cache unavailable - Cannot open " + m_filename);
+        return m_file != nullptr;
+    }
+
+    bool rewrite() {
+        string temp = m_filename + ".tmp";
+        {
+            ofstream out(temp, ios::trunc);
+            out << "ftp-scan-cache 1 " << hex(m_seed) << "\n";
+            for (const auto& [key, verdict] : m_verdicts) {
+                istringstream fields(key);
+                string hash, size, dbVersion;
+                fields >> hash >> size >> dbVersion;
+                out << "V " << hash << " " << size << " " << dbVersion << " " << verdict << "\n";
+            }
+            for (const auto& [path, entry] : m_files) {
+                out << "F " << hex(entry.hash) << " " << entry.size << " " << entry.time << " " << path << "\n";
+            }
+            if (!out) {
+                write_log("Scan cache unavailable - Cannot write " + temp);
+                return false;
+            }
+        }
+        error_code ec;
+        fs::rename(temp, m_filename, ec);
+        return !ec;
+    }
+
+    void append(const string& line) {
+        fputs((line + "\n").c_str(), m_file);
+        fflush(m_file);
+    }
+
+    void close_file() {
+        if (m_file) fclose(m_file);
+        m_file = nullptr;
+    }
+};
+
+VerdictCache g_verdict_cache;
+
+// Enter passive mode, open the data connection and send STOR for remoteName; marks the "pasv" and
+// "stor" phases. Returns the data socket once the server accepted the transfer, or INVALID_SOCKET
+SOCKET start_stor_transfer(FtpSession& session, const string& filename, const string& remoteName, PhaseClock& phases) {
+    // Drop the cached listing now: resolving the path may need a PWD, which the server would not
+    // answer while it waits for STOR data
+    g_listing_cache.invalidate_entry(session, remoteName);
+
+    FtpReply reply;
+    if (!session.command("PASV\r\n", reply)) {
+        console() << "No PASV response from FTP server.\n";
+        log_transfer("UPLOAD_FAILED", filename, "No PASV response from FTP server");
+        return INVALID_SOCKET;
     }
-    buffer[bytesReceived] = '\0';
-    cout << "Server: " << buffer;
+    console() << "Server: " << reply.text;
 
     string ip;
     int port;
-    if (!parsePasvResponse(buffer, ip, port)) {
-        cout << "Failed to parse PASV response.\n";
-        log_transfer("DOWNLOAD_FAILED", filename, "Failed to parse PASV response");
-        return;
+    if (!parsePasvResponse(reply.text, ip, port)) {
+        console() << "Failed to parse PASV response from FTP server.\n";
+        log_transfer("UPLOAD_FAILED", filename, "Failed to parse PASV response from FTP server");
+        return INVALID_SOCKET;
     }
 
     SOCKET dataSock = connectToServer(ip.c_str(), port);
     if (dataSock == INVALID_SOCKET) {
-        cout << "Failed to open data connection.\n";
-        log_transfer("DOWNLOAD_FAILED", filename, "Failed to open data connection");
-        return;
+        console() << "Unable to establish data connection with FTP server.\n";
+        log_transfer("UPLOAD_FAILED", filename, "Unable to establish data connection with FTP server");
+        return INVALID_SOCKET;
     }
+    tune_data_socket(dataSock);
+    phases.mark("pasv");
 
-    string retrCmd = "RETR " + filename + "\r\n";
-    send(controlSock, retrCmd.c_str(), static_cast<int>(retrCmd.length()), 0);
-
-    bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
-
-        if (strncmp(buffer, "150", 3) != 0) {
-            cout << "File transfer not started.\n";
-            closesocket(dataSock);
-            log_transfer("DOWNLOAD_FAILED", filename, "File transfer not started");
-            return;
-        }
+    string storCmd = "STOR " + remoteName + "\r\n";
+    if (!session.command(storCmd, reply)) {
+        console() << "No response after STOR command.\n";
+        closesocket(dataSock);
+        log_transfer("UPLOAD_FAILED", filename, "No response after STOR command");
+        return INVALID_SOCKET;
     }
+    console() << "Server: " << reply.text;
 
-    FILE* file;
-    fopen_s(&file, filename.c_str(), "wb");
-    if (!file) {
-        cout << "Failed to open local file for writing.\n";
+    if (!reply.is_preliminary()) { // Check if server is ready to accept data
+        console() << "FTP server rejected STOR command. Aborting upload.\n";
         closesocket(dataSock);
-        log_transfer("DOWNLOAD_FAILED", filename, "Failed to open local file for writing");
-        return;
+        log_transfer("UPLOAD_FAILED", filename, "FTP server rejected STOR command");
+        return INVALID_SOCKET;
     }
+    phases.mark("stor");
+    return dataSock;
+}
 
-    int totalBytes = 0;
-    while ((bytesReceived = recv(dataSock, buffer, sizeof(buffer), 0)) > 0) {
-        fwrite(buffer, 1, bytesReceived, file);
-        totalBytes += bytesReceived;
+// Read the server's final reply after the STOR data connection was closed
+bool finish_stor_transfer(FtpSession& session) {
+    FtpReply reply;
+    if (!session.read_reply(reply)) {
+        console() << "No final response from FTP server after file transfer.\n";
+        return false;
     }
+    console() << "Server: " << reply.text;
+    return reply.is_completion();
+}
 
-    fclose(file);
-    closesocket(dataSock);
-
-    bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
-    }
+// Hidden name next to `remoteName` for an upload still waiting for its verdict, such as
+// "dir/.report.pdf.3f9a1c2b.scanning". The random part keeps concurrent clients apart
+string hidden_upload_name(const string& remoteName) {
+    thread_local mt19937 random(random_device{}());
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%08x", static_cast<unsigned>(random()));
+    size_t slash = remoteName.find_last_of('/');
+    string directory = slash == string::npos ? "" : remoteName.substr(0, slash + 1);
+    string name = slash == string::npos ? remoteName : remoteName.substr(slash + 1);
+    return directory + "." + name + suffix + ".scanning";
+}
 
-    cout << "File downloaded successfully: " << filename << endl;
-    log_transfer("DOWNLOAD_SUCCESS", filename, "Downloaded " + to_string(totalBytes) + " bytes");
+// Whether `remoteName` may already exist on the server: SIZE answers 213 for a file and 550 for a
+// missing one. Any other reply (SIZE not supported, say) cannot rule it out
+bool remote_file_may_exist(FtpSession& session, const string& remoteName) {
+    FtpReply reply;
+    return !session.command("SIZE " + remoteName + "\r\n", reply) || !reply.is(550);
 }
 
-// command "put" : upload single file to server with ClamAV scan
-void ftp_put(int controlSock, const string& filename) {
-    if (controlSock == INVALID_SOCKET) {
-        cout << "Not connected to a server.\n";
-        return;
-    }
-    if (!g_passive_mode_preference) {
-        cout << "Error: Client is not in passive mode. Active mode (PORT) is not supported for STOR.\n";
-        return;
+// Upload `file` on its cached clean verdict, without a scan. The contents are hashed in the same
+// pass that sends them to a hidden name, which is renamed to `remoteName` only if they are the
+// ones the verdict was given for: an edit that kept the size and modification time never shows up
+// under the file's name. If they differ, the hidden copy and the cache entry are dropped and
+// `changed` is set; the caller then scans the file like any other
+bool ftp_put_cached(FtpSession& session, FILE* file, const string& filename, const string& remoteName, long long fileSize,
+                    const VerdictCache::Hit& cached, PhaseClock& phases, bool& changed) {
+    changed = false;
+    string storName = hidden_upload_name(remoteName);
+    SOCKET dataSock = start_stor_transfer(session, filename, storName, phases);
+    if (dataSock == INVALID_SOCKET) {
+        return false;
     }
 
-    log_transfer("UPLOAD_START", filename, "Initiating upload with ClamAV scan");
+    TransferBuffer transferBuffer(g_transfer_buffer_size);
+    ContentHasher hasher(g_verdict_cache.seed());
+    long long sentBytes = transfer_file_to_socket(file, dataSock, transferBuffer, -1, &hasher);
+    long long dataMicros = phases.mark("transfer");
+    closesocket(dataSock);
 
-    // Step 1: Connect to ClamAV Agent and send file for scanning
-    SOCKET clamSock = connectToServer("127.0.0.1", 9000);
-    if (clamSock == INVALID_SOCKET) {
-        cout << "Failed to connect to ClamAV Agent\n";
-        log_scan(filename, "Failed to connect to ClamAV Agent");
-        log_transfer("UPLOAD_FAILED", filename, "ClamAV connection failed");
-        return;
-    }
+    bool stored = finish_stor_transfer(session);
+    phases.mark("final_reply");
+    if (sentBytes >= 0) {
+        g_metrics.record_transfer("upload", sentBytes, dataMicros);
+    }
+
+    if (sentBytes >= 0 && (sentBytes != fileSize || hasher.digest() != cached.hash)) {
+        console() << "File changed since its cached scan. Removing uploaded file and scanning it.\n";
+        ftp_delete(session, storName);
+        g_verdict_cache.forget(filename);
+        log_scan(filename, "Contents differ from the cached verdict - scanning again");
+        changed = true;
+        return false;
+    }
+    if (sentBytes < 0 || !stored) {
+        console() << (sentBytes < 0 ? "Upload failed while sending data: " : "FTP server did not confirm the upload: ") << filename << endl;
+        ftp_delete(session, storName);
+        log_transfer("UPLOAD_FAILED", filename, sentBytes < 0 ? "Error while reading or sending data" : "FTP server did not confirm the upload");
+        return false;
+    }
+    log_scan(filename, "CLEAN - " + cached.verdict + " (cached)");
+
+    bool renamed = ftp_rename(session, storName, remoteName);
+    phases.mark("rename");
+    if (!renamed) {
+        console() << "Could not rename the upload to " << remoteName << ". Removing uploaded file.\n";
+        ftp_delete(session, storName);
+        log_transfer("UPLOAD_FAILED", filename, "Could not rename " + storName + " to " + remoteName);
+        return false;
+    }
+    console() << "File uploaded successfully: " << filename << endl;
+    log_transfer("UPLOAD_SUCCESS", filename, "Uploaded " + to_string(sentBytes) + " bytes (cached verdict)");
+    return true;
+}
 
-    log_scan(filename, "Connected to ClamAV Agent");
+// Upload a file while it is being scanned: every chunk is read from disk once and sent to both
+// the scanner and the FTP data connection. The upload is deleted again unless the verdict is clean.
+// With g_hidden_upload it is stored under hidden_upload_name() and renamed to `remoteName` only
+// once clean, so an infected file is never visible under its name, not even while it is scanned.
+// Without it the file is stored under its name directly, unless that would overwrite an existing
+// file before the verdict: deleting a rejected upload would then lose the previous copy, so such
+// an upload goes through a hidden name too
+bool ftp_put_pipelined(FtpSession& session, const string& filename, const string& remoteName) {
+    log_transfer("UPLOAD_START", filename, "Initiating pipelined upload with ClamAV scan");
+    TraceSpan span("put", filename);
+    PhaseClock phases(filename);
+
+    FILE* file = open_transfer_file(filename, "rb");
+    if (!file) {
+        console() << "Cannot open file: " << filename << endl;
+        log_transfer("UPLOAD_FAILED", filename, "Cannot open file");
+        return false;
+    }
 
-    string scanCmd = "SCAN " + filename + "\r\n";
-    send(clamSock, scanCmd.c_str(), (int)scanCmd.length(), 0);
+    long long fileSize = local_file_size(filename);
+    long long fileTime = local_file_time(filename);
 
-    char clamBuffer[1024] = {};
-    int clamLen = recv(clamSock, clamBuffer, sizeof(clamBuffer) - 1, 0);
-    if (clamLen <= 0) {
-        cout << "No PASV response from ClamAV\n";
-        closesocket(clamSock);
-        log_scan(filename, "No PASV response from ClamAV");
-        log_transfer("UPLOAD_FAILED", filename, "ClamAV scan failed");
-        return;
+    // An unchanged file with a cached verdict is uploaded without a scan; a known infected one not at all
+    VerdictCache::Hit cached;
+    if (g_verdict_cache.lookup(filename, fileSize, fileTime, g_scanner.db_version(), cached)) {
+        if (!cached.clean) {
+            fclose(file);
+            console() << "ClamAV detected virus (cached verdict). File not uploaded.\n";
+            log_scan(filename, "VIRUS DETECTED (cached verdict) - " + cached.verdict);
+            log_transfer("UPLOAD_FAILED", filename, "ClamAV scan failed or virus detected");
+            return false;
+        }
+        bool changed;
+        bool uploaded = ftp_put_cached(session, file, filename, remoteName, fileSize, cached, phases, changed);
+        if (!changed) {
+            fclose(file);
+            return uploaded;
+        }
+        rewind(file);
     }
-    clamBuffer[clamLen] = '\0';
-    cout << "ClamAV: " << clamBuffer;
-
-    string clamIp;
-    int clamPort;
-    if (!parsePasvResponse(clamBuffer, clamIp, clamPort)) {
-        cout << "Invalid PASV response from ClamAV\n";
-        closesocket(clamSock);
-        log_scan(filename, "Invalid PASV response from ClamAV");
+    ScanRequest scan;
+    if (!scan.begin(filename, fileSize)) {
+        fclose(file);
         log_transfer("UPLOAD_FAILED", filename, "ClamAV scan failed");
-        return;
+        return false;
     }
+    phases.mark("scan_connect");
 
-    SOCKET clamDataSock = connectToServer(clamIp.c_str(), clamPort);
+    bool hidden = g_hidden_upload || remote_file_may_exist(session, remoteName);
+    string storName = hidden ? hidden_upload_name(remoteName) : remoteName;
+    SOCKET dataSock = start_stor_transfer(session, filename, storName, phases);
+    if (dataSock == INVALID_SOCKET) {
+        fclose(file);
+        return false;
+    }
+    SOCKET clamDataSock = scan.open_stream();
     if (clamDataSock == INVALID_SOCKET) {
-        cout << "Failed to connect data socket to ClamAV\n";
-        closesocket(clamSock);
-        log_scan(filename, "Failed to connect data socket to ClamAV");
+        fclose(file);
+        closesocket(dataSock);
+        finish_stor_transfer(session);
+        ftp_delete(session, storName);
         log_transfer("UPLOAD_FAILED", filename, "ClamAV scan failed");
-        return;
-    }
-
-    FILE* fileToScan;
-    fopen_s(&fileToScan, filename.c_str(), "rb");
-    if (!fileToScan) {
-        cout << "Cannot open file: " << filename << endl;
-        closesocket(clamSock);
-        closesocket(clamDataSock);
-        log_scan(filename, "Cannot open file for scanning");
-        log_transfer("UPLOAD_FAILED", filename, "Cannot open file");
-        return;
-    }
-
-    char fileBuffer[1024];
-    int scannedBytes = 0;
-    while (!feof(fileToScan)) {
-        size_t n = fread(fileBuffer, 1, sizeof(fileBuffer), fileToScan);
-        if (n > 0) {
-            send(clamDataSock, fileBuffer, (int)n, 0);
-            scannedBytes += n;
-        }
+        return false;
     }
 
-    fclose(fileToScan);
-    closesocket(clamDataSock);
+    TransferBuffer transferBuffer(g_transfer_buffer_size);
+    ContentHasher hasher(g_verdict_cache.seed());
+    long long sentBytes = transfer_file_to_sockets(file, clamDataSock, dataSock, transferBuffer, fileSize, &hasher, scan.instream(), [&scan]() { return scan.early_verdict(); });
+    long long dataMicros = phases.mark("transfer");
 
-    clamLen = recv(clamSock, clamBuffer, sizeof(clamBuffer) - 1, 0);
-    closesocket(clamSock);
+    fclose(file);
+    scan.end_stream(sentBytes);
+    closesocket(dataSock);
 
-    if (clamLen <= 0 || string(clamBuffer).find("OK") == string::npos) {
-        cout << "ClamAV detected virus or scan failed. File not uploaded.\n";
-        log_scan(filename, "VIRUS DETECTED or scan failed - " + string(clamBuffer));
+    bool stored = finish_stor_transfer(session);
+    phases.mark("final_reply");
+    string verdict;
+    bool clean = scan.verdict(verdict);
+    phases.mark("scan_verdict");
+    // A clean verdict is cached only for an upload the server confirmed
+    if (sentBytes == fileSize && (stored || !clean)) g_verdict_cache.store(filename, fileSize, fileTime, hasher.digest(), scan.db_version(), verdict);
+    // The scanner rejected the file mid-stream; the server got only what was sent until then
+    if (scan.stopped_early() && sentBytes < fileSize) verdict += " (after " + to_string(sentBytes) + " of " + to_string(fileSize) + " bytes)";
+    if (sentBytes >= 0) {
+        g_metrics.record_transfer("upload", sentBytes, dataMicros);
+    }
+
+    if (!clean) {
+        console() << "ClamAV detected virus or scan failed. Removing uploaded file.\n";
+        log_scan(filename, "VIRUS DETECTED or scan failed - " + verdict);
+        ftp_delete(session, storName);
         log_transfer("UPLOAD_FAILED", filename, "ClamAV scan failed or virus detected");
-        return; // Exit if ClamAV detects a virus or fails to scan
+        return false;
     }
+    log_scan(filename, "CLEAN - Scanned " + to_string(sentBytes) + " bytes");
 
-    cout << "ClamAV scan successful. Proceeding with FTP upload.\n";
-    log_scan(filename, "CLEAN - Scanned " + to_string(scannedBytes) + " bytes");
-
-    // Step 2: Enter passive mode with the FTP server
-    send(controlSock, "PASV\r\n", 6, 0);
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived <= 0) {
-        cout << "No PASV response from FTP server.\n";
-        log_transfer("UPLOAD_FAILED", filename, "No PASV response from FTP server");
-        return;
+    if (sentBytes < 0 || !stored) {
+        console() << "Upload failed while sending data: " << filename << endl;
+        ftp_delete(session, storName);
+        log_transfer("UPLOAD_FAILED", filename, "Error while reading or sending data");
+        return false;
     }
-    buffer[bytesReceived] = '\0';
-    cout << "Server: " << buffer;
 
-    // Step 3: Parse IP/Port from PASV response
-    string ip;
-    int port;
-    if (!parsePasvResponse(buffer, ip, port)) {
-        cout << "Failed to parse PASV response from FTP server.\n";
-        log_transfer("UPLOAD_FAILED", filename, "Failed to parse PASV response from FTP server");
-        return;
+    if (hidden) {
+        bool renamed = ftp_rename(session, storName, remoteName);
+        phases.mark("rename");
+        if (!renamed) {
+            console() << "Could not rename the scanned upload to " << remoteName << ". Removing uploaded file.\n";
+            ftp_delete(session, storName);
+            log_transfer("UPLOAD_FAILED", filename, "Could not rename " + storName + " to " + remoteName);
+            return false;
+        }
     }
 
-    SOCKET dataSock = connectToServer(ip.c_str(), port);
-    if (dataSock == INVALID_SOCKET) {
-        cout << "Unable to establish data connection with FTP server.\n";
-        log_transfer("UPLOAD_FAILED", filename, "Unable to establish data connection with FTP server");
-        return;
+    console() << "File uploaded successfully: " << filename << endl;
+    log_transfer("UPLOAD_SUCCESS", filename, "Uploaded " + to_string(sentBytes) + " bytes (pipelined" + (hidden ? ", hidden until clean)" : ")"));
+    return true;
+}
+
+// command "put" : upload single file to server with ClamAV scan, stored as `remotePath` if given
+// (else under the same name). Neither the local nor the remote working directory is changed
+bool ftp_put(FtpSession& session, const string& filename, const string& remotePath = "") {
+    const string& remoteName = remotePath.empty() ? filename : remotePath;
+    if (!session.is_open()) {
+        console() << "Not connected to a server.\n";
+        return false;
+    }
+    if (!session.passive) {
+        console() << "Error: Client is not in passive mode. Active mode (PORT) is not supported for STOR.\n";
+        return false;
+    }
+    if (g_pipelined_upload) {
+        return ftp_put_pipelined(session, filename, remoteName);
     }
 
-    // Step 4: Send STOR command to initiate upload
-    string storCmd = "STOR " + filename + "\r\n";
-    send(controlSock, storCmd.c_str(), static_cast<int>(storCmd.length()), 0);
+    log_transfer("UPLOAD_START", filename, "Initiating upload with ClamAV scan");
+    TraceSpan span("put", filename);
+    PhaseClock phases(filename);
 
-    memset(buffer, 0, sizeof(buffer)); // Clear buffer before receiving
-    bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived <= 0) {
-        cout << "No response after STOR command.\n";
-        closesocket(dataSock);
-        log_transfer("UPLOAD_FAILED", filename, "No response after STOR command");
-        return;
+    // Step 1: Connect to ClamAV Agent and send file for scanning
+    FILE* fileToScan = open_transfer_file(filename, "rb");
+    if (!fileToScan) {
+        console() << "Cannot open file: " << filename << endl;
+        log_scan(filename, "Cannot open file for scanning");
+        log_transfer("UPLOAD_FAILED", filename, "Cannot open file");
+        return false;
+    }
+
+    long long fileSize = local_file_size(filename);
+    long long fileTime = local_file_time(filename);
+
+    // An unchanged file with a cached clean verdict is uploaded without contacting the scanner, and
+    // one whose contents turn out to differ is scanned like any other
+    VerdictCache::Hit cached;
+    bool fromCache = g_verdict_cache.lookup(filename, fileSize, fileTime, g_scanner.db_version(), cached);
+    if (fromCache && cached.clean) {
+        bool changed;
+        bool uploaded = ftp_put_cached(session, fileToScan, filename, remoteName, fileSize, cached, phases, changed);
+        if (!changed) {
+            fclose(fileToScan);
+            return uploaded;
+        }
+        fromCache = false;
+        rewind(fileToScan);
+    }
+    TransferBuffer transferBuffer(g_transfer_buffer_size);
+    long long scannedBytes = fileSize;
+    string verdict, scannedVersion;
+    uint64_t scannedHash = 0;
+    bool clean;
+    if (fromCache) {
+        fclose(fileToScan);
+        verdict = cached.verdict + " (cached)";
+        clean = cached.clean;
+    }
+    else {
+        ScanRequest scan;
+        if (!scan.begin(filename, fileSize)) {
+            fclose(fileToScan);
+            log_transfer("UPLOAD_FAILED", filename, "ClamAV scan failed");
+            return false;
+        }
+        phases.mark("scan_connect");
+
+        ContentHasher hasher(g_verdict_cache.seed());
+        SOCKET clamDataSock = scan.open_stream();
+        scannedBytes = clamDataSock == INVALID_SOCKET ? -1
+            : transfer_file_to_socket(fileToScan, clamDataSock, transferBuffer, fileSize, &hasher, scan.instream(), [&scan]() { return scan.early_verdict(); });
+
+        fclose(fileToScan);
+        scan.end_stream(scannedBytes);
+        phases.mark("scan_stream");
+
+        clean = scan.verdict(verdict);
+        phases.mark("scan_verdict");
+        // A clean verdict is cached once the server has confirmed the upload below
+        scannedHash = hasher.digest();
+        scannedVersion = scan.db_version();
+        if (!clean && scannedBytes == fileSize) g_verdict_cache.store(filename, fileSize, fileTime, scannedHash, scannedVersion, verdict);
+        // The rest of the file was not read once the scanner had rejected it
+        if (scan.stopped_early() && scannedBytes < fileSize) verdict += " (after " + to_string(scannedBytes) + " of " + to_string(fileSize) + " bytes)";
+    }
+
+    if (scannedBytes < 0 || !clean) {
+        console() << "ClamAV detected virus or scan failed. File not uploaded.\n";
+        log_scan(filename, "VIRUS DETECTED or scan failed - " + verdict);
+        log_transfer("UPLOAD_FAILED", filename, "ClamAV scan failed or virus detected");
+        return false; // Exit if ClamAV detects a virus or fails to scan
     }
-    buffer[bytesReceived] = '\0';
-    cout << "Server: " << buffer;
 
-    if (strncmp(buffer, "150", 3) != 0) { // Check if server is ready to accept data
-        cout << "FTP server rejected STOR command. Aborting upload.\n";
-        closesocket(dataSock);
-        log_transfer("UPLOAD_FAILED", filename, "FTP server rejected STOR command");
-        return;
+    console() << "ClamAV scan successful. Proceeding with FTP upload.\n";
+    log_scan(filename, "CLEAN - Scanned " + to_string(scannedBytes) + " bytes");
+
+    // Step 2: Enter passive mode, open the data connection and send STOR
+    SOCKET dataSock = start_stor_transfer(session, filename, remoteName, phases);
+    if (dataSock == INVALID_SOCKET) {
+        return false;
     }
 
-    // Step 5: Open file and upload data to FTP server
-    FILE* fileToUpload = nullptr;
-    fopen_s(&fileToUpload, filename.c_str(), "rb");
+    // Step 3: Open file and upload data to FTP server
+    FILE* fileToUpload = open_transfer_file(filename, "rb");
     if (!fileToUpload) {
-        cout << "Failed to open local file for FTP upload: " << filename << endl;
+        console() << "Failed to open local file for FTP upload: " << filename << endl;
         closesocket(dataSock);
         log_transfer("UPLOAD_FAILED", filename, "Failed to open local file for FTP upload");
-        return;
+        return false;
     }
 
-    int uploadedBytes = 0;
-    while (!feof(fileToUpload)) {
-        size_t bytes = fread(fileBuffer, 1, sizeof(fileBuffer), fileToUpload);
-        if (bytes > 0) {
-            send(dataSock, fileBuffer, (int)bytes, 0);
-            uploadedBytes += bytes;
-        }
-    }
+    long long uploadedBytes = transfer_file_to_socket(fileToUpload, dataSock, transferBuffer);
+    long long dataMicros = phases.mark("transfer");
 
     fclose(fileToUpload);
     closesocket(dataSock);
 
-    // Step 6: Receive final FTP server response
-    memset(buffer, 0, sizeof(buffer)); // Clear buffer before receiving
-    bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
+    // Step 4: Receive final FTP server response
+    bool stored = finish_stor_transfer(session);
+    phases.mark("final_reply");
+    if (uploadedBytes >= 0) {
+        g_metrics.record_transfer("upload", uploadedBytes, dataMicros);
     }
-    else {
-        cout << "No final response from FTP server after file transfer.\n";
+
+    if (uploadedBytes < 0) {
+        console() << "Upload failed while sending data: " << filename << endl;
+        log_transfer("UPLOAD_FAILED", filename, "Error while reading or sending data");
+        return false;
+    }
+    if (!stored) {
+        console() << "FTP server did not confirm the upload: " << filename << endl;
+        log_transfer("UPLOAD_FAILED", filename, "FTP server did not confirm the upload");
+        return false;
     }
 
-    cout << "File uploaded successfully: " << filename << endl;
+    if (scannedBytes == fileSize) g_verdict_cache.store(filename, fileSize, fileTime, scannedHash, scannedVersion, verdict);
+    console() << "File uploaded successfully: " << filename << endl;
     log_transfer("UPLOAD_SUCCESS", filename, "Uploaded " + to_string(uploadedBytes) + " bytes");
+    return true;
 }
 
 //command "mput" : upload multiple files to server
-void ftp_mput(int controlSock, const std::vector<std::string>& filenames) {
+void ftp_mput(FtpSession& session, const std::vector<std::string>& filenames, int jobs = 1) {
     if (filenames.empty()) {
         cout << "No files specified for mput.\n";
         return;
     }
-    if (controlSock == INVALID_SOCKET) {
+    if (!session.is_open()) {
         cout << "Not connected to a server.\n";
         return;
     }
-    if (!g_passive_mode_preference) {
+    if (!session.passive) {
         cout << "Error: Client is not in passive mode. Active mode (PORT) is not supported for MPUT.\n";
         return;
     }
@@ -725,74 +3897,427 @@ void ftp_mput(int controlSock, const std::vector<std::string>& filenames) {
         }
     }
 
+    if (jobs > 1) {
+        ftp_mput_parallel(session, filenames, jobs);
+        return;
+    }
+
     cout << "Attempting to upload multiple files...\n";
     int successCount = 0;
     for (const string& filename : filenames) {
         cout << "\n--- Processing file: " << filename << " ---\n";
-        ftp_put(controlSock, filename);
+        if (ftp_put(session, filename)) successCount++;
+        cout << "--- Finished processing: " << filename << " ---\n";
+    }
+    cout << "\nAll specified files processed for upload.\n";
+    write_log("MPUT operation completed - " + to_string(successCount) + "/" + to_string(filenames.size()) + " files uploaded");
+}
+
+//command "mget" : download multiple files from server
+void ftp_mget(FtpSession& session, const std::vector<std::string>& filenames, int jobs = 1) {
+    if (filenames.empty()) {
+        cout << "No files specified for mget.\n";
+        return;
+    }
+    if (!session.is_open()) {
+        cout << "Not connected to a server.\n";
+        return;
+    }
+    if (!session.passive) {
+        cout << "Error: Client is not in passive mode. Active mode (PORT) is not supported for MGET.\n";
+        return;
+    }
+
+    write_log("MGET operation started - " + to_string(filenames.size()) + " files");
+
+    if (g_prompt_confirmation) {
+        cout << "You are about to download " << filenames.size() << " file(s):\n";
+        for (const string& filename : filenames) {
+            cout << "  - " << filename << "\n";
+        }
+        cout << "Do you want to proceed? (y/N): ";
+        string confirmation;
+        getline(cin, confirmation);
+
+        if (confirmation != "y" && confirmation != "Y") {
+            cout << "mget operation cancelled by user.\n";
+            write_log("MGET operation cancelled by user");
+            return;
+        }
+    }
+
+    if (jobs > 1) {
+        ftp_mget_parallel(session, filenames, jobs);
+        return;
+    }
+
+    cout << "Attempting to download multiple files...\n";
+    int successCount = 0;
+    for (const string& filename : filenames) {
+        cout << "\n--- Processing file: " << filename << " ---\n";
+        if (ftp_get(session, filename)) successCount++;
         cout << "--- Finished processing: " << filename << " ---\n";
-        successCount++;
     }
-    cout << "\nAll specified files processed for upload.\n";
-    write_log("MPUT operation completed - " + to_string(successCount) + "/" + to_string(filenames.size()) + " files processed");
-}
+    cout << "\nAll specified files processed for download.\n";
+    write_log("MGET operation completed - " + to_string(successCount) + "/" + to_string(filenames.size()) + " files downloaded");
+}
+
+// Outcome of one file handled by a worker pool
+struct TransferResult {
+    string filename;
+    bool ok = false;
+    string output; // Console output captured while the file was processed
+};
+
+// Run job(session, index) for every index in [0, jobCount) on up to `workers` pooled sessions
+// to main's server, all in `directory`. Each worker holds one session and keeps taking the next
+// index from a shared counter until none are left, then gives the session back to the pool
+void run_worker_pool(int workers, const FtpSession& main, const string& directory, size_t jobCount, const function<void(FtpSession&, size_t)>& job) {
+    atomic<size_t> nextJob{ 0 };
+    vector<thread> threads;
+    for (int w = 0; w < workers && static_cast<size_t>(w) < jobCount; w++) {
+        threads.emplace_back([&]() {
+            string error;
+            unique_ptr<FtpSession> session = g_session_pool.acquire(main, directory, error);
+            if (!session) {
+                write_log("Worker session failed - " + error);
+                return;
+            }
+            size_t index;
+            while ((index = nextJob++) < jobCount) {
+                job(*session, index);
+            }
+            g_session_pool.release(move(session));
+        });
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+}
+
+// Run a transfer for one file with its console output captured into the result
+void run_captured(TransferResult& result, const function<bool()>& transfer) {
+    ostringstream output;
+    ostream* previous = t_console;
+    t_console = &output;
+    result.ok = transfer();
+    t_console = previous;
+    result.output = output.str();
+}
+
+// Print the per-file outcome of a parallel batch after all workers finished
+int report_transfer_results(const vector<TransferResult>& results) {
+    int okCount = 0;
+    for (const TransferResult& result : results) {
+        if (result.ok) {
+            okCount++;
+            cout << "  OK      " << result.filename << "\n";
+            continue;
+        }
+        // Show the last message of the failed transfer as the reason
+        string reason = result.output.empty() ? "Not processed (no worker session available)" : result.output;
+        while (!reason.empty() && (reason.back() == '\n' || reason.back() == '\r')) reason.pop_back();
+        size_t lineStart = reason.find_last_of('\n');
+        if (lineStart != string::npos) reason = reason.substr(lineStart + 1);
+        if (reason.compare(0, 5, "LOG: ") == 0) reason = reason.substr(5);
+        cout << "  FAILED  " << result.filename << " - " << reason << "\n";
+    }
+    return okCount;
+}
+
+// Transfer files in parallel on `jobs` worker sessions that start in the main session's directory.
+// Every file is handled by transfer(session, filename); results are printed together at the end.
+// Returns the number of files transferred successfully
+int run_parallel_transfers(FtpSession& session, const vector<string>& filenames, int jobs,
+    const function<bool(FtpSession&, const string&)>& transfer, double& seconds) {
+    string directory = session.current_directory();
+    vector<TransferResult> results(filenames.size());
+    for (size_t i = 0; i < filenames.size(); i++) {
+        results[i].filename = filenames[i];
+    }
+
+    auto start = chrono::steady_clock::now();
+    run_worker_pool(jobs, session, directory, filenames.size(), [&](FtpSession& worker, size_t index) {
+        run_captured(results[index], [&]() { return transfer(worker, filenames[index]); });
+    });
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    return report_transfer_results(results);
+}
+
+// One connection of a parallel mget: downloads the next file of the batch until none are left
+// or the connection fails
+Task<bool> mget_worker(AsyncFtpSession& async, const vector<string>& filenames, size_t& next, vector<TransferResult>& results) {
+    while (next < filenames.size() && async.session().is_open()) {
+        size_t index = next++;
+        const string& filename = filenames[index];
+        TransferResult& result = results[index];
+        auto note = [&](const string& operation, const string& status) {
+            string logMessage = operation + " - File: " + filename + " - Status: " + status;
+            write_log(logMessage);
+            result.output += "LOG: " + logMessage + "\n";
+        };
+        note("DOWNLOAD_START", "Initiating download");
+
+        // The local file is created once the server sends data, so a failed RETR leaves nothing behind,
+        // and removed again if the transfer breaks off, so neither does a failed download
+        FILE* file = nullptr;
+        long long bytes = co_await async.retr(filename, [&](const char* data, size_t length) {
+            if (!file) file = open_transfer_file(filename, "wb");
+            return file && fwrite(data, 1, length, file) == length;
+        });
+        if (!file && bytes == 0) file = open_transfer_file(filename, "wb"); // Empty file
+        bool written = file != nullptr;
+        if (file) fclose(file);
+
+        result.ok = bytes >= 0 && written;
+        if (!result.ok && written) {
+            error_code ec;
+            fs::remove(filename, ec);
+        }
+        if (result.ok) {
+            note("DOWNLOAD_SUCCESS", "Downloaded " + to_string(bytes) + " bytes");
+        }
+        else {
+            note("DOWNLOAD_FAILED", bytes >= 0 ? "Failed to open local file for writing" : async.last_error());
+        }
+    }
+    co_return true;
+}
+
+// Download files in parallel over `jobs` pooled sessions, reporting all results at the end.
+// Sessions that still have to log in do so on short-lived threads; the transfers themselves are
+// coroutines on this thread's event loop
+void ftp_mget_parallel(FtpSession& session, const vector<string>& filenames, int jobs) {
+    cout << "Downloading " << filenames.size() << " files over " << jobs << " connections...\n";
+    string directory = session.current_directory();
+    vector<TransferResult> results(filenames.size());
+    for (size_t i = 0; i < filenames.size(); i++) {
+        results[i].filename = filenames[i];
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<unique_ptr<FtpSession>> sessions(min<size_t>(jobs, filenames.size()));
+    vector<thread> threads;
+    for (size_t w = 0; w < sessions.size(); w++) {
+        threads.emplace_back([&, w]() {
+            string error;
+            sessions[w] = g_session_pool.acquire(session, directory, error);
+            if (!sessions[w]) {
+                write_log("Worker session failed - " + error);
+            }
+        });
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+
+    IoEngine& engine = thread_io_engine();
+    size_t next = 0;
+    {
+        vector<unique_ptr<AsyncFtpSession>> connections;
+        vector<Task<bool>> workers;
+        for (auto& worker : sessions) {
+            if (!worker) continue;
+            connections.push_back(make_unique<AsyncFtpSession>(*worker, engine));
+            workers.push_back(mget_worker(*connections.back(), filenames, next, results));
+            workers.back().start();
+        }
+        engine.run();
+    }
+    for (auto& worker : sessions) {
+        if (worker && worker->is_open()) g_session_pool.release(move(worker));
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    int okCount = report_transfer_results(results);
+    cout << "\nDownloaded " << okCount << "/" << filenames.size() << " files in "
+        << fixed << setprecision(2) << seconds << " s" << defaultfloat << "\n";
+    write_log("MGET operation completed - " + to_string(okCount) + "/" + to_string(filenames.size()) + " files downloaded over " + to_string(jobs) + " connections");
+}
+
+// Scan and upload files in parallel: every worker has its own FTP session and opens its own
+// ClamAV Agent connections, so scans and uploads of different files overlap
+void ftp_mput_parallel(FtpSession& session, const vector<string>& filenames, int jobs) {
+    cout << "Scanning and uploading " << filenames.size() << " files over " << jobs << " connections...\n";
+    double seconds = 0;
+    int okCount = run_parallel_transfers(session, filenames, jobs,
+        [](FtpSession& worker, const string& filename) { return ftp_put(worker, filename); }, seconds);
+    cout << "\nUploaded " << okCount << "/" << filenames.size() << " files in "
+        << fixed << setprecision(2) << seconds << " s" << defaultfloat << "\n";
+    write_log("MPUT operation completed - " + to_string(okCount) + "/" + to_string(filenames.size()) + " files uploaded over " + to_string(jobs) + " connections");
+}
+
+// Byte range of a file downloaded by one pget connection
+struct Segment {
+    long long offset = 0;
+    long long length = 0;
+    bool ok = false;
+    string error;
+};
+
+// Download one byte range with REST + RETR on its own session and write it at its offset in the local file
+void download_segment(const FtpSession& main, const string& directory, const string& filename, Segment& segment) {
+    unique_ptr<FtpSession> session = g_session_pool.acquire(main, directory, segment.error);
+    if (!session) return;
+
+    SOCKET dataSock = open_data_connection(*session, segment.error);
+    if (dataSock == INVALID_SOCKET) {
+        session->quit();
+        return;
+    }
+
+    string reply = session->exchange("REST " + to_string(segment.offset) + "\r\n");
+    if (reply.compare(0, 3, "350") != 0) {
+        segment.error = "REST rejected: " + reply;
+        closesocket(dataSock);
+        session->quit();
+        return;
+    }
+
+    reply = session->exchange("RETR " + filename + "\r\n");
+    if (reply.compare(0, 3, "150") != 0 && reply.compare(0, 3, "125") != 0) {
+        segment.error = "RETR rejected: " + reply;
+        closesocket(dataSock);
+        session->quit();
+        return;
+    }
+
+    FILE* file = open_transfer_file(filename, "r+b");
+    if (!file || _fseeki64(file, segment.offset, SEEK_SET) != 0) {
+        segment.error = "Could not open local file at offset " + to_string(segment.offset);
+        if (file) fclose(file);
+        closesocket(dataSock);
+        session->quit();
+        return;
+    }
+
+    TransferBuffer transferBuffer(g_transfer_buffer_size);
+    long long received = transfer_socket_to_file(dataSock, file, transferBuffer, segment.length);
+    fclose(file);
+
+    // Closing the data connection early ends the RETR; read its 426/226 so the session can be reused
+    closesocket(dataSock);
+    if (session->exchange("").empty()) {
+        session->close();
+    }
+    g_session_pool.release(move(session));
+
+    if (received != segment.length) {
+        segment.error = "Received " + to_string(received) + " of " + to_string(segment.length) + " bytes";
+        return;
+    }
+    segment.ok = true;
+}
+
+// command "pget" : download a single file over several connections, one byte range per connection
+void ftp_pget(FtpSession& session, const string& filename, int connections) {
+    if (!session.is_open()) {
+        cout << "Not connected to a server.\n";
+        return;
+    }
+    if (!session.passive) {
+        cout << "Error: Client is not in passive mode. Active mode (PORT) is not supported for PGET.\n";
+        return;
+    }
+    if (!session.binary) {
+        cout << "Segmented download requires binary mode. Falling back to a single connection.\n";
+        ftp_get(session, filename);
+        return;
+    }
+
+    string sizeCmd = "SIZE " + filename + "\r\n";
+    FtpReply reply;
+    long long fileSize = -1;
+    if (session.command(sizeCmd, reply)) {
+        cout << "Server: " << reply.text;
+        if (reply.is(213)) {
+            fileSize = atoll(string(reply.text.substr(4)).c_str());
+        }
+    }
+    if (fileSize < 0) {
+        cout << "File size unknown. Falling back to a single connection.\n";
+        ftp_get(session, filename);
+        return;
+    }
 
-//command "mget" : download multiple files from server
-void ftp_mget(int controlSock, const std::vector<std::string>& filenames) {
-    if (filenames.empty()) {
-        cout << "No files specified for mget.\n";
+    // Small files are not worth the extra logins
+    long long maxConnections = max<long long>(1, fileSize / MIN_SEGMENT_SIZE);
+    connections = static_cast<int>(min<long long>(connections, maxConnections));
+    if (connections <= 1) {
+        ftp_get(session, filename);
         return;
     }
-    if (controlSock == INVALID_SOCKET) {
-        cout << "Not connected to a server.\n";
+
+    log_transfer("DOWNLOAD_START", filename, "Initiating segmented download over " + to_string(connections) + " connections");
+
+    // Preallocate the local file so every segment can be written at its offset
+    FILE* file = open_transfer_file(filename, "wb");
+    if (!file) {
+        cout << "Failed to open local file for writing.\n";
+        log_transfer("DOWNLOAD_FAILED", filename, "Failed to open local file for writing");
         return;
     }
-    if (!g_passive_mode_preference) {
-        cout << "Error: Client is not in passive mode. Active mode (PORT) is not supported for MGET.\n";
+    fclose(file);
+    try {
+        fs::resize_file(filename, static_cast<uintmax_t>(fileSize));
+    }
+    catch (const fs::filesystem_error& e) {
+        cout << "Failed to preallocate local file: " << e.what() << endl;
+        log_transfer("DOWNLOAD_FAILED", filename, "Failed to preallocate local file");
         return;
     }
 
-    write_log("MGET operation started - " + to_string(filenames.size()) + " files");
+    vector<Segment> segments(connections);
+    long long segmentSize = fileSize / connections;
+    for (int i = 0; i < connections; i++) {
+        segments[i].offset = i * segmentSize;
+        segments[i].length = (i == connections - 1) ? fileSize - segments[i].offset : segmentSize;
+    }
 
-    if (g_prompt_confirmation) {
-        cout << "You are about to download " << filenames.size() << " file(s):\n";
-        for (const string& filename : filenames) {
-            cout << "  - " << filename << "\n";
-        }
-        cout << "Do you want to proceed? (y/N): ";
-        string confirmation;
-        getline(cin, confirmation);
+    string directory = session.current_directory();
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (Segment& segment : segments) {
+        workers.emplace_back([&session, &directory, &filename, &segment]() { download_segment(session, directory, filename, segment); });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-        if (confirmation != "y" && confirmation != "Y") {
-            cout << "mget operation cancelled by user.\n";
-            write_log("MGET operation cancelled by user");
-            return;
+    int failed = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (!segments[i].ok) {
+            cout << "Segment " << i + 1 << " failed: " << segments[i].error << endl;
+            failed++;
         }
     }
-
-    cout << "Attempting to download multiple files...\n";
-    int successCount = 0;
-    for (const string& filename : filenames) {
-        cout << "\n--- Processing file: " << filename << " ---\n";
-        ftp_get(controlSock, filename);
-        cout << "--- Finished processing: " << filename << " ---\n";
-        successCount++;
+    if (failed > 0) {
+        error_code ec;
+        fs::remove(filename, ec);
+        cout << "Segmented download failed: " << filename << endl;
+        log_transfer("DOWNLOAD_FAILED", filename, to_string(failed) + " of " + to_string(connections) + " segments failed");
+        return;
     }
-    cout << "\nAll specified files processed for download.\n";
-    write_log("MGET operation completed - " + to_string(successCount) + "/" + to_string(filenames.size()) + " files processed");
+
+    double mbPerSecond = seconds > 0 ? fileSize / seconds / (1024 * 1024) : 0;
+    cout << "File downloaded successfully: " << filename << " (" << fileSize << " bytes, "
+        << fixed << setprecision(1) << mbPerSecond << " MB/s)" << defaultfloat << endl;
+    log_transfer("DOWNLOAD_SUCCESS", filename, "Downloaded " + to_string(fileSize) + " bytes over " + to_string(connections) + " connections");
 }
 
 // open command: connect to an FTP server
 void ftp_open(const string& ip, unsigned short port = 21) {
-    if (g_control_sockfd != INVALID_SOCKET) {
+    if (g_session.is_open()) {
         cout << "Already connected. Please 'close' current connection first.\n";
         return;
     }
 
     write_log("Attempting to connect to FTP server: " + ip + ":" + to_string(port));
 
-    g_control_sockfd = connectToServer(ip.c_str(), port);
-    if (g_control_sockfd == INVALID_SOCKET) {
+    string greeting = g_session.connect(ip, port);
+    if (!g_session.is_open()) {
         cerr << "Failed to connect to FTP server.\n";
         write_log("Failed to connect to FTP server: " + ip + ":" + to_string(port));
         return;
@@ -801,35 +4326,41 @@ void ftp_open(const string& ip, unsigned short port = 21) {
     cout << "Connected to FTP server at " << ip << ":" << port << ".\n";
     write_log("Successfully connected to FTP server: " + ip + ":" + to_string(port));
 
-    char buffer[1024] = { 0 };
-    int bytesReceived = recv(g_control_sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        cout << "Server: " << buffer;
+    if (!greeting.empty()) {
+        cout << "Server: " << greeting;
+    }
+
+    // Send default login commands, the initial transfer mode and FEAT in one pipelined batch
+    PhaseClock phases(g_username);
+    vector<PipelinedReply> replies = g_session.pipeline({
+        "USER " + g_username + "\r\n",
+        "PASS " + g_password + "\r\n",
+        g_session.binary ? "TYPE I\r\n" : "TYPE A\r\n",
+        "FEAT\r\n" });
+    phases.mark("login");
+    for (size_t i = 0; i < 3; i++) {
+        if (!replies[i].text.empty()) {
+            cout << "Server: " << replies[i].text;
+        }
     }
-
-    // Send default login commands
-    sendCommand(g_control_sockfd, "USER user\r\n");
-    sendCommand(g_control_sockfd, "PASS 14022006\r\n");
     write_log("Login completed with default credentials");
+    write_log(g_session.binary ? "Transfer mode set to BINARY" : "Transfer mode set to ASCII");
 
-    // Set initial transfer mode on server
-    if (g_is_binary_mode) {
-        sendCommand(g_control_sockfd, "TYPE I\r\n");
-        write_log("Transfer mode set to BINARY");
-    }
-    else {
-        sendCommand(g_control_sockfd, "TYPE A\r\n");
-        write_log("Transfer mode set to ASCII");
+    // Remember which extensions the server supports
+    if (replies[3].code == 211) {
+        g_session.parse_features(replies[3].text);
     }
+    write_log("Server features: " + to_string(g_session.features.size()) + " announced");
 }
 
 // close command: disconnect from the FTP server
 void ftp_close() {
-    if (g_control_sockfd != INVALID_SOCKET) {
-        sendCommand(g_control_sockfd, "QUIT\r\n");
-        closesocket(g_control_sockfd);
-        g_control_sockfd = INVALID_SOCKET;
+    if (g_session.is_open()) {
+        g_session_pool.clear();
+        g_listing_cache.clear();
+        g_known_remote_dirs.clear();
+        sendCommand(g_session, "QUIT\r\n");
+        g_session.close();
         cout << "Disconnected from FTP server.\n";
         write_log("Disconnected from FTP server");
     }
@@ -840,26 +4371,26 @@ void ftp_close() {
 
 // ascii command: set file transfer mode to ASCII
 void ftp_ascii() {
-    if (g_control_sockfd == INVALID_SOCKET) {
+    if (!g_session.is_open()) {
         cout << "Not connected to a server.\n";
         return;
     }
 
-    g_is_binary_mode = false;
-    sendCommand(g_control_sockfd, "TYPE A\r\n");
+    g_session.binary = false;
+    sendCommand(g_session, "TYPE A\r\n");
     cout << "Transfer mode set to ASCII.\n";
     write_log("Transfer mode changed to ASCII");
 }
 
 // binary command: set file transfer mode to binary
 void ftp_binary() {
-    if (g_control_sockfd == INVALID_SOCKET) {
+    if (!g_session.is_open()) {
         cout << "Not connected to a server.\n";
         return;
     }
 
-    g_is_binary_mode = true;
-    sendCommand(g_control_sockfd, "TYPE I\r\n");
+    g_session.binary = true;
+    sendCommand(g_session, "TYPE I\r\n");
     cout << "Transfer mode set to binary.\n";
     write_log("Transfer mode changed to binary");
 }
@@ -868,35 +4399,244 @@ void ftp_binary() {
 void ftp_status() {
     cout << "\n=== FTP Client Status ===" << endl;
 
-    if (g_control_sockfd != INVALID_SOCKET) {
+    if (g_session.is_open()) {
         cout << "Connection: Connected to FTP server" << endl;
     }
     else {
         cout << "Connection: Not connected" << endl;
     }
 
-    cout << "Transfer mode: " << (g_is_binary_mode ? "Binary (TYPE I)" : "ASCII (TYPE A)") << endl;
-    cout << "Passive mode: " << (g_passive_mode_preference ? "Enabled (PASV)" : "Disabled (PORT - Not supported)") << endl;
+    cout << "Transfer mode: " << (g_session.binary ? "Binary (TYPE I)" : "ASCII (TYPE A)") << endl;
+    cout << "Passive mode: " << (g_session.passive ? "Enabled (PASV)" : "Disabled (PORT - Not supported)") << endl;
     cout << "Prompt confirmation: " << (g_prompt_confirmation ? "Enabled" : "Disabled") << endl;
+    cout << "Transfer buffer: " << g_transfer_buffer_size << " bytes" << endl;
+    cout << "Pipelined upload: " << (!g_pipelined_upload ? "Disabled" : g_hidden_upload ? "Enabled (scan and upload in one pass, hidden name until clean)"
+        : "Enabled (scan and upload in one pass)") << endl;
+    cout << "Scanner: " << g_scanner.describe() << endl;
+    if (g_scan_cache_filename.empty()) {
+        cout << "Scan cache: Off" << endl;
+    }
+    else {
+        cout << "Scan cache: " << g_scan_cache_filename << ", " << g_verdict_cache.size() << " verdicts" << endl;
+    }
+    cout << "Idle pooled sessions: " << g_session_pool.idle_count() << endl;
+    cout << "Listing cache: " << g_listing_cache.size() << " listings, TTL " << g_listing_cache_ttl << " s" << endl;
+    cout << "Socket timeout: " << g_socket_timeout << " s" << endl;
     cout << "Log file: " << g_log_filename << endl;
+    cout << "Trace: " << (g_tracer.enabled() ? g_trace_filename : "Off") << endl;
     cout << "=========================" << endl;
 
-    write_log("Status command executed - Mode: " + string(g_is_binary_mode ? "Binary" : "ASCII") +
-        ", Passive: " + string(g_passive_mode_preference ? "On" : "Off") +
-        ", Connected: " + string(g_control_sockfd != INVALID_SOCKET ? "Yes" : "No"));
+    write_log("Status command executed - Mode: " + string(g_session.binary ? "Binary" : "ASCII") +
+        ", Passive: " + string(g_session.passive ? "On" : "Off") +
+        ", Connected: " + string(g_session.is_open() ? "Yes" : "No"));
 }
 
 // passive command: toggle passive mode preference
 void ftp_passive_toggle() {
-    g_passive_mode_preference = !g_passive_mode_preference;
-    cout << "Passive mode " << (g_passive_mode_preference ? "enabled" : "disabled") << endl;
+    g_session.passive = !g_session.passive;
+    cout << "Passive mode " << (g_session.passive ? "enabled" : "disabled") << endl;
 
-    if (!g_passive_mode_preference) {
+    if (!g_session.passive) {
         cout << "Warning: Active mode (PORT) is not supported by this client." << endl;
         cout << "Some operations may fail. Consider enabling passive mode." << endl;
     }
 
-    write_log("Passive mode toggled - Now " + string(g_passive_mode_preference ? "enabled" : "disabled"));
+    write_log("Passive mode toggled - Now " + string(g_session.passive ? "enabled" : "disabled"));
+}
+
+// pool command: show, warm up or clear the pool of extra sessions used by parallel transfers
+void ftp_pool(const string& action, int count) {
+    if (action == "warm") {
+        if (!g_session.is_open()) {
+            cout << "Not connected to a server.\n";
+            return;
+        }
+        if (count < 1 || count > MAX_PARALLEL_CONNECTIONS) {
+            cout << "Usage: pool warm <N> (1 <= N <= " << MAX_PARALLEL_CONNECTIONS << ")" << endl;
+            return;
+        }
+        g_session_pool.warm(g_session, count);
+        write_log("Session pool warmed - " + to_string(g_session_pool.idle_count()) + " idle sessions");
+    }
+    else if (action == "clear") {
+        g_session_pool.clear();
+        write_log("Session pool cleared");
+    }
+    else if (!action.empty()) {
+        cout << "Usage: pool [warm <N> | clear]" << endl;
+        return;
+    }
+    cout << "Idle pooled sessions: " << g_session_pool.idle_count() << endl;
+}
+
+// stats command: show the latency and throughput metrics, dump them as JSON or clear them
+void ftp_stats(const string& action, const string& filename) {
+    if (action.empty()) {
+        cout << "\n=== Transfer Statistics ===" << endl;
+        g_metrics.print(cout);
+        cout << "===========================" << endl;
+    }
+    else if (action == "json") {
+        string json = g_metrics.json();
+        if (filename.empty()) {
+            cout << json << endl;
+            return;
+        }
+        ofstream out(filename);
+        if (!(out << json << "\n")) {
+            cout << "Could not write statistics to " << filename << endl;
+            write_log("STATS failed - Could not write: " + filename);
+            return;
+        }
+        cout << "Statistics written to " << filename << endl;
+        write_log("Statistics written to " + filename);
+    }
+    else if (action == "reset") {
+        g_metrics.reset();
+        cout << "Statistics cleared" << endl;
+        write_log("Statistics cleared");
+    }
+    else {
+        cout << "Usage: stats [json [file] | reset]" << endl;
+    }
+}
+
+// trace command: record transfer phases to a Chrome trace-event file ("on [file]"), or stop ("off")
+void ftp_trace(const string& action, const string& filename) {
+    if (action == "on") {
+        string path = filename.empty() ? "ftp_trace.json" : filename;
+        if (!g_tracer.start(path)) {
+            cout << "Could not create trace file " << path << endl;
+            write_log("TRACE failed - Could not create: " + path);
+            return;
+        }
+        g_trace_filename = path;
+        cout << "Tracing transfer phases to " << path << " (open it in chrome://tracing or Perfetto)" << endl;
+        write_log("Trace started: " + path);
+    }
+    else if (action == "off") {
+        if (!g_tracer.enabled()) {
+            cout << "Tracing is not on." << endl;
+            return;
+        }
+        g_tracer.stop();
+        cout << "Trace written to " << g_trace_filename << endl;
+        write_log("Trace written: " + g_trace_filename);
+        g_trace_filename.clear();
+    }
+    else {
+        cout << "Usage: trace on [file] | trace off" << endl;
+    }
+}
+
+// scanner command: show the scanner, or scan uploads with the ClamAV Agent ("agent") or directly
+// with clamd ("clamd <ip>:<port>" or "clamd unix:<socket path>")
+void ftp_scanner(const string& kind, const string& target) {
+    if (kind.empty()) {
+        cout << "Scanner: " << g_scanner.describe() << endl;
+    }
+    else if (kind == "agent" && target.empty()) {
+        g_scanner.use_agent();
+        cout << "Scanning uploads with the ClamAV Agent on 127.0.0.1:9000" << endl;
+        write_log("Scanner set to the ClamAV Agent");
+    }
+    else if (kind == "clamd" && g_scanner.use_clamd(target)) {
+        cout << "Scanning uploads with clamd at " << target << " (zINSTREAM)" << endl;
+        if (g_scanner.clamd_version().empty()) {
+            cout << "Warning: clamd at " << target << " did not answer VERSION; scan verdicts are not cached until it does" << endl;
+        }
+        write_log("Scanner set to clamd at " + target);
+    }
+    else {
+        cout << "Usage: scanner [agent | clamd <ip>:<port> | clamd unix:<socket path>]" << endl;
+        write_log("SCANNER failed - Invalid arguments: " + kind + " " + target);
+    }
+}
+
+// set command: change a client option
+void ftp_set(const string& option, const string& value) {
+    if (option == "bufsize") {
+        size_t size = 0;
+        if (!parse_size(value, size) || size < MIN_TRANSFER_BUFFER_SIZE || size > MAX_TRANSFER_BUFFER_SIZE) {
+            cout << "Usage: set bufsize <bytes>[K|M] (between " << MIN_TRANSFER_BUFFER_SIZE / 1024 << "K and "
+                << MAX_TRANSFER_BUFFER_SIZE / (1024 * 1024) << "M)" << endl;
+            write_log("SET bufsize failed - Invalid value: " + value);
+            return;
+        }
+        // Round up to the buffer alignment so the buffer is a whole number of pages
+        size = (size + TRANSFER_BUFFER_ALIGNMENT - 1) / TRANSFER_BUFFER_ALIGNMENT * TRANSFER_BUFFER_ALIGNMENT;
+        g_transfer_buffer_size = size;
+        cout << "Transfer buffer size set to " << g_transfer_buffer_size << " bytes" << endl;
+        write_log("Transfer buffer size set to " + to_string(g_transfer_buffer_size) + " bytes");
+    }
+    else if (option == "pipeline") {
+        if (value != "on" && value != "off" && value != "hidden") {
+            cout << "Usage: set pipeline on|off|hidden" << endl;
+            write_log("SET pipeline failed - Invalid value: " + value);
+            return;
+        }
+        g_pipelined_upload = (value != "off");
+        g_hidden_upload = (value == "hidden");
+        string state = !g_pipelined_upload ? "disabled" : g_hidden_upload ? "enabled, uploading to a hidden name until the scan is clean" : "enabled";
+        cout << "Pipelined upload " << state << endl;
+        write_log("Pipelined upload " + state);
+    }
+    else if (option == "cachettl") {
+        char* end = nullptr;
+        long seconds = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0' || seconds < 0) {
+            cout << "Usage: set cachettl <seconds> (0 disables the listing cache)" << endl;
+            write_log("SET cachettl failed - Invalid value: " + value);
+            return;
+        }
+        g_listing_cache_ttl = static_cast<int>(min<long>(seconds, INT_MAX));
+        if (g_listing_cache_ttl == 0) g_listing_cache.clear();
+        cout << "Listing cache TTL set to " << g_listing_cache_ttl << " s" << endl;
+        write_log("Listing cache TTL set to " + to_string(g_listing_cache_ttl) + " s");
+    }
+    else if (option == "timeout") {
+        char* end = nullptr;
+        long seconds = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0' || seconds < 1 || seconds > INT_MAX / 1000) {
+            cout << "Usage: set timeout <seconds> (at least 1)" << endl;
+            write_log("SET timeout failed - Invalid value: " + value);
+            return;
+        }
+        g_socket_timeout = static_cast<int>(seconds);
+        cout << "Socket timeout set to " << g_socket_timeout << " s" << endl;
+        write_log("Socket timeout set to " + to_string(g_socket_timeout) + " s");
+    }
+    else if (option == "scancache") {
+        if (value.empty()) {
+            cout << "Usage: set scancache <file>|off" << endl;
+            return;
+        }
+        g_scan_cache_filename = (value == "off") ? "" : value;
+        g_verdict_cache.open(g_scan_cache_filename);
+        cout << (g_scan_cache_filename.empty() ? "Scan verdict cache disabled" : "Scan verdict cache: " + g_scan_cache_filename) << endl;
+        write_log(g_scan_cache_filename.empty() ? "Scan verdict cache disabled" : "Scan verdict cache set to " + g_scan_cache_filename);
+    }
+    else if (option == "logfile") {
+        if (value.empty()) {
+            cout << "Usage: set logfile <path>" << endl;
+            return;
+        }
+        // Queued messages go to the old file before it is closed
+        write_log("Log file changed to " + value);
+        if (!g_logger.start(value)) {
+            cout << "Could not open log file: " << value << ", keeping " << g_log_filename << endl;
+            g_logger.start(g_log_filename);
+            write_log("SET logfile failed - Could not open: " + value);
+            return;
+        }
+        g_log_filename = value;
+        cout << "Logging to " << g_log_filename << endl;
+        write_log("Log file opened");
+    }
+    else {
+        cout << "Usage: set bufsize <bytes>[K|M] | set pipeline on|off|hidden | set cachettl <seconds> | set timeout <seconds> | set logfile <path> | set scancache <file>|off" << endl;
+        write_log("SET failed - Unknown option: " + option);
+    }
 }
 
 // get all local files in a directory
@@ -927,84 +4667,252 @@ vector<string> get_local_files(const string& directory, bool recursive = true) {
     return files;
 }
 
-// create a remote directory recursively
-bool create_remote_directory_recursive(int controlSock, const std::string& path) {
-    if (controlSock == INVALID_SOCKET) return false;
-
-    std::string current_path = "/";
-    std::istringstream iss(path);
-    std::string segment;
-
-    while (std::getline(iss, segment, '/')) {
-        if (segment.empty()) continue;
-
-        if (current_path != "/") current_path += "/";
-        current_path += segment;
+// Make sure every directory in `directories` (absolute remote paths) and all of its parents exist.
+// Directories not known to exist yet are created shallowest first in one pipelined batch of MKD
+// commands. A refused MKD usually means the directory exists; a second batch of CWD commands checks
+// that before it is remembered. Returns false if a directory could not be created
+bool ensure_remote_directories(FtpSession& session, const vector<string>& directories) {
+    // Every missing directory and its parents, ordered by depth so each MKD follows its parent's
+    set<pair<size_t, string>> missing;
+    for (const string& directory : directories) {
+        for (string path = directory; path != "/" && !path.empty(); path = remote_parent(path)) {
+            if (g_known_remote_dirs.contains(path)) break;
+            missing.insert({ static_cast<size_t>(count(path.begin(), path.end(), '/')), path });
+        }
+    }
+    if (missing.empty()) return true;
 
-        // Try to create directory (may already exist)
-        std::string cmd = "MKD " + current_path + "\r\n";
-        send(controlSock, cmd.c_str(), (int)cmd.length(), 0);
+    vector<string> paths;
+    vector<string> commands;
+    for (const auto& [depth, path] : missing) {
+        paths.push_back(path);
+        commands.push_back("MKD " + path + "\r\n");
+    }
 
-        char buffer[1024] = { 0 };
-        int bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-        if (bytesReceived > 0) {
-            buffer[bytesReceived] = '\0';
-            // Log success or failure, but continue even if directory exists
-            if (strncmp(buffer, "257", 3) == 0) {
-                write_log("MKDIR succeeded for: " + current_path);
-            }
-            else {
-                write_log("MKDIR response for " + current_path + ": " + string(buffer));
-            }
+    vector<PipelinedReply> replies = session.pipeline(commands);
+    bool ok = true;
+    vector<string> refused;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (replies[i].code == 257) {
+            g_listing_cache.invalidate(remote_parent(paths[i]));
+            write_log("MKDIR succeeded for: " + paths[i]);
+            g_known_remote_dirs.add(paths[i]);
+        }
+        else if (replies[i].code / 100 == 5) {
+            // Most servers answer 550 for an existing directory, but also for one they will not create
+            write_log("MKDIR response for " + paths[i] + ": " + replies[i].text);
+            refused.push_back(paths[i]);
+        }
+        else {
+            write_log("MKDIR failed for " + paths[i] + ": " + (replies[i].text.empty() ? "No response" : replies[i].text));
+            ok = false;
         }
     }
+    if (refused.empty()) return ok;
+
+    // CWD into each refused directory, then back to where the session was
+    string current = session.current_directory();
+    if (current.empty()) return ok; // Cannot come back: leave them unconfirmed, a missing one fails at STOR
+    commands.clear();
+    for (const string& path : refused) commands.push_back("CWD " + path + "\r\n");
+    commands.push_back("CWD " + current + "\r\n");
+    replies = session.pipeline(commands);
+    for (size_t i = 0; i < refused.size(); i++) {
+        if (replies[i].code / 100 == 2) {
+            g_known_remote_dirs.add(refused[i]);
+        }
+        else {
+            write_log("MKDIR failed for " + refused[i] + ": directory does not exist");
+            ok = false;
+        }
+    }
+    if (replies.back().code / 100 != 2) {
+        write_log("Could not return to " + current + " after checking directories");
+        session.cwd.clear(); // Asked again with PWD
+    }
+    return ok;
+}
 
-    return true;
+// create a remote directory recursively (relative paths start at the session's working directory)
+bool create_remote_directory_recursive(FtpSession& session, const std::string& path) {
+    if (!session.is_open()) return false;
+
+    std::string absolute = resolve_remote_path(session, path);
+    if (absolute.empty()) return false;
+    return ensure_remote_directories(session, { absolute });
 }
 
-// Helper function to parse LIST response
+// One entry of a remote directory listing
 struct DirEntry {
     string name;
-    bool is_directory;
+    bool is_directory = false;
+    long long size = -1; // Bytes, -1 if the listing did not say
+    time_t modified = 0; // Last modification (UTC), 0 if unknown
+    string permissions; // MLSD "perm" fact (e.g. "adfrw") or the LIST mode string (e.g. "-rw-r--r--")
 };
 
+// Parse an MLSD/MLST time value "YYYYMMDDHHMMSS[.sss]" (always UTC)
+time_t parse_mlsd_time(const string& value) {
+    struct tm timeinfo = {};
+    if (value.length() < 14 || sscanf_s(value.c_str(), "%4d%2d%2d%2d%2d%2d", &timeinfo.tm_year, &timeinfo.tm_mon,
+        &timeinfo.tm_mday, &timeinfo.tm_hour, &timeinfo.tm_min, &timeinfo.tm_sec) != 6) {
+        return 0;
+    }
+    timeinfo.tm_year -= 1900;
+    timeinfo.tm_mon -= 1;
+    return _mkgmtime(&timeinfo);
+}
+
+// Parse one MLSD line or MLST entry: "type=file;size=1234;modify=20240101120000;perm=adfrw; name".
+// The name is everything after the first space, so it may contain spaces itself.
+// Returns false for lines without facts and for the "." / ".." entries (type=cdir/pdir)
+bool parse_mlsd_entry(const string& line, DirEntry& entry) {
+    size_t space = line.find(' ');
+    if (space == string::npos || space + 1 >= line.length()) return false;
+
+    entry = DirEntry();
+    entry.name = line.substr(space + 1);
+    istringstream facts(line.substr(0, space));
+    string fact;
+    while (getline(facts, fact, ';')) {
+        size_t equals = fact.find('=');
+        if (equals == string::npos) continue;
+        string key = fact.substr(0, equals);
+        string value = fact.substr(equals + 1);
+        transform(key.begin(), key.end(), key.begin(), ::tolower);
+        if (key == "type") {
+            transform(value.begin(), value.end(), value.begin(), ::tolower);
+            if (value == "cdir" || value == "pdir") return false;
+            entry.is_directory = (value == "dir");
+        }
+        else if (key == "size" || key == "sizd") {
+            entry.size = atoll(value.c_str());
+        }
+        else if (key == "modify") {
+            entry.modified = parse_mlsd_time(value);
+        }
+        else if (key == "perm" || (key == "unix.mode" && entry.permissions.empty())) {
+            entry.permissions = value;
+        }
+    }
+    return entry.name != "." && entry.name != "..";
+}
+
+// Parse an MLSD data connection listing
+vector<DirEntry> parse_mlsd_response(const string& list_data) {
+    vector<DirEntry> entries;
+    istringstream iss(list_data);
+    string line;
+    while (getline(iss, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        DirEntry entry;
+        if (parse_mlsd_entry(line, entry)) {
+            entries.push_back(entry);
+        }
+    }
+    return entries;
+}
+
+// Parse the date columns of a Unix LIST line: "Oct 10 12:00" (within the last year) or "Oct 10 2023"
+time_t parse_list_time(const string& month, const string& day, const string& timeOrYear) {
+    static const string months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    size_t monthIndex = months.find(month);
+    if (month.length() != 3 || monthIndex == string::npos || monthIndex % 3 != 0) return 0;
+
+    struct tm timeinfo = {};
+    timeinfo.tm_mon = static_cast<int>(monthIndex / 3);
+    timeinfo.tm_mday = atoi(day.c_str());
+    if (timeOrYear.find(':') != string::npos) {
+        time_t now = time(0);
+        struct tm today;
+        localtime_s(&today, &now);
+        timeinfo.tm_year = today.tm_year;
+        if (sscanf_s(timeOrYear.c_str(), "%d:%d", &timeinfo.tm_hour, &timeinfo.tm_min) != 2) return 0;
+        // A date later than today belongs to the previous year
+        if (timeinfo.tm_mon > today.tm_mon || (timeinfo.tm_mon == today.tm_mon && timeinfo.tm_mday > today.tm_mday)) {
+            timeinfo.tm_year--;
+        }
+    }
+    else {
+        timeinfo.tm_year = atoi(timeOrYear.c_str()) - 1900;
+    }
+    return _mkgmtime(&timeinfo);
+}
+
+// Parse a LIST response, used when the server does not support MLSD
 vector<DirEntry> parse_list_response(const string& list_data) {
     vector<DirEntry> entries;
     istringstream iss(list_data);
     string line;
 
     while (getline(iss, line)) {
-        // Simple parsing assuming Unix-style LIST output (e.g., ls -l format)
-        // Example: drwxr-xr-x 2 user group 4096 Oct 10 12:00 dirname
-        //         -rw-r--r-- 1 user group 1234 Oct 10 12:00 filename
-        if (line.empty()) continue;
+        // Unix-style LIST output (ls -l format):
+        //         drwxr-xr-x 2 user group 4096 Oct 10 12:00 dirname
+        //         -rw-r--r-- 1 user group 1234 Oct 10  2023 file name with spaces
+        // and DOS-style output from IIS:
+        //         10-10-23  12:00PM       <DIR>          dirname
+        //         10-10-23  12:00PM                 1234 filename
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line.compare(0, 5, "total") == 0) continue;
 
         DirEntry entry;
-        entry.is_directory = (line[0] == 'd');
-
-        // Find the name (last field after spaces)
-        size_t pos = line.rfind(' ');
-        if (pos != string::npos) {
-            entry.name = line.substr(pos + 1);
-            // Skip "." and ".." entries
-            if (entry.name != "." && entry.name != "..") {
-                entries.push_back(entry);
-            }
+        istringstream fields(line);
+        if (isdigit(static_cast<unsigned char>(line[0]))) {
+            string date, clock, sizeOrDir;
+            fields >> date >> clock >> sizeOrDir;
+            entry.is_directory = (sizeOrDir == "<DIR>");
+            if (!entry.is_directory) entry.size = atoll(sizeOrDir.c_str());
+        }
+        else {
+            // The name starts after the 8th field; everything after it belongs to the name
+            string links, owner, group, size, month, day, timeOrYear;
+            fields >> entry.permissions >> links >> owner >> group >> size >> month >> day >> timeOrYear;
+            entry.is_directory = (!entry.permissions.empty() && entry.permissions[0] == 'd');
+            entry.size = entry.is_directory ? -1 : atoll(size.c_str());
+            entry.modified = parse_list_time(month, day, timeOrYear);
+        }
+        if (!fields) continue;
+
+        // Unix listings put one space before the name, DOS listings pad the size column
+        if (entry.permissions.empty()) fields >> ws;
+        else fields.get();
+        getline(fields, entry.name);
+        if (!entry.permissions.empty() && entry.permissions[0] == 'l') {
+            // Symbolic link: "name -> target"
+            size_t arrow = entry.name.find(" -> ");
+            if (arrow != string::npos) entry.name.erase(arrow);
+        }
+        // Skip "." and ".." entries
+        if (!entry.name.empty() && entry.name != "." && entry.name != "..") {
+            entries.push_back(entry);
         }
     }
 
     return entries;
 }
 
+// Listing of `path` ("" for the current directory) without console output, from the listing cache
+// when it is fresh. Uses MLSD when the server announced it in FEAT, LIST otherwise
+bool list_directory(FtpSession& session, const string& path, vector<DirEntry>& entries, string& error, bool refresh = false) {
+    TraceSpan span("list", path);
+    bool useMlsd = session.has_feature("MLSD") || session.has_feature("MLST");
+    string list_data;
+    if (!get_listing(session, useMlsd ? "MLSD" : "LIST", path, refresh, list_data, error)) {
+        return false;
+    }
+    entries = useMlsd ? parse_mlsd_response(list_data) : parse_list_response(list_data);
+    return true;
+}
+
 // Upload files recursively from local directory to remote directory
-void ftp_mput_recursive(int controlSock, const std::string& local_directory, const std::string& remote_directory = "") {
-    if (controlSock == INVALID_SOCKET) {
+void ftp_mput_recursive(FtpSession& session, const std::string& local_directory, const std::string& remote_directory = "") {
+    if (!session.is_open()) {
         cout << "Not connected to a server.\n";
         write_log("RPUT failed - Not connected to server");
         return;
     }
 
-    if (!g_passive_mode_preference) {
+    if (!session.passive) {
         cout << "Error: Recursive upload requires passive mode.\n";
         write_log("RPUT failed - Passive mode required");
         return;
@@ -1033,79 +4941,209 @@ void ftp_mput_recursive(int controlSock, const std::string& local_directory, con
         }
     }
 
-    // Save current remote directory to restore later
-    string original_remote_dir;
-    char buffer[1024] = { 0 };
-    send(controlSock, "PWD\r\n", 5, 0);
-    int bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        size_t firstQuote = string(buffer).find('"');
-        size_t lastQuote = string(buffer).rfind('"');
-        if (firstQuote != string::npos && lastQuote != string::npos && lastQuote > firstQuote) {
-            original_remote_dir = string(buffer).substr(firstQuote + 1, lastQuote - firstQuote - 1);
-        }
-    }
-
-    // Create remote directory if specified
-    if (!remote_directory.empty()) {
-        create_remote_directory_recursive(controlSock, remote_directory);
-        ftp_cd(controlSock, remote_directory);
+    // Every file goes below this remote directory (the current one if none was given)
+    string remote_base = resolve_remote_path(session, remote_directory);
+    if (remote_base.empty()) {
+        cout << "Cannot resolve remote directory: " << remote_directory << endl;
+        write_log("RPUT failed - Cannot resolve remote directory: " + remote_directory);
+        return;
     }
 
     fs::path base_path(local_directory);
-    int success_count = 0;
-    int failed_count = 0;
 
+    // Create each remote directory of the tree once, shallowest first, before the first upload
+    set<string> remote_dirs = { remote_base };
     for (const auto& file_path : files) {
-        fs::path full_path(file_path);
-        fs::path relative_path = fs::relative(full_path, base_path);
-
-        // Create subdirectories on server if needed
+        fs::path relative_path = fs::relative(fs::path(file_path), base_path);
         if (relative_path.has_parent_path()) {
             string parent_dir = relative_path.parent_path().string();
             replace(parent_dir.begin(), parent_dir.end(), '\\', '/');
-            create_remote_directory_recursive(controlSock, parent_dir);
-            ftp_cd(controlSock, parent_dir);
+            remote_dirs.insert(remote_base + (remote_base == "/" ? "" : "/") + parent_dir);
         }
+    }
+    if (!ensure_remote_directories(session, vector<string>(remote_dirs.begin(), remote_dirs.end()))) {
+        cout << "Warning: some remote directories could not be created (see log).\n";
+    }
 
-        // Upload file
-        cout << "Uploading: " << relative_path.string() << endl;
-
-        // Change to the local file's directory
-        fs::path old_local_path = fs::current_path();
-        fs::current_path(full_path.parent_path());
-
-        string filename = relative_path.filename().string();
-        ftp_put(controlSock, filename);
+    int success_count = 0;
+    int failed_count = 0;
 
-        // Restore local directory
-        fs::current_path(old_local_path);
+    for (const auto& file_path : files) {
+        fs::path relative_path = fs::relative(fs::path(file_path), base_path);
+        string remote_relative = relative_path.string();
+        replace(remote_relative.begin(), remote_relative.end(), '\\', '/');
 
-        // Return to the target remote directory
-        if (!remote_directory.empty()) {
-            ftp_cd(controlSock, remote_directory);
+        // Store by full path: no CWD on the server and no chdir locally
+        cout << "Uploading: " << relative_path.string() << endl;
+        if (ftp_put(session, file_path, remote_base + (remote_base == "/" ? "" : "/") + remote_relative)) {
+            success_count++;
         }
         else {
-            ftp_cd(controlSock, "/");
+            failed_count++;
         }
-
-        success_count++;
     }
 
     cout << "Recursive upload completed: " << success_count << "/" << files.size() << " files uploaded\n";
     write_log("RPUT completed - " + to_string(success_count) + "/" + to_string(files.size()) + " files uploaded, " + to_string(failed_count) + " failed");
 }
 
+// Work item of a parallel rget: a remote directory to list or a remote file to download
+struct TreeTask {
+    bool is_directory = false;
+    string remote_path; // Absolute
+    string local_path;
+};
+
+// Tasks of a parallel rget shared by all workers. Directories are handed out before files, so
+// listing runs ahead of the downloads and keeps the file queue filled
+class TreeWorkQueue {
+public:
+    void push(TreeTask task) {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            (task.is_directory ? m_directories : m_files).push_back(move(task));
+        }
+        m_ready.notify_one();
+    }
+
+    // Wait for the next task. Returns false once both queues are empty and no worker is still
+    // listing a directory that could add more
+    bool pop(TreeTask& task) {
+        unique_lock<mutex> lock(m_mutex);
+        m_ready.wait(lock, [this]() { return !m_directories.empty() || !m_files.empty() || m_active == 0; });
+        deque<TreeTask>& source = !m_directories.empty() ? m_directories : m_files;
+        if (source.empty()) return false;
+        task = move(source.front());
+        source.pop_front();
+        m_active++;
+        return true;
+    }
+
+    // Mark the task taken by pop() as finished
+    void done() {
+        bool finished;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_active--;
+            finished = (m_active == 0 && m_directories.empty() && m_files.empty());
+        }
+        if (finished) m_ready.notify_all();
+    }
+
+private:
+    mutex m_mutex;
+    condition_variable m_ready;
+    deque<TreeTask> m_directories;
+    deque<TreeTask> m_files;
+    int m_active = 0; // Tasks popped but not done yet
+};
+
+// Download a remote tree over `jobs` pooled sessions. Every worker lists directories and downloads
+// files with absolute remote and local paths, so no session or process working directory changes
+void ftp_mget_recursive_parallel(FtpSession& session, const string& remote_directory, const string& local_directory, int jobs) {
+    string remoteRoot = resolve_remote_path(session, remote_directory);
+    if (remoteRoot.empty()) {
+        cout << "Cannot resolve remote directory: " << remote_directory << endl;
+        write_log("RGET failed - Cannot resolve remote directory: " + remote_directory);
+        return;
+    }
+
+    TraceSpan span("rget", remoteRoot);
+    TreeWorkQueue tasks;
+    tasks.push({ true, remoteRoot, local_directory });
+
+    mutex resultsMutex;
+    vector<TransferResult> results;
+    atomic<long long> totalBytes{ 0 };
+    atomic<int> directoryCount{ 0 };
+
+    cout << "Downloading " << remoteRoot << " over " << jobs << " connections...\n";
+    auto start = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    for (int w = 0; w < jobs; w++) {
+        workers.emplace_back([&]() {
+            string error;
+            unique_ptr<FtpSession> worker = g_session_pool.acquire(session, "", error);
+            if (!worker) {
+                write_log("Worker session failed - " + error);
+                return;
+            }
+
+            TreeTask task;
+            while (tasks.pop(task)) {
+                TransferResult result;
+                result.filename = task.remote_path;
+                if (task.is_directory) {
+                    vector<DirEntry> entries;
+                    try {
+                        fs::create_directories(task.local_path);
+                        result.ok = list_directory(*worker, task.remote_path, entries, error);
+                        if (!result.ok) result.output = "Could not list directory: " + error;
+                    }
+                    catch (const fs::filesystem_error& e) {
+                        result.output = string("Could not create local directory: ") + e.what();
+                    }
+                    for (const DirEntry& entry : entries) {
+                        string remotePath = task.remote_path + (task.remote_path == "/" ? "" : "/") + entry.name;
+                        string localPath = (fs::path(task.local_path) / entry.name).string();
+                        tasks.push({ entry.is_directory, remotePath, localPath });
+                    }
+                    directoryCount++;
+                    if (!result.ok) {
+                        result.filename += "/";
+                        lock_guard<mutex> lock(resultsMutex);
+                        results.push_back(move(result));
+                    }
+                }
+                else {
+                    run_captured(result, [&]() { return ftp_get(*worker, task.remote_path, task.local_path); });
+                    if (result.ok) {
+                        error_code ec;
+                        uintmax_t size = fs::file_size(task.local_path, ec);
+                        if (!ec) totalBytes += static_cast<long long>(size);
+                    }
+                    lock_guard<mutex> lock(resultsMutex);
+                    results.push_back(move(result));
+                }
+                tasks.done();
+            }
+            g_session_pool.release(move(worker));
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (directoryCount == 0) {
+        cout << "No worker session could be opened.\n";
+        write_log("RGET failed - No worker session available");
+        return;
+    }
+
+    int okCount = report_transfer_results(results);
+    int fileCount = 0;
+    for (const TransferResult& result : results) {
+        if (result.filename.empty() || result.filename.back() != '/') fileCount++;
+    }
+    int failedCount = static_cast<int>(results.size()) - okCount;
+    cout << "\nRecursive download completed: " << okCount << "/" << fileCount << " files downloaded (" << totalBytes
+        << " bytes) from " << directoryCount << " directories in " << fixed << setprecision(2) << seconds << " s"
+        << defaultfloat << ", " << failedCount << " failed\n";
+    write_log("RGET completed - " + to_string(okCount) + " files downloaded, " + to_string(totalBytes) + " bytes, " +
+        to_string(failedCount) + " failed over " + to_string(jobs) + " connections");
+}
+
 // Download files recursively from remote directory to local directory
-void ftp_mget_recursive(int controlSock, const std::string& remote_directory, const std::string& local_directory = ".") {
-    if (controlSock == INVALID_SOCKET) {
+void ftp_mget_recursive(FtpSession& session, const std::string& remote_directory, const std::string& local_directory = ".", int jobs = 1) {
+    if (!session.is_open()) {
         cout << "Not connected to a server.\n";
         write_log("RGET failed - Not connected to server");
         return;
     }
 
-    if (!g_passive_mode_preference) {
+    if (!session.passive) {
         cout << "Error: Recursive download requires passive mode.\n";
         write_log("RGET failed - Passive mode required");
         return;
@@ -1113,6 +5151,11 @@ void ftp_mget_recursive(int controlSock, const std::string& remote_directory, co
 
     write_log("Recursive download started - Remote: " + remote_directory + ", Local: " + local_directory);
 
+    if (jobs > 1) {
+        ftp_mget_recursive_parallel(session, remote_directory, local_directory, jobs);
+        return;
+    }
+
     // Create local directory if it doesn't exist
     try {
         fs::create_directories(local_directory);
@@ -1123,86 +5166,40 @@ void ftp_mget_recursive(int controlSock, const std::string& remote_directory, co
         return;
     }
 
-    // Save current remote directory to restore later
-    string original_remote_dir;
-    char buffer[1024] = { 0 };
-    send(controlSock, "PWD\r\n", 5, 0);
-    int bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-    if (bytesReceived > 0) {
-        buffer[bytesReceived] = '\0';
-        size_t firstQuote = string(buffer).find('"');
-        size_t lastQuote = string(buffer).rfind('"');
-        if (firstQuote != string::npos && lastQuote != string::npos && lastQuote > firstQuote) {
-            original_remote_dir = string(buffer).substr(firstQuote + 1, lastQuote - firstQuote - 1);
-        }
+    // Every directory is listed and every file retrieved by its absolute path, so neither the
+    // remote nor the local working directory changes during the download
+    string remote_base = resolve_remote_path(session, remote_directory);
+    if (remote_base.empty()) {
+        cout << "Cannot resolve remote directory: " << remote_directory << endl;
+        write_log("RGET failed - Cannot resolve remote directory: " + remote_directory);
+        return;
     }
 
+    TraceSpan span("rget", remote_base);
+
     // Use queue for directory traversal
     queue<pair<string, string>> dir_queue; // {remote_path, local_path}
-    dir_queue.push({ remote_directory, local_directory });
+    dir_queue.push({ remote_base, local_directory });
     int file_count = 0;
     int failed_count = 0;
+    long long total_bytes = 0;
 
     while (!dir_queue.empty()) {
         auto [current_remote, current_local] = dir_queue.front();
         dir_queue.pop();
 
-        // Change to remote directory
-        ftp_cd(controlSock, current_remote);
-
-        // Get directory listing
-        send(controlSock, "PASV\r\n", 6, 0);
-        bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-        if (bytesReceived <= 0) {
-            cout << "No PASV response for directory: " << current_remote << endl;
-            write_log("RGET failed - No PASV response for directory: " + current_remote);
-            continue;
-        }
-        buffer[bytesReceived] = '\0';
-        string ip;
-        int port;
-        if (!parsePasvResponse(buffer, ip, port)) {
-            cout << "Failed to parse PASV response for directory: " << current_remote << endl;
-            write_log("RGET failed - Failed to parse PASV response for directory: " + current_remote);
-            continue;
-        }
-
-        SOCKET dataSock = connectToServer(ip.c_str(), port);
-        if (dataSock == INVALID_SOCKET) {
-            cout << "Failed to open data connection for directory: " << current_remote << endl;
-            write_log("RGET failed - Failed to open data connection for directory: " + current_remote);
+        // Get directory listing (MLSD when available, so names, types and sizes need no guessing)
+        vector<DirEntry> entries;
+        string error;
+        if (!list_directory(session, current_remote, entries, error)) {
+            cout << "Failed to list directory: " << current_remote << " - " << error << endl;
+            write_log("RGET failed - Could not list directory: " + current_remote + " - " + error);
+            failed_count++;
             continue;
         }
 
-        send(controlSock, "LIST\r\n", 6, 0);
-        bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-        if (bytesReceived > 0) {
-            buffer[bytesReceived] = '\0';
-            cout << "Server: " << buffer;
-        }
-
-        // Collect LIST output
-        string list_data;
-        while ((bytesReceived = recv(dataSock, buffer, sizeof(buffer) - 1, 0)) > 0) {
-            buffer[bytesReceived] = '\0';
-            list_data += buffer;
-        }
-        closesocket(dataSock);
-
-        bytesReceived = recv(controlSock, buffer, sizeof(buffer) - 1, 0);
-        if (bytesReceived > 0) {
-            buffer[bytesReceived] = '\0';
-            cout << "Server: " << buffer;
-        }
-
-        // Parse LIST response
-        vector<DirEntry> entries = parse_list_response(list_data);
-
-        // Change to local directory
-        fs::path old_local_path = fs::current_path();
         try {
             fs::create_directories(current_local);
-            fs::current_path(current_local);
         }
         catch (const fs::filesystem_error& e) {
             cout << "Error creating/accessing local directory: " << current_local << " - " << e.what() << endl;
@@ -1221,23 +5218,22 @@ void ftp_mget_recursive(int controlSock, const std::string& remote_directory, co
             }
             else {
                 // Download file
-                cout << "Downloading: " << remote_path << " to " << local_path << endl;
-                ftp_get(controlSock, entry.name);
-                file_count++;
+                cout << "Downloading: " << remote_path << " to " << local_path;
+                if (entry.size >= 0) cout << " (" << entry.size << " bytes)";
+                cout << endl;
+                if (ftp_get(session, remote_path, local_path)) {
+                    file_count++;
+                    total_bytes += max<long long>(entry.size, 0);
+                }
+                else {
+                    failed_count++;
+                }
             }
         }
-
-        // Restore local directory
-        fs::current_path(old_local_path);
-    }
-
-    // Restore original remote directory
-    if (!original_remote_dir.empty()) {
-        ftp_cd(controlSock, original_remote_dir);
     }
 
-    cout << "Recursive download completed: " << file_count << " files downloaded, " << failed_count << " failed\n";
-    write_log("RGET completed - " + to_string(file_count) + " files downloaded, " + to_string(failed_count) + " failed");
+    cout << "Recursive download completed: " << file_count << " files downloaded (" << total_bytes << " bytes), " << failed_count << " failed\n";
+    write_log("RGET completed - " + to_string(file_count) + " files downloaded, " + to_string(total_bytes) + " bytes, " + to_string(failed_count) + " failed");
 }
 
 // help command: display available commands
@@ -1254,31 +5250,45 @@ void display_help() {
     cout << "  ascii                - Set transfer mode to ASCII" << endl;
     cout << "  binary               - Set transfer mode to binary" << endl;
     cout << "  passive              - Toggle passive mode on/off" << endl;
+    cout << "  set bufsize <n>[K|M] - Set transfer buffer size (e.g. 256K, 4M)" << endl;
+    cout << "  set pipeline on|off  - Scan and upload in one read pass; infected uploads are deleted" << endl;
+    cout << "  set pipeline hidden  - Same, but upload to a hidden name and rename it once the scan is clean" << endl;
+    cout << "  set cachettl <sec>   - Reuse directory listings for this long (0 disables the cache)" << endl;
+    cout << "  set timeout <sec>    - Give up on a connect or a stalled transfer after this long" << endl;
+    cout << "  set logfile <path>   - Write the log to another file" << endl;
+    cout << "  set scancache <file>|off - Reuse scan verdicts of unchanged files across runs" << endl;
+    cout << "  scanner [agent|clamd <ip:port>|clamd unix:<path>] - Scan uploads with the ClamAV Agent or directly with clamd" << endl;
+    cout << "  pool [warm N|clear]  - Show, pre-open or close the extra sessions of parallel transfers" << endl;
+    cout << "  stats [json [file]|reset] - Show command latencies, transfer phases and throughput" << endl;
+    cout << "  trace on [file]|off  - Record transfer phases as Chrome trace events (chrome://tracing)" << endl;
     cout << "" << endl;
 
     cout << "Directory Commands:" << endl;
-    cout << "  ls                   - List files in current remote directory" << endl;
+    cout << "  ls [-f]              - List files in current remote directory (-f: bypass the listing cache)" << endl;
     cout << "  pwd                  - Show current remote directory" << endl;
     cout << "  cd <directory>       - Change remote directory" << endl;
     cout << "  lcd <directory>      - Change local directory" << endl;
     cout << "  lpwd                 - Show current local directory" << endl;
     cout << "  mkdir <directory>    - Create directory on server" << endl;
     cout << "  rmdir <directory>    - Remove directory on server" << endl;
+    cout << "  mmkdir <dir1> [dir2] - Create several directories in one pipelined batch" << endl;
     cout << "" << endl;
 
     cout << "File Operations:" << endl;
     cout << "  get <filename>       - Download file from server" << endl;
+    cout << "  pget <filename> [-n N] - Download one file over N connections (default 4)" << endl;
     cout << "  put <filename>       - Upload file to server (with ClamAV scan)" << endl;
-    cout << "  mget <file1> [file2] - Download multiple files" << endl;
-    cout << "  mput <file1> [file2] - Upload multiple files" << endl;
+    cout << "  mget [-j N] <file1> [file2] - Download multiple files, N in parallel" << endl;
+    cout << "  mput [-j N] <file1> [file2] - Upload multiple files, N scanned and uploaded in parallel" << endl;
     cout << "  delete <filename>    - Delete file on server" << endl;
+    cout << "  mdelete <file1> [file2] - Delete several files in one pipelined batch" << endl;
     cout << "  rename <old> <new>   - Rename file on server" << endl;
-    cout << "  rget <remote_dir> [local_dir] - Recursively download directory" << endl;
+    cout << "  rget [-j N] <remote_dir> [local_dir] - Recursively download directory, N connections in parallel" << endl;
     cout << "  rput <local_dir> [remote_dir] - Recursively upload directory" << endl;
     cout << "" << endl;
 
     cout << "Other Commands:" << endl;
-    cout << "  prompt               - Toggle confirmation prompts for mget/mput" << endl;
+    cout << "  prompt               - Toggle confirmation prompts for mget/mput/mdelete" << endl;
     cout << "  help/?               - Display this help message" << endl;
     cout << "============================" << endl;
 
@@ -1294,10 +5304,8 @@ void ftp_prompt_toggle() {
 
 // Enhanced logging function to create log file if it doesn't exist
 void initialize_log() {
-    ofstream logFile(g_log_filename, ios::app);
-    if (logFile.is_open()) {
-        logFile << "\n[" << get_timestamp() << "] ========== FTP CLIENT SESSION START ==========" << endl;
-        logFile.close();
+    if (g_logger.start(g_log_filename)) {
+        write_log("========== FTP CLIENT SESSION START ==========");
         cout << "Log file initialized: " << g_log_filename << endl;
     }
     else {
@@ -1305,13 +5313,10 @@ void initialize_log() {
     }
 }
 
-// Function to close log session
+// Function to close log session; returns once every queued message is in the file
 void finalize_log() {
-    ofstream logFile(g_log_filename, ios::app);
-    if (logFile.is_open()) {
-        logFile << "[" << get_timestamp() << "] ========== FTP CLIENT SESSION END ==========" << endl;
-        logFile.close();
-    }
+    write_log("========== FTP CLIENT SESSION END ==========");
+    g_logger.stop();
 }
 
 // Enhanced version of existing log functions for better file transfer and scan logging
@@ -1419,11 +5424,43 @@ void process_command(const string& input) {
     else if (command == "prompt") {
         ftp_prompt_toggle();
     }
+    else if (command == "pool") {
+        string action;
+        int count = 0;
+        iss >> action >> count;
+        ftp_pool(action, count);
+    }
+    else if (command == "stats") {
+        string action, filename;
+        iss >> action;
+        getline(iss >> ws, filename);
+        ftp_stats(action, filename);
+    }
+    else if (command == "trace") {
+        string action, filename;
+        iss >> action;
+        getline(iss >> ws, filename);
+        ftp_trace(action, filename);
+    }
+    else if (command == "scanner") {
+        string kind, target;
+        iss >> kind;
+        getline(iss >> ws, target);
+        ftp_scanner(kind, target);
+    }
+    else if (command == "set") {
+        string option, value;
+        iss >> option >> value;
+        transform(option.begin(), option.end(), option.begin(), ::tolower);
+        ftp_set(option, value);
+    }
     else if (command == "ls" || command == "dir") {
-        ftp_ls(static_cast<int>(g_control_sockfd));
+        string option;
+        iss >> option;
+        ftp_ls(g_session, option == "-f");
     }
     else if (command == "pwd") {
-        ftp_pwd(static_cast<int>(g_control_sockfd));
+        ftp_pwd(g_session);
     }
     else if (command == "lpwd") {
         ftp_lpwd();
@@ -1436,7 +5473,7 @@ void process_command(const string& input) {
             log_command("CD", "Failed - No directory specified");
         }
         else {
-            ftp_cd(static_cast<int>(g_control_sockfd), directory);
+            ftp_cd(g_session, directory);
         }
     }
     else if (command == "lcd") {
@@ -1458,7 +5495,7 @@ void process_command(const string& input) {
             log_command("MKDIR", "Failed - No directory specified");
         }
         else {
-            ftp_mkdir(static_cast<int>(g_control_sockfd), directory);
+            ftp_mkdir(g_session, directory);
         }
     }
     else if (command == "rmdir") {
@@ -1469,7 +5506,7 @@ void process_command(const string& input) {
             log_command("RMDIR", "Failed - No directory specified");
         }
         else {
-            ftp_rmdir(static_cast<int>(g_control_sockfd), directory);
+            ftp_rmdir(g_session, directory);
         }
     }
     else if (command == "delete" || command == "del") {
@@ -1480,7 +5517,24 @@ void process_command(const string& input) {
             log_command("DELETE", "Failed - No filename specified");
         }
         else {
-            ftp_delete(static_cast<int>(g_control_sockfd), filename);
+            ftp_delete(g_session, filename);
+        }
+    }
+    else if (command == "mdelete" || command == "mmkdir") {
+        vector<string> names;
+        string name;
+        while (iss >> name) {
+            names.push_back(name);
+        }
+        if (names.empty()) {
+            cout << "Usage: " << command << (command == "mdelete" ? " <filename1> [filename2] ..." : " <directory1> [directory2] ...") << endl;
+            log_command(command == "mdelete" ? "MDELETE" : "MMKDIR", "Failed - No names specified");
+        }
+        else if (command == "mdelete") {
+            ftp_mdelete(g_session, names);
+        }
+        else {
+            ftp_mmkdir(g_session, names);
         }
     }
     else if (command == "rename" || command == "ren") {
@@ -1491,7 +5545,7 @@ void process_command(const string& input) {
             log_command("RENAME", "Failed - Missing filename(s)");
         }
         else {
-            ftp_rename(static_cast<int>(g_control_sockfd), oldname, newname);
+            ftp_rename(g_session, oldname, newname);
         }
     }
     else if (command == "get" || command == "recv") {
@@ -1502,7 +5556,22 @@ void process_command(const string& input) {
             log_command("GET", "Failed - No filename specified");
         }
         else {
-            ftp_get(static_cast<int>(g_control_sockfd), filename);
+            ftp_get(g_session, filename);
+        }
+    }
+    else if (command == "pget") {
+        string filename, option;
+        int connections = 4;
+        iss >> filename;
+        if (iss >> option && option == "-n") {
+            iss >> connections;
+        }
+        if (filename.empty() || connections < 1 || connections > MAX_PARALLEL_CONNECTIONS) {
+            cout << "Usage: pget <filename> [-n N] (1 <= N <= " << MAX_PARALLEL_CONNECTIONS << ")" << endl;
+            log_command("PGET", "Failed - Invalid arguments");
+        }
+        else {
+            ftp_pget(g_session, filename, connections);
         }
     }
     else if (command == "put" || command == "send") {
@@ -1513,35 +5582,45 @@ void process_command(const string& input) {
             log_command("PUT", "Failed - No filename specified");
         }
         else {
-            ftp_put(static_cast<int>(g_control_sockfd), filename);
+            ftp_put(g_session, filename);
         }
     }
     else if (command == "mget") {
         vector<string> filenames;
         string filename;
+        int jobs = 1;
         while (iss >> filename) {
+            if (filename == "-j" && filenames.empty()) {
+                iss >> jobs;
+                continue;
+            }
             filenames.push_back(filename);
         }
-        if (filenames.empty()) {
-            cout << "Usage: mget <filename1> [filename2] ..." << endl;
-            log_command("MGET", "Failed - No filenames specified");
+        if (filenames.empty() || jobs < 1 || jobs > MAX_PARALLEL_CONNECTIONS) {
+            cout << "Usage: mget [-j N] <filename1> [filename2] ... (1 <= N <= " << MAX_PARALLEL_CONNECTIONS << ")" << endl;
+            log_command("MGET", "Failed - Invalid arguments");
         }
         else {
-            ftp_mget(static_cast<int>(g_control_sockfd), filenames);
+            ftp_mget(g_session, filenames, jobs);
         }
     }
     else if (command == "mput") {
         vector<string> filenames;
         string filename;
+        int jobs = 1;
         while (iss >> filename) {
+            if (filename == "-j" && filenames.empty()) {
+                iss >> jobs;
+                continue;
+            }
             filenames.push_back(filename);
         }
-        if (filenames.empty()) {
-            cout << "Usage: mput <filename1> [filename2] ..." << endl;
-            log_command("MPUT", "Failed - No filenames specified");
+        if (filenames.empty() || jobs < 1 || jobs > MAX_PARALLEL_CONNECTIONS) {
+            cout << "Usage: mput [-j N] <filename1> [filename2] ... (1 <= N <= " << MAX_PARALLEL_CONNECTIONS << ")" << endl;
+            log_command("MPUT", "Failed - Invalid arguments");
         }
         else {
-            ftp_mput(static_cast<int>(g_control_sockfd), filenames);
+            ftp_mput(g_session, filenames, jobs);
         }
     }
     else if (command == "user") {
@@ -1559,13 +5638,17 @@ void process_command(const string& input) {
         // For production, consider using platform-specific hidden input
         getline(cin, password);
 
-        if (g_control_sockfd == INVALID_SOCKET) {
+        if (!g_session.is_open()) {
             cout << "Not connected to a server." << endl;
             log_command("USER", "Failed - Not connected");
         }
         else {
-            sendCommand(static_cast<int>(g_control_sockfd), "USER " + username + "\r\n");
-            sendCommand(static_cast<int>(g_control_sockfd), "PASS " + password + "\r\n");
+            sendCommand(g_session, "USER " + username + "\r\n");
+            sendCommand(g_session, "PASS " + password + "\r\n");
+            g_username = username;
+            g_password = password;
+            // Pooled sessions are still logged in as the previous user
+            g_session_pool.clear();
             log_command("USER", "Login attempt for user: " + username);
         }
     }
@@ -1579,23 +5662,26 @@ void process_command(const string& input) {
         else {
             // Remove leading whitespace
             raw_command.erase(0, raw_command.find_first_not_of(" \t"));
-            if (g_control_sockfd == INVALID_SOCKET) {
+            if (!g_session.is_open()) {
                 cout << "Not connected to a server." << endl;
                 log_command("QUOTE", "Failed - Not connected");
             }
             else {
-                sendCommand(static_cast<int>(g_control_sockfd), raw_command + "\r\n");
+                sendCommand(g_session, raw_command + "\r\n");
+                g_session.cwd.clear(); // A raw CWD/CDUP may have moved the session
+                g_listing_cache.clear(); // A raw command may also have changed directories
+                g_known_remote_dirs.clear();
                 log_command("QUOTE", "Sent raw command: " + raw_command);
             }
         }
     }
     else if (command == "system") {
-        if (g_control_sockfd == INVALID_SOCKET) {
+        if (!g_session.is_open()) {
             cout << "Not connected to a server." << endl;
             log_command("SYSTEM", "Failed - Not connected");
         }
         else {
-            sendCommand(static_cast<int>(g_control_sockfd), "SYST\r\n");
+            sendCommand(g_session, "SYST\r\n");
             log_command("SYSTEM", "Requested system information");
         }
     }
@@ -1607,38 +5693,43 @@ void process_command(const string& input) {
             log_command("SIZE", "Failed - No filename specified");
         }
         else {
-            if (g_control_sockfd == INVALID_SOCKET) {
+            if (!g_session.is_open()) {
                 cout << "Not connected to a server." << endl;
                 log_command("SIZE", "Failed - Not connected");
             }
             else {
-                sendCommand(static_cast<int>(g_control_sockfd), "SIZE " + filename + "\r\n");
+                sendCommand(g_session, "SIZE " + filename + "\r\n");
                 log_command("SIZE", "Requested size for: " + filename);
             }
         }
     }
     else if (command == "noop") {
-        if (g_control_sockfd == INVALID_SOCKET) {
+        if (!g_session.is_open()) {
             cout << "Not connected to a server." << endl;
             log_command("NOOP", "Failed - Not connected");
         }
         else {
-            sendCommand(static_cast<int>(g_control_sockfd), "NOOP\r\n");
+            sendCommand(g_session, "NOOP\r\n");
             log_command("NOOP", "Sent NOOP command");
         }
     }
     else if (command == "rget") {
         std::string remote_dir, local_dir;
-        iss >> remote_dir >> local_dir;
+        int jobs = 1;
+        iss >> remote_dir;
+        if (remote_dir == "-j") {
+            iss >> jobs >> remote_dir;
+        }
+        iss >> local_dir;
 
-        if (remote_dir.empty()) {
-            cout << "Usage: rget <remote_directory> [local_directory]\n";
+        if (remote_dir.empty() || jobs < 1 || jobs > MAX_PARALLEL_CONNECTIONS) {
+            cout << "Usage: rget [-j N] <remote_directory> [local_directory] (1 <= N <= " << MAX_PARALLEL_CONNECTIONS << ")\n";
             return;
         }
 
         if (local_dir.empty()) local_dir = ".";
 
-        ftp_mget_recursive(static_cast<int>(g_control_sockfd), remote_dir, local_dir);
+        ftp_mget_recursive(g_session, remote_dir, local_dir, jobs);
     }
     else if (command == "rput") {
         std::string local_dir, remote_dir;
@@ -1649,7 +5740,7 @@ void process_command(const string& input) {
             return;
         }
 
-        ftp_mput_recursive(static_cast<int>(g_control_sockfd), local_dir, remote_dir);
+        ftp_mput_recursive(g_session, local_dir, remote_dir);
     }
     else {
         cout << "Unknown command: " << command << endl;
@@ -1660,6 +5751,7 @@ void process_command(const string& input) {
 
 // Refactored main function
 int main() {
+#ifdef _WIN32
     // Initialize Winsock
     WSADATA wsaData;
     int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
@@ -1667,10 +5759,15 @@ int main() {
         cerr << "WSAStartup failed: " << result << endl;
         return 1;
     }
+#else
+    // A server closing a data connection mid-transfer must fail send(), not kill the client
+    signal(SIGPIPE, SIG_IGN);
+#endif
 
     // Initialize logging
     initialize_log();
     write_log("FTP Client application started");
+    g_verdict_cache.open(g_scan_cache_filename);
 
     cout << "=== FTP Client ===" << endl;
     cout << "Type 'help' or '?' for available commands" << endl;
@@ -1705,16 +5802,23 @@ int main() {
     cout << "\nClosing FTP client..." << endl;
 
     // Close any open connection
-    if (g_control_sockfd != INVALID_SOCKET) {
+    if (g_session.is_open()) {
         ftp_close();
     }
 
+    // Finish an active trace file
+    if (g_tracer.enabled()) {
+        ftp_trace("off", "");
+    }
+
     // Finalize logging
     write_log("FTP Client application terminated");
     finalize_log();
 
+#ifdef _WIN32
     // Cleanup Winsock
     WSACleanup();
+#endif
 
     cout << "Goodbye!" << endl;
     return 0;
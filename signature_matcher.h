@@ -0,0 +1,25 @@
+﻿#pragma once
+#include <string>
+#include <algorithm>
+
+// Finds the EICAR test string in contents fed a buffer at a time, also across buffer boundaries.
+// The built-in engine of clamav_agent and the stand-in agent of ftp_bench both scan with it
+class SignatureMatcher {
+public:
+    void feed(const char* data, size_t length) {
+        static const std::string signature = "EICAR-STANDARD-ANTIVIRUS-TEST-FILE";
+        size_t tail = signature.size() - 1;
+        m_carried.append(data, std::min<size_t>(length, tail));
+        m_found = m_found || m_carried.find(signature) != std::string::npos;
+        m_found = m_found || std::search(data, data + length, signature.begin(), signature.end()) != data + length;
+        // The last `tail` bytes of everything fed so far, however short the buffers were
+        if (length >= tail) m_carried.assign(data + length - tail, tail);
+        else if (m_carried.size() > tail) m_carried.erase(0, m_carried.size() - tail);
+    }
+
+    bool found() const { return m_found; }
+
+private:
+    std::string m_carried; // End of the contents fed so far
+    bool m_found = false;
+};